@@ -10,6 +10,27 @@ static_assert(sizeof(double) == 8, "double must be 64 bits");
 static_assert(std::numeric_limits<float>::is_iec559, "IEEE 754 float required");
 static_assert(std::numeric_limits<double>::is_iec559, "IEEE 754 double required");
 
+// CRC32 implementation: 1 for the classic byte-at-a-time loop with a 1 KiB
+// table, 8 or 16 for slicing-by-N with N KiB of tables. Defaults to 8 on
+// 64-bit hosts and 1 everywhere else, such as microcontrollers.
+#ifndef MSGLITE_CRC32_SLICES
+#if UINTPTR_MAX > 0xFFFFFFFF
+#define MSGLITE_CRC32_SLICES 8
+#else
+#define MSGLITE_CRC32_SLICES 1
+#endif
+#endif
+static_assert(MSGLITE_CRC32_SLICES == 1 || MSGLITE_CRC32_SLICES == 8 || MSGLITE_CRC32_SLICES == 16, "MSGLITE_CRC32_SLICES must be 1, 8 or 16");
+
+// On x86 with gcc or clang, large inputs are folded with the carry-less
+// multiply (PCLMULQDQ) instruction if the CPU supports it, checked at
+// runtime. Define MSGLITE_CRC32_NO_CLMUL to always use the table loop.
+#if !defined(MSGLITE_CRC32_NO_CLMUL) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MSGLITE_CRC32_CLMUL
+#include <atomic>
+#include <immintrin.h>
+#endif
+
 #ifdef MSGLITE_BOUND_CHECKING
 #include <cassert>
 #define Assert(x, msg) assert((x) && msg)
@@ -17,6 +38,12 @@ static_assert(std::numeric_limits<double>::is_iec559, "IEEE 754 double required"
 #define Assert(x, msg)
 #endif
 
+#ifdef MSGLITE_UNPACKER_STATS
+#define Count(counter, n) (counters.counter += (n))
+#else
+#define Count(counter, n) ((void)0)
+#endif
+
 // Helper functions and classes
 namespace {
     // Helper function for bool checking
@@ -253,66 +280,292 @@ namespace {
         0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
         0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
     };
-    uint32_t crc32b(uint32_t crc, ReadonlySlice buf)
+
+    using MsgLite::Internal::index_list;
+    using MsgLite::Internal::make_index_list;
+
+#if MSGLITE_CRC32_SLICES > 1
+    // Tables for slicing-by-N, generated at compile time.
+    //
+    // Entry n of table k is the CRC of byte n followed by k zero bytes, so
+    // table 0 is the same as crc32_table.
+    constexpr uint32_t crc32_shift_bit(uint32_t crc, int bits)
+    {
+        return bits == 0 ? crc : crc32_shift_bit((crc >> 1) ^ (0xEDB88320 & (0U - (crc & 1))), bits - 1);
+    }
+    constexpr uint32_t crc32_zero_byte(uint32_t crc)
+    {
+        return (crc >> 8) ^ crc32_shift_bit(crc & 0xFF, 8);
+    }
+    constexpr uint32_t crc32_slice_entry(size_t k, uint32_t n)
+    {
+        return k == 0 ? crc32_shift_bit(n, 8) : crc32_zero_byte(crc32_slice_entry(k - 1, n));
+    }
+    static_assert(crc32_slice_entry(0, 0x01) == 0x77073096, "CRC32 table mismatch");
+    static_assert(crc32_slice_entry(0, 0xFF) == 0x2d02ef8d, "CRC32 table mismatch");
+
+    struct crc32_slice_tables {
+        uint32_t entry[MSGLITE_CRC32_SLICES][256];
+    };
+    template <size_t... Is>
+    constexpr crc32_slice_tables make_crc32_slice_tables(index_list<Is...>)
+    {
+        return crc32_slice_tables { { crc32_slice_entry(Is / 256, Is % 256)... } };
+    }
+    constexpr crc32_slice_tables crc32_slices = make_crc32_slice_tables(make_index_list<MSGLITE_CRC32_SLICES * 256>::type());
+#endif
+
+#ifdef MSGLITE_CRC32_CLMUL
+    // Folds len bytes (a multiple of 16, at least 64) into the CRC register
+    // with carry-less multiplications, then does a Barrett reduction.
+    //
+    // Constants are for the reflected polynomial 0xEDB88320, see "Fast CRC
+    // Computation for Generic Polynomials Using PCLMULQDQ Instruction" by
+    // Gopal et al., Intel, 2009.
+    __attribute__((target("pclmul,sse4.1"))) uint32_t crc32_clmul(uint32_t crc, const uint8_t* buf, size_t len)
+    {
+        const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+        const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+        const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+        const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+        const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+        __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+        x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+        x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+        x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+        x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+        x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+        buf += 64;
+        len -= 64;
+
+        // Fold 4 x 128 bits at a time.
+        x0 = k1k2;
+        while (len >= 64) {
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+            x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+            x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+            x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+            x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(buf + 0x00)));
+            x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(buf + 0x10)));
+            x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(buf + 0x20)));
+            x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(buf + 0x30)));
+            buf += 64;
+            len -= 64;
+        }
+
+        // Fold into 128 bits.
+        x0 = k3k4;
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+        // Fold 128 bits at a time.
+        while (len >= 16) {
+            x2 = _mm_loadu_si128((const __m128i*)buf);
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+            buf += 16;
+            len -= 16;
+        }
+
+        // Fold 128 bits into 64 bits.
+        x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+        x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+        x0 = k5k0;
+        x2 = _mm_srli_si128(x1, 4);
+        x1 = _mm_and_si128(x1, mask);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        // Barrett reduction to 32 bits.
+        x0 = poly;
+        x2 = _mm_and_si128(x1, mask);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+        x2 = _mm_and_si128(x2, mask);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        return _mm_extract_epi32(x1, 1);
+    }
+
+    // Checks the CPU once. The cache is an atomic with a constant initializer,
+    // so it needs no guard, and racing threads store the same answer.
+    bool cpu_has_clmul(void)
+    {
+        static std::atomic<int8_t> has_clmul(-1);
+        int8_t cached = has_clmul.load(std::memory_order_relaxed);
+        if (cached < 0) {
+            __builtin_cpu_init();
+            cached = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+            has_clmul.store(cached, std::memory_order_relaxed);
+        }
+        return cached;
+    }
+#endif
+
+    uint32_t crc32b(uint32_t crc, const uint8_t* buf, size_t len)
     {
         crc = crc ^ ~0U;
-        for (int ii = 0; ii < buf.len; ++ii)
-            crc = crc32_table[(crc ^ buf[ii]) & 0xFF] ^ (crc >> 8);
+
+#ifdef MSGLITE_CRC32_CLMUL
+        if (len >= 64 && cpu_has_clmul()) {
+            size_t n = len & ~(size_t)15;
+            crc = crc32_clmul(crc, buf, n);
+            buf += n;
+            len -= n;
+        }
+#endif
+
+#if MSGLITE_CRC32_SLICES > 1
+        const uint32_t(&table)[MSGLITE_CRC32_SLICES][256] = crc32_slices.entry;
+        const int N = MSGLITE_CRC32_SLICES;
+        while (len >= N) {
+            // Little-endian load, regardless of the host byte order.
+            uint32_t x = crc ^ ((uint32_t)buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24);
+            crc = table[N - 1][x & 0xFF] ^ table[N - 2][(x >> 8) & 0xFF] ^ table[N - 3][(x >> 16) & 0xFF] ^ table[N - 4][x >> 24];
+            for (int ii = 4; ii < N; ++ii)
+                crc ^= table[N - 1 - ii][buf[ii]];
+            buf += N;
+            len -= N;
+        }
+#endif
+
+        while (len-- > 0)
+            crc = crc32_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
         return crc ^ ~0U;
     }
+    uint32_t crc32b(uint32_t crc, ReadonlySlice buf)
+    {
+        return crc32b(crc, buf.ptr, buf.len);
+    }
 
-    // See specification of MessagePack.
+    // Descriptor of each type byte, see specification of MessagePack.
     // https://github.com/msgpack/msgpack/blob/master/spec.md
-    int8_t bytes_of_type(uint8_t type_byte)
+    //
+    // The high nibble is the Object type (Untyped if the byte is not a valid
+    // type) and the low nibble the number of payload bytes after it.
+    constexpr uint8_t type_descriptor(size_t type_byte)
     {
-        switch (type_byte) {
-            // Bool (false)
-            case 0xC2:
-                return 0;
-            // Bool (true)
-            case 0xC3:
-                return 0;
-            // Uint8
-            case 0xCC:
-                return 1;
-            // Uint16
-            case 0xCD:
-                return 2;
-            // Uint32
-            case 0xCE:
-                return 4;
-            // Uint64
-            case 0xCF:
-                return 8;
-            // Int8
-            case 0xD0:
-                return 1;
-            // Int16
-            case 0xD1:
-                return 2;
-            // Int32
-            case 0xD2:
-                return 4;
-            // Int64
-            case 0xD3:
-                return 8;
-            // Float
-            case 0xCA:
-                return 4;
-            // Double
-            case 0xCB:
-                return 8;
-            // String and others
-            default: {
-                // String
-                if (0xA0 <= type_byte && type_byte <= 0xAF)
-                    return type_byte - 0xA0;
-
-                // Unknown type
-                return -1;
-            }
-        }
+        using MsgLite::Object;
+        return type_byte == 0xC2 || type_byte == 0xC3 ? Object::Bool << 4
+            : type_byte == 0xCC                     ? Object::Uint8 << 4 | 1
+            : type_byte == 0xCD                     ? Object::Uint16 << 4 | 2
+            : type_byte == 0xCE                     ? Object::Uint32 << 4 | 4
+            : type_byte == 0xCF                     ? Object::Uint64 << 4 | 8
+            : type_byte == 0xD0                     ? Object::Int8 << 4 | 1
+            : type_byte == 0xD1                     ? Object::Int16 << 4 | 2
+            : type_byte == 0xD2                     ? Object::Int32 << 4 | 4
+            : type_byte == 0xD3                     ? Object::Int64 << 4 | 8
+            : type_byte == 0xCA                     ? Object::Float << 4 | 4
+            : type_byte == 0xCB                     ? Object::Double << 4 | 8
+            : type_byte >= 0xA0 && type_byte <= 0xAF ? Object::String << 4 | (type_byte - 0xA0)
+            : type_byte == 0xC4                     ? Object::Binary << 4 | 1
+                                                     : Object::Untyped << 4;
+    }
+    struct type_descriptor_table {
+        uint8_t entry[256];
+    };
+    template <size_t... Is>
+    constexpr type_descriptor_table make_type_descriptor_table(index_list<Is...>)
+    {
+        return type_descriptor_table { { type_descriptor(Is)... } };
+    }
+    constexpr type_descriptor_table type_table = make_type_descriptor_table(make_index_list<256>::type());
+
+    // Type byte and payload bytes of each Object type (0 if not fixed)
+    struct object_descriptor {
+        uint8_t type_byte;
+        uint8_t payload_len;
+    };
+    const object_descriptor object_table[] = {
+        { 0x00, 0 }, // Untyped
+        { 0xC2, 0 }, // Bool, plus its value
+        { 0xCC, 1 }, // Uint8
+        { 0xCD, 2 }, // Uint16
+        { 0xCE, 4 }, // Uint32
+        { 0xCF, 8 }, // Uint64
+        { 0xD0, 1 }, // Int8
+        { 0xD1, 2 }, // Int16
+        { 0xD2, 4 }, // Int32
+        { 0xD3, 8 }, // Int64
+        { 0xCA, 4 }, // Float
+        { 0xCB, 8 }, // Double
+        { 0xA0, 0 }, // String, plus its length
+        { 0xC4, 0 }, // Binary, plus its length byte and bytes
+    };
+
+    // Returns the number of payload bytes after a type byte, -1 if unknown.
+    // For bin8, it is only the length byte, see object_payload().
+    inline int8_t bytes_of_type(uint8_t type_byte)
+    {
+        uint8_t desc = type_table.entry[type_byte];
+        return desc >> 4 == MsgLite::Object::Untyped ? -1 : desc & 0x0F;
+    }
+
+    // Returns the number of payload bytes of a known object at p, once its
+    // bytes_of_type() bytes are there.
+    inline int16_t object_payload(const uint8_t* p)
+    {
+        uint8_t desc = type_table.entry[p[0]];
+        return desc >> 4 == MsgLite::Object::Binary ? 1 + p[1] : desc & 0x0F;
+    }
+
+    // Big-endian loads and stores of unsigned integers of 1, 2, 4 or 8
+    // bytes: one unaligned memcpy, plus a byte swap on little-endian hosts.
+    // Shifts are used if the byte order is unknown at compile time.
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ || __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    inline uint8_t swap_bytes(uint8_t x) { return x; }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    inline uint16_t swap_bytes(uint16_t x) { return __builtin_bswap16(x); }
+    inline uint32_t swap_bytes(uint32_t x) { return __builtin_bswap32(x); }
+    inline uint64_t swap_bytes(uint64_t x) { return __builtin_bswap64(x); }
+#else
+    inline uint16_t swap_bytes(uint16_t x) { return x; }
+    inline uint32_t swap_bytes(uint32_t x) { return x; }
+    inline uint64_t swap_bytes(uint64_t x) { return x; }
+#endif
+    template <typename T>
+    T load_be(const uint8_t* p)
+    {
+        T x;
+        memcpy(&x, p, sizeof(T));
+        return swap_bytes(x);
+    }
+    template <typename T>
+    void store_be(uint8_t* p, T x)
+    {
+        x = swap_bytes(x);
+        memcpy(p, &x, sizeof(T));
+    }
+#else
+    template <typename T>
+    T load_be(const uint8_t* p)
+    {
+        T x = 0;
+        for (size_t ii = 0; ii < sizeof(T); ++ii)
+            x = (T)(x << 8 | p[ii]);
+        return x;
+    }
+    template <typename T>
+    void store_be(uint8_t* p, T x)
+    {
+        for (size_t ii = 0; ii < sizeof(T); ++ii)
+            p[ii] = (uint8_t)(x >> (8 * (sizeof(T) - 1 - ii)));
     }
+#endif
 }
 
 using namespace MsgLite;
@@ -395,41 +648,33 @@ Object::Object(const char* x)
     this->as.String[15] = '\0';
 }
 
+Object::Object(Blob x)
+{
+    this->type = Binary;
+    this->as.Binary = x;
+}
+
+Object::Object(const uint8_t* data, uint8_t len)
+{
+    this->type = Binary;
+    this->as.Binary.data = data;
+    this->as.Binary.len = len;
+}
+
 // Returns byte size after serialization, -1 if invalid type.
-int8_t Object::size() const
+int16_t Object::size() const
 {
-    switch (type) {
-        case Bool:
-            return 1;
-        case Uint8:
-            return 2;
-        case Uint16:
-            return 3;
-        case Uint32:
-            return 5;
-        case Uint64:
-            return 9;
-        case Int8:
-            return 2;
-        case Int16:
-            return 3;
-        case Int32:
-            return 5;
-        case Int64:
-            return 9;
-        case Float:
-            return 5;
-        case Double:
-            return 9;
-        case String: {
-            int len = custom_strnlen(as.String, sizeof(as.String));
-            if (len > 15)
-                return -1; // string too long
-            return 1 + len;
-        }
-        default:
-            return -1; // invalid type
-    }
+    if (type <= Untyped || type > Binary)
+        return -1; // invalid type
+    if (type == Binary)
+        return as.Binary.data || as.Binary.len == 0 ? 2 + as.Binary.len : -1;
+    if (type != String)
+        return 1 + object_table[type].payload_len;
+
+    int len = custom_strnlen(as.String, sizeof(as.String));
+    if (len > 15)
+        return -1; // string too long
+    return 1 + len;
 }
 
 bool MsgLite::operator==(const Object& lhs, const Object& rhs)
@@ -437,10 +682,13 @@ bool MsgLite::operator==(const Object& lhs, const Object& rhs)
     if (lhs.type != rhs.type)
         return false;
 
-    int8_t lhs_size = lhs.size();
+    int16_t lhs_size = lhs.size();
     if (lhs_size < 0 || lhs_size != rhs.size())
         return false;
 
+    if (lhs.type == Object::Binary)
+        return lhs.as.Binary.len == 0 || memcmp(lhs.as.Binary.data, rhs.as.Binary.data, lhs.as.Binary.len) == 0;
+
     if (lhs.type == Object::Bool) {
         if (broken_bool(lhs) || broken_bool(rhs))
             return false;
@@ -556,6 +804,14 @@ bool Object::cast_to(char* x) const // Assumes sizeof(x) >= 16
     }
     return false;
 }
+bool Object::cast_to(Blob& x) const
+{
+    if (type == Binary) {
+        x = as.Binary;
+        return true;
+    }
+    return false;
+}
 
 // Dummy converting functions that do nothing and return false.
 bool Object::cast_to(const bool& x) const
@@ -618,6 +874,11 @@ bool Object::cast_to(const char* x) const
     (void)x;
     return false;
 }
+bool Object::cast_to(const Blob& x) const
+{
+    (void)x;
+    return false;
+}
 
 // Returns byte size after serialization, -1 if invalid message.
 int16_t Message::size() const
@@ -626,25 +887,96 @@ int16_t Message::size() const
     if (len > 15)
         return -1; // message too long
     for (uint8_t ii = 0; ii < len; ++ii) {
-        int8_t obj_size = obj[ii].size();
+        int16_t obj_size = obj[ii].size();
         if (obj_size == -1) {
             return -1; // invalid object
         }
         total_size += obj_size;
     }
+    if (total_size > MAX_MSG_LEN)
+        return -1; // binary objects too long
     return total_size;
 }
 
-// Serializes message and writes bytes to a byte array.
+// Serializes one object to a byte array holding at least obj.size() bytes.
 //
-// Returns length of data if serialization is successful, -1 if fails.
-int16_t MsgLite::Pack(const Message& msg, uint8_t* _raw_buf, uint8_t _len)
+// Returns the number of bytes written, -1 if the object is invalid.
+static int16_t encode_object_at(const Object& obj, uint8_t* buf)
 {
-    Slice buf = Slice(_raw_buf, _len);
+    if (obj.type <= Object::Untyped || obj.type > Object::Binary)
+        return -1; // unknown type
 
-    int16_t msg_size = msg.size();
-    if (msg_size < 0 || msg_size > buf.len)
-        return -1; // invalid message or buffer size is insufficient
+    const object_descriptor& desc = object_table[obj.type];
+    buf[0] = desc.type_byte;
+
+    // Numbers are copied as unsigned integers of the same size.
+    switch (desc.payload_len) {
+        case 1: {
+            buf[1] = obj.as.Uint8;
+            return 2;
+        }
+        case 2: {
+            store_be(buf + 1, obj.as.Uint16);
+            return 3;
+        }
+        case 4: {
+            uint32_t bits;
+            memcpy(&bits, &obj.as, sizeof(bits));
+            store_be(buf + 1, bits);
+            return 5;
+        }
+        case 8: {
+            uint64_t bits;
+            memcpy(&bits, &obj.as, sizeof(bits));
+            store_be(buf + 1, bits);
+            return 9;
+        }
+    }
+
+    if (obj.type == Object::Bool) {
+        if (broken_bool(obj))
+            return -1;
+        buf[0] += obj.as.Bool;
+        return 1;
+    }
+
+    if (obj.type == Object::Binary) {
+        uint8_t n = obj.as.Binary.len;
+        if (n > 0 && obj.as.Binary.data == nullptr)
+            return -1;
+        buf[1] = n;
+        if (n > 0)
+            memcpy(buf + 2, obj.as.Binary.data, n);
+        return 2 + n;
+    }
+
+    int str_len = custom_strnlen(obj.as.String, sizeof(obj.as.String));
+    if (str_len > 15)
+        return -1; // string too long
+    buf[0] += str_len;
+    memcpy(buf + 1, obj.as.String, str_len);
+    return 1 + str_len;
+}
+
+// Serializes one object to a byte array.
+//
+// Returns the number of bytes written, -1 if the object is invalid or does
+// not fit.
+static int16_t encode_object(const Object& obj, Slice buf)
+{
+    int16_t obj_size = obj.size();
+    if (obj_size < 0 || obj_size > buf.len)
+        return -1;
+    return encode_object_at(obj, buf.ptr);
+}
+
+// Serializes message of known size (from Message::size()) to a byte array
+// holding at least that many bytes.
+//
+// Returns length of data if serialization is successful, -1 if fails.
+static int16_t pack_sized(const Message& msg, uint8_t msg_size, uint8_t* _raw_buf)
+{
+    Slice buf = Slice(_raw_buf, msg_size);
 
     uint8_t pos = 0;
 
@@ -661,101 +993,12 @@ int16_t MsgLite::Pack(const Message& msg, uint8_t* _raw_buf, uint8_t _len)
     // Message Length
     buf[pos++] = 0x90 + msg.len;
 
-    // Message Body
+    // Message Body, within msg_size as that is the sum of the object sizes
     for (int ii = 0; ii < msg.len; ii++) {
-        switch (msg.obj[ii].type) {
-            case Object::Bool: {
-                if (broken_bool(msg.obj[ii]))
-                    return -1;
-                buf[pos++] = 0xC2 + msg.obj[ii].as.Bool;
-                break;
-            }
-
-            case Object::Uint8: {
-                buf[pos++] = 0xCC;
-                to_1_bytes(msg.obj[ii].as.Uint8, buf.slice(pos, 1));
-                pos += 1;
-                break;
-            }
-
-            case Object::Uint16: {
-                buf[pos++] = 0xCD;
-                to_2_bytes(msg.obj[ii].as.Uint16, buf.slice(pos, 2));
-                pos += 2;
-                break;
-            }
-
-            case Object::Uint32: {
-                buf[pos++] = 0xCE;
-                to_4_bytes(msg.obj[ii].as.Uint32, buf.slice(pos, 4));
-                pos += 4;
-                break;
-            }
-
-            case Object::Uint64: {
-                buf[pos++] = 0xCF;
-                to_8_bytes(msg.obj[ii].as.Uint64, buf.slice(pos, 8));
-                pos += 8;
-                break;
-            }
-
-            case Object::Int8: {
-                buf[pos++] = 0xD0;
-                to_1_bytes(msg.obj[ii].as.Int8, buf.slice(pos, 1));
-                pos += 1;
-                break;
-            }
-
-            case Object::Int16: {
-                buf[pos++] = 0xD1;
-                to_2_bytes(msg.obj[ii].as.Int16, buf.slice(pos, 2));
-                pos += 2;
-                break;
-            }
-
-            case Object::Int32: {
-                buf[pos++] = 0xD2;
-                to_4_bytes(msg.obj[ii].as.Int32, buf.slice(pos, 4));
-                pos += 4;
-                break;
-            }
-
-            case Object::Int64: {
-                buf[pos++] = 0xD3;
-                to_8_bytes(msg.obj[ii].as.Int64, buf.slice(pos, 8));
-                pos += 8;
-                break;
-            }
-
-            case Object::Float: {
-                buf[pos++] = 0xCA;
-                to_4_bytes(msg.obj[ii].as.Float, buf.slice(pos, 4));
-                pos += 4;
-                break;
-            }
-
-            case Object::Double: {
-                buf[pos++] = 0xCB;
-                to_8_bytes(msg.obj[ii].as.Double, buf.slice(pos, 8));
-                pos += 8;
-                break;
-            }
-
-            case Object::String: {
-                int str_len = custom_strnlen(msg.obj[ii].as.String, sizeof(msg.obj[ii].as.String));
-                if (str_len > 15)
-                    return -1; // string too long
-                buf[pos++] = 0xA0 + str_len;
-                for (int jj = 0; jj < str_len; ++jj)
-                    buf[pos + jj] = msg.obj[ii].as.String[jj];
-                pos += str_len;
-                break;
-            }
-
-            default: {
-                return -1; // unknown type
-            }
-        }
+        int16_t obj_size = encode_object_at(msg.obj[ii], _raw_buf + pos);
+        if (obj_size < 0)
+            return -1;
+        pos += obj_size;
     }
 
     // Checksum (CRC32)
@@ -769,6 +1012,104 @@ int16_t MsgLite::Pack(const Message& msg, uint8_t* _raw_buf, uint8_t _len)
     return pos;
 }
 
+// Serializes message and writes bytes to a byte array.
+//
+// Returns length of data if serialization is successful, -1 if fails.
+int16_t MsgLite::Pack(const Message& msg, uint8_t* buf, uint8_t len)
+{
+    int16_t msg_size = msg.size();
+    if (msg_size < 0 || msg_size > len)
+        return -1; // invalid message or buffer size is insufficient
+    return pack_sized(msg, msg_size, buf);
+}
+
+// Serializes message to a region wrapping from the end of buf to wrap.
+//
+// Returns length of data if serialization is successful, -1 if fails.
+int16_t MsgLite::Pack(const Message& msg, uint8_t* buf, size_t len, uint8_t* wrap, size_t wrap_len)
+{
+    int16_t msg_size = msg.size();
+    if (msg_size < 0 || (size_t)msg_size > len + wrap_len)
+        return -1; // invalid message or buffer size is insufficient
+    if ((size_t)msg_size <= len)
+        return pack_sized(msg, msg_size, buf);
+
+    // Writes bytes at a position of the whole region.
+    auto write = [&](size_t pos, const uint8_t* data, size_t n) {
+        size_t first = pos < len ? len - pos : 0;
+        if (first > n)
+            first = n;
+        memcpy(buf + pos, data, first);
+        if (n > first)
+            memcpy(wrap + pos + first - len, data + first, n - first);
+    };
+
+    // Header, with the checksum filled post-serialization
+    uint8_t header[7] = { 0x92, 0xCE, 0x00, 0x00, 0x00, 0x00, (uint8_t)(0x90 + msg.len) };
+    size_t pos = sizeof(header);
+
+    // Message Body, objects are serialized in place unless they wrap.
+    for (int ii = 0; ii < msg.len; ii++) {
+        const Object& obj = msg.obj[ii];
+        int16_t obj_size = obj.size();
+        int16_t n;
+        if (pos + obj_size <= len) {
+            n = encode_object(obj, Slice(buf + pos, obj_size));
+        } else if (pos >= len) {
+            n = encode_object(obj, Slice(wrap + pos - len, obj_size));
+        } else if (obj.type == Object::Binary) {
+            uint8_t head[2] = { 0xC4, obj.as.Binary.len };
+            write(pos, head, sizeof(head));
+            if (obj.as.Binary.len > 0)
+                write(pos + sizeof(head), obj.as.Binary.data, obj.as.Binary.len);
+            n = obj_size;
+        } else {
+            uint8_t tmp[16];
+            n = encode_object(msg.obj[ii], Slice(tmp, sizeof(tmp)));
+            if (n >= 0)
+                write(pos, tmp, n);
+        }
+        if (n != obj_size)
+            return -1;
+        pos += n;
+    }
+
+    // Checksum (CRC32) of the length byte and the body
+    uint32_t crc = crc32b(0, header + 6, 1);
+    if (len > 7)
+        crc = crc32b(crc, buf + 7, len - 7);
+    size_t body_start = len > 7 ? 0 : 7 - len;
+    crc = crc32b(crc, wrap + body_start, msg_size - len - body_start);
+    to_4_bytes(crc, Slice(header + 2, 4));
+    write(0, header, sizeof(header));
+
+    return msg_size;
+}
+
+// Serializes messages back-to-back to a byte array.
+//
+// Returns the number of messages handled.
+size_t MsgLite::Pack(const Message* msgs, size_t count, uint8_t* buf, size_t len, size_t& written, Frame* frames)
+{
+    written = 0;
+    for (size_t ii = 0; ii < count; ++ii) {
+        int16_t msg_size = msgs[ii].size();
+        if (msg_size >= 0 && (size_t)msg_size > len - written)
+            return ii; // insufficient buffer size, try again later
+
+        int16_t n = -1;
+        if (msg_size >= 0)
+            n = pack_sized(msgs[ii], msg_size, buf + written);
+        if (frames) {
+            frames[ii].offset = written;
+            frames[ii].len = n;
+        }
+        if (n > 0)
+            written += n;
+    }
+    return count;
+}
+
 // Serializes message and writes bytes to a buffer.
 //
 // Returns true if successful, false if packing fails.
@@ -781,16 +1122,76 @@ bool MsgLite::Pack(const Message& msg, Buffer& buf)
     return true;
 }
 
-// Low-level function that deserializes message body from a byte array.
+// Decodes one object from a byte array starting at its type byte. The array
+// must hold the whole object, see object_payload(). Binary objects point into
+// the array.
+//
+// Returns false if the type byte is unknown.
+static bool decode_object(ReadonlySlice buf, Object& obj)
+{
+    uint8_t desc = type_table.entry[buf[0]];
+    uint8_t payload_len = desc & 0x0F;
+    Assert(1 + payload_len <= buf.len, "Slice out of bound");
+    const uint8_t* payload = buf.ptr + 1;
+
+    obj.type = (decltype(obj.type))(desc >> 4);
+    switch (obj.type) {
+        case Object::Untyped:
+            return false; // unknown type
+        case Object::Bool: {
+            obj.as.Bool = buf.ptr[0] == 0xC3;
+            return true;
+        }
+        case Object::String: {
+            memcpy(obj.as.String, payload, payload_len);
+            obj.as.String[payload_len] = '\0';
+            return true;
+        }
+        case Object::Binary: {
+            Assert(2 + payload[0] <= buf.len, "Slice out of bound");
+            obj.as.Binary.data = payload + 1;
+            obj.as.Binary.len = payload[0];
+            return true;
+        }
+        default:
+            break;
+    }
+
+    // Numbers are copied as unsigned integers of the same size.
+    switch (payload_len) {
+        case 1: {
+            obj.as.Uint8 = payload[0];
+            break;
+        }
+        case 2: {
+            obj.as.Uint16 = load_be<uint16_t>(payload);
+            break;
+        }
+        case 4: {
+            uint32_t bits = load_be<uint32_t>(payload);
+            memcpy(&obj.as, &bits, sizeof(bits));
+            break;
+        }
+        case 8: {
+            uint64_t bits = load_be<uint64_t>(payload);
+            memcpy(&obj.as, &bits, sizeof(bits));
+            break;
+        }
+    }
+    return true;
+}
+
+// Low-level function that locates objects of a message body in a byte
+// array, without decoding them.
 //
-// Returns three possible values below.
+// Returns four possible values below.
 enum unpack_ll_status {
     unpack_ll_success,
     unpack_ll_need_more_bytes,
     unpack_ll_corrupted,
     unpack_ll_too_many_bytes
 };
-static unpack_ll_status unpack_ll_body(ReadonlySlice buf, Message& msg)
+static unpack_ll_status view_ll_body(ReadonlySlice buf, MessageView& view)
 {
     if (buf.len < MIN_MSG_LEN)
         return unpack_ll_need_more_bytes;
@@ -798,146 +1199,46 @@ static unpack_ll_status unpack_ll_body(ReadonlySlice buf, Message& msg)
     if (buf.len > MAX_MSG_LEN)
         return unpack_ll_too_many_bytes;
 
+    view.data = buf.ptr;
+
     // Skip verifying the header and checksum (6 bytes).
     uint8_t pos = 6;
 
     // Message length
-    msg.len = buf[pos++] - 0x90;
-    if (msg.len > 15)
+    view.len = buf[pos++] - 0x90;
+    if (view.len > 15)
         return unpack_ll_corrupted;
 
     // Message body
-    for (int ii = 0; ii < msg.len; ii++) {
+    for (int ii = 0; ii < view.len; ii++) {
         if (pos + 1 > buf.len)
             return unpack_ll_need_more_bytes;
-        uint8_t type_byte = buf[pos++];
-
-        switch (type_byte) {
-            // Bool (false)
-            case 0xC2: {
-                msg.obj[ii].type = Object::Bool;
-                msg.obj[ii].as.Bool = false;
-                break;
-            }
-            // Bool (true)
-            case 0xC3: {
-                msg.obj[ii].type = Object::Bool;
-                msg.obj[ii].as.Bool = true;
-                break;
-            }
-            // Uint8
-            case 0xCC: {
-                if (pos + 1 > buf.len)
-                    return unpack_ll_need_more_bytes;
-                msg.obj[ii].type = Object::Uint8;
-                from_1_bytes(msg.obj[ii].as.Uint8, buf.slice(pos, 1));
-                pos += 1;
-                break;
-            }
-            // Uint16
-            case 0xCD: {
-                if (pos + 2 > buf.len)
-                    return unpack_ll_need_more_bytes;
-                msg.obj[ii].type = Object::Uint16;
-                from_2_bytes(msg.obj[ii].as.Uint16, buf.slice(pos, 2));
-                pos += 2;
-                break;
-            }
-            // Uint32
-            case 0xCE: {
-                if (pos + 4 > buf.len)
-                    return unpack_ll_need_more_bytes;
-                msg.obj[ii].type = Object::Uint32;
-                from_4_bytes(msg.obj[ii].as.Uint32, buf.slice(pos, 4));
-                pos += 4;
-                break;
-            }
-            // Uint64
-            case 0xCF: {
-                if (pos + 8 > buf.len)
-                    return unpack_ll_need_more_bytes;
-                msg.obj[ii].type = Object::Uint64;
-                from_8_bytes(msg.obj[ii].as.Uint64, buf.slice(pos, 8));
-                pos += 8;
-                break;
-            }
-            // Int8
-            case 0xD0: {
-                if (pos + 1 > buf.len)
-                    return unpack_ll_need_more_bytes;
-                msg.obj[ii].type = Object::Int8;
-                from_1_bytes(msg.obj[ii].as.Int8, buf.slice(pos, 1));
-                pos += 1;
-                break;
-            }
-            // Int16
-            case 0xD1: {
-                if (pos + 2 > buf.len)
-                    return unpack_ll_need_more_bytes;
-                msg.obj[ii].type = Object::Int16;
-                from_2_bytes(msg.obj[ii].as.Int16, buf.slice(pos, 2));
-                pos += 2;
-                break;
-            }
-            // Int32
-            case 0xD2: {
-                if (pos + 4 > buf.len)
-                    return unpack_ll_need_more_bytes;
-                msg.obj[ii].type = Object::Int32;
-                from_4_bytes(msg.obj[ii].as.Int32, buf.slice(pos, 4));
-                pos += 4;
-                break;
-            }
-            // Int64
-            case 0xD3: {
-                if (pos + 8 > buf.len)
-                    return unpack_ll_need_more_bytes;
-                msg.obj[ii].type = Object::Int64;
-                from_8_bytes(msg.obj[ii].as.Int64, buf.slice(pos, 8));
-                pos += 8;
-                break;
-            }
-            // Float
-            case 0xCA: {
-                if (pos + 4 > buf.len)
-                    return unpack_ll_need_more_bytes;
-                msg.obj[ii].type = Object::Float;
-                from_4_bytes(msg.obj[ii].as.Float, buf.slice(pos, 4));
-                pos += 4;
-                break;
-            }
-            // Double
-            case 0xCB: {
-                if (pos + 8 > buf.len)
-                    return unpack_ll_need_more_bytes;
-                msg.obj[ii].type = Object::Double;
-                from_8_bytes(msg.obj[ii].as.Double, buf.slice(pos, 8));
-                pos += 8;
-                break;
-            }
-            // String and others
-            default: {
-                if (0xA0 <= type_byte && type_byte <= 0xAF) {
-                    int str_len = type_byte - 0xA0;
-                    if (pos + str_len > buf.len)
-                        return unpack_ll_need_more_bytes;
-                    msg.obj[ii].type = Object::String;
-                    for (int jj = 0; jj < str_len; ++jj) {
-                        msg.obj[ii].as.String[jj] = buf[pos + jj];
-                    }
-                    msg.obj[ii].as.String[str_len] = '\0';
-                    pos += str_len;
-                    break;
-                }
 
-                // Unknown type
-                return unpack_ll_corrupted;
-            }
-        }
+        int16_t payload_len = bytes_of_type(buf[pos]);
+        if (payload_len < 0)
+            return unpack_ll_corrupted; // unknown type
+        if (pos + 1 + payload_len > buf.len)
+            return unpack_ll_need_more_bytes;
+        payload_len = object_payload(buf.ptr + pos);
+        if (pos + 1 + payload_len > buf.len)
+            return unpack_ll_need_more_bytes;
+
+        view.offset[ii] = pos;
+        pos += 1 + payload_len;
     }
     return pos == buf.len ? unpack_ll_success : unpack_ll_too_many_bytes;
 }
 
+// Low-level function that deserializes message body from a byte array.
+static unpack_ll_status unpack_ll_body(ReadonlySlice buf, Message& msg)
+{
+    MessageView view;
+    unpack_ll_status status = view_ll_body(buf, view);
+    if (status != unpack_ll_success)
+        return status;
+    return Unpack(view, msg) ? unpack_ll_success : unpack_ll_corrupted;
+}
+
 // Deserializes data from a byte array.
 //
 // Returns true if successful, false if unpacking fails.
@@ -973,6 +1274,275 @@ bool MsgLite::Unpack(const Buffer& buf, Message& msg)
     return Unpack(buf.data, buf.len, msg);
 }
 
+// Checks data in a byte array and locates its objects without decoding.
+//
+// Returns true if successful, false if the data is not a valid message.
+bool MsgLite::Unpack(const uint8_t* _raw_buf, uint8_t _len, MessageView& view)
+{
+    ReadonlySlice buf = ReadonlySlice(_raw_buf, _len);
+
+    if (buf.len < MIN_MSG_LEN || buf.len > MAX_MSG_LEN)
+        return false;
+
+    // Header
+    if (buf[0] != 0x92)
+        return false;
+
+    // Checksum
+    if (buf[1] != 0xCE)
+        return false;
+    uint32_t crc_header, crc_body;
+    from_4_bytes(crc_header, buf.slice(2, 4));
+    crc_body = crc32b(0, buf.slice(6));
+    if (crc_body != crc_header)
+        return false;
+
+    // Body
+    return view_ll_body(buf, view) == unpack_ll_success;
+}
+
+// Checks data in a buffer and locates its objects without decoding.
+//
+// Returns true if successful, false if the data is not a valid message.
+bool MsgLite::Unpack(const Buffer& buf, MessageView& view)
+{
+    return Unpack(buf.data, buf.len, view);
+}
+
+// Checks for a message at the start of a byte array that may hold more bytes
+// after it, such as a capture file.
+//
+// Returns the length of the message, 0 if there is none.
+uint8_t MsgLite::FrameLength(const uint8_t* _raw_buf, size_t _len)
+{
+    ReadonlySlice buf = ReadonlySlice(_raw_buf, _len < MAX_MSG_LEN ? _len : MAX_MSG_LEN);
+
+    if (buf.len < MIN_MSG_LEN || buf[0] != 0x92 || buf[1] != 0xCE)
+        return 0;
+
+    // Same walk as view_ll_body(), but the end is found, not given.
+    uint8_t len = buf[6] - 0x90;
+    if (len > 15)
+        return 0;
+    uint8_t pos = 7;
+    for (uint8_t ii = 0; ii < len; ++ii) {
+        if (pos + 1 > buf.len)
+            return 0;
+        int16_t payload_len = bytes_of_type(buf[pos]);
+        if (payload_len < 0 || pos + 1 + payload_len > buf.len)
+            return 0;
+        payload_len = object_payload(buf.ptr + pos);
+        if (pos + 1 + payload_len > buf.len)
+            return 0;
+        pos += 1 + payload_len;
+    }
+
+    uint32_t crc_header;
+    from_4_bytes(crc_header, buf.slice(2, 4));
+    if (crc32b(0, buf.slice(6, pos - 6)) != crc_header)
+        return 0;
+    return pos;
+}
+
+// Decodes all objects of a message view.
+//
+// Returns true if successful, false if the view is invalid.
+bool MsgLite::Unpack(const MessageView& view, Message& msg)
+{
+    if (view.len > 15)
+        return false;
+    msg.len = view.len;
+    for (uint8_t ii = 0; ii < view.len; ++ii) {
+        if (!view.get(ii, msg.obj[ii]))
+            return false;
+    }
+    return true;
+}
+
+// Decodes object ii. Returns false if out of range.
+bool MessageView::get(uint8_t ii, Object& obj) const
+{
+    if (ii >= len)
+        return false;
+    const uint8_t* ptr = data + offset[ii];
+    if (bytes_of_type(ptr[0]) < 0)
+        return false;
+    return decode_object(ReadonlySlice(ptr, 1 + object_payload(ptr)), obj);
+}
+
+// Points str to the characters of String object ii, which are not
+// null-terminated. Returns false if out of range or not a String.
+bool MessageView::get(uint8_t ii, const char*& str, uint8_t& str_len) const
+{
+    if (ii >= len)
+        return false;
+    const uint8_t* ptr = data + offset[ii];
+    if (ptr[0] < 0xA0 || ptr[0] > 0xAF)
+        return false;
+    str = (const char*)ptr + 1;
+    str_len = ptr[0] - 0xA0;
+    return true;
+}
+
+// Stores x as object ii (ii < 15) without changing len.
+//
+// Returns false if x is invalid.
+bool CompactMessage::set(uint8_t ii, const Object& x)
+{
+    if (ii >= 15)
+        return false;
+    return encode_object(x, Slice(obj[ii], sizeof(obj[ii]))) >= 0;
+}
+
+// Converting functions between Message and CompactMessage.
+//
+// Returns false if any object is invalid.
+bool CompactMessage::from(const Message& msg)
+{
+    if (msg.len > 15)
+        return false;
+    CompactMessage tmp;
+    for (uint8_t ii = 0; ii < msg.len; ++ii) {
+        if (!tmp.set(ii, msg.obj[ii]))
+            return false;
+    }
+    tmp.len = msg.len;
+    *this = tmp;
+    return true;
+}
+bool CompactMessage::to(Message& msg) const
+{
+    return Unpack(view(), msg);
+}
+
+// Returns a view of the objects, see MessageView.
+MessageView CompactMessage::view(void) const
+{
+    MessageView view;
+    view.len = len;
+    view.data = obj[0];
+    for (uint8_t ii = 0; ii < len && ii < 15; ++ii)
+        view.offset[ii] = ii * sizeof(obj[ii]);
+    return view;
+}
+
+// Returns byte size after serialization, -1 if invalid message.
+int16_t CompactMessage::size() const
+{
+    int16_t total_size = 7; // header
+    if (len > 15)
+        return -1; // message too long
+    for (uint8_t ii = 0; ii < len; ++ii) {
+        if (bytes_of_type(obj[ii][0]) < 0)
+            return -1; // invalid object
+        int16_t payload_len = object_payload(obj[ii]);
+        if (1 + payload_len > (int16_t)sizeof(obj[ii]))
+            return -1; // invalid object
+        total_size += 1 + payload_len;
+    }
+    return total_size;
+}
+
+bool MsgLite::operator==(const CompactMessage& lhs, const CompactMessage& rhs)
+{
+    if (lhs.len > 15 || lhs.len != rhs.len)
+        return false;
+    for (int ii = 0; ii < lhs.len; ++ii) {
+        if (bytes_of_type(lhs.obj[ii][0]) < 0)
+            return false;
+        int16_t payload_len = object_payload(lhs.obj[ii]);
+        if (1 + payload_len > (int16_t)sizeof(lhs.obj[ii]))
+            return false;
+        if (memcmp(lhs.obj[ii], rhs.obj[ii], 1 + payload_len) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Serializes message and writes bytes to a byte array.
+//
+// Returns length of data if serialization is successful, -1 if fails.
+int16_t MsgLite::Pack(const CompactMessage& msg, uint8_t* _raw_buf, uint8_t _len)
+{
+    Slice buf = Slice(_raw_buf, _len);
+
+    if (msg.len > 15 || buf.len < MIN_MSG_LEN)
+        return -1; // invalid message or buffer size is insufficient
+
+    uint8_t pos = 0;
+
+    // Header, checksum and message length
+    buf[pos++] = 0x92;
+    buf[pos++] = 0xCE;
+    pos += 4; // to be filled post-serialization
+    buf[pos++] = 0x90 + msg.len;
+
+    // Message Body, already serialized
+    for (int ii = 0; ii < msg.len; ii++) {
+        if (bytes_of_type(msg.obj[ii][0]) < 0)
+            return -1; // invalid object
+        int16_t payload_len = object_payload(msg.obj[ii]);
+        if (1 + payload_len > (int16_t)sizeof(msg.obj[ii]) || pos + 1 + payload_len > buf.len)
+            return -1; // invalid object or buffer size is insufficient
+
+        uint8_t obj_size = 1 + payload_len;
+        Slice dst = buf.slice(pos, obj_size);
+        for (uint8_t jj = 0; jj < obj_size; ++jj)
+            dst[jj] = msg.obj[ii][jj];
+        pos += obj_size;
+    }
+
+    // Checksum (CRC32)
+    {
+        uint32_t crc = crc32b(0, buf.slice(6, pos - 6));
+        to_4_bytes(crc, buf.slice(2, 4));
+    }
+
+    return pos;
+}
+
+// Serializes message and writes bytes to a buffer.
+//
+// Returns true if successful, false if packing fails.
+bool MsgLite::Pack(const CompactMessage& msg, Buffer& buf)
+{
+    int16_t len = Pack(msg, buf.data, sizeof(buf.data));
+    if (len < 0)
+        return false;
+    buf.len = (uint8_t)len;
+    return true;
+}
+
+// Deserializes data from a byte array.
+//
+// Returns true if successful, false if unpacking fails.
+bool MsgLite::Unpack(const uint8_t* buf, uint8_t len, CompactMessage& msg)
+{
+    MessageView view;
+    if (!Unpack(buf, len, view))
+        return false;
+
+    CompactMessage tmp;
+    for (uint8_t ii = 0; ii < view.len; ++ii) {
+        const uint8_t* obj = view.data + view.offset[ii];
+        int16_t obj_size = 1 + object_payload(obj);
+        if (obj_size > (int16_t)sizeof(tmp.obj[ii]))
+            return false; // binary object too long
+        memcpy(tmp.obj[ii], obj, obj_size);
+    }
+    tmp.len = view.len;
+    msg = tmp;
+    return true;
+}
+
+// Deserializes data from a buffer.
+//
+// Returns true if successful, false if unpacking fails.
+bool MsgLite::Unpack(const Buffer& buf, CompactMessage& msg)
+{
+    return Unpack(buf.data, buf.len, msg);
+}
+
 // Stream packer constructor
 Packer::Packer(void)
 {
@@ -1005,14 +1575,86 @@ int Packer::get()
         return -1;
 }
 
+// Message builder into a buffer, whose len is set by finish()
+MessageBuilder::MessageBuilder(Buffer& buf)
+    : data(buf.data), len(sizeof(buf.data)), buffer(&buf)
+{
+    reset();
+}
+
+// Message builder into a byte array of len bytes, of which a message uses at
+// most MAX_MSG_LEN
+MessageBuilder::MessageBuilder(uint8_t* buf, uint8_t len)
+    : data(buf), len(len < MAX_MSG_LEN ? len : MAX_MSG_LEN), buffer(nullptr)
+{
+    reset();
+}
+
+// Adds a string of n bytes.
+MessageBuilder& MessageBuilder::add(const char* x, uint8_t n)
+{
+    if (n > 15 || memchr(x, '\0', n) != NULL || count >= 15 || 1 + n > len - pos) {
+        failed = true;
+        return *this;
+    }
+    data[pos++] = 0xA0 + n;
+    memcpy(data + pos, x, n);
+    pos += n;
+    count++;
+    return *this;
+}
+
+// Writes the number of objects and the checksum.
+//
+// Returns length of data if serialization is successful, -1 if fails.
+int16_t MessageBuilder::finish(void)
+{
+    if (failed)
+        return -1;
+
+    Slice buf(data, pos);
+    buf[6] = 0x90 + count;
+    uint32_t crc = crc32b(0, buf.slice(6, pos - 6));
+    to_4_bytes(crc, buf.slice(2, 4));
+
+    if (buffer)
+        buffer->len = pos;
+    return pos;
+}
+
+// Starts another message in the same buffer.
+void MessageBuilder::reset(void)
+{
+    pos = 0;
+    count = 0;
+    failed = len < MIN_MSG_LEN;
+    if (failed)
+        return;
+
+    // Header and checksum type, the rest is filled by finish()
+    data[pos++] = 0x92;
+    data[pos++] = 0xCE;
+    pos = MIN_MSG_LEN;
+}
+
 // Stream unpacker constructor
-Unpacker::Unpacker(uint8_t max_msg_len)
+Unpacker::Unpacker(uint8_t max_msg_len, bool resync)
 {
     buf.len = 0;
     reset_buffer_on_next_put = false;
     if (max_msg_len > MAX_MSG_LEN)
         max_msg_len = MAX_MSG_LEN;
     this->max_msg_len = max_msg_len;
+    this->resync = resync;
+    msg_decoded = true;
+    pending_head = 0;
+    pending_len = 0;
+    clock = nullptr;
+    put_time = feed_time = header_time = pending_time = 0;
+#ifdef MSGLITE_UNPACKER_STATS
+    memset(&counters, 0, sizeof(counters));
+    message_bytes = 0;
+#endif
 }
 
 // 1. Call put() repeatedly to drive the unpacker. It returns true if a
@@ -1022,6 +1664,65 @@ Unpacker::Unpacker(uint8_t max_msg_len)
 // returning true should be immediately followed by a get() to
 // retrieve the message.
 bool Unpacker::put(uint8_t byte)
+{
+    if (clock)
+        put_time = clock();
+    return put_byte(byte);
+}
+
+// Version of put() that also tells when the byte was received.
+bool Unpacker::put(uint8_t byte, uint64_t time)
+{
+    put_time = time;
+    return put_byte(byte);
+}
+
+// Reads the time from a clock function once per call to put().
+void Unpacker::set_clock(uint64_t (*clock)(void))
+{
+    this->clock = clock;
+}
+
+// Returns when the header byte of the message was received.
+uint64_t Unpacker::timestamp(void) const
+{
+    return header_time;
+}
+
+// Puts one byte received at put_time.
+bool Unpacker::put_byte(uint8_t byte)
+{
+    Count(bytes, 1);
+    feed_time = put_time;
+    if (!resync)
+        return feed(byte);
+
+    Slice q(pending, sizeof(pending));
+    if (pending_head == pending_len) {
+        // Nothing queued, skip the queue unless a message gets rejected.
+        uint8_t before = reset_buffer_on_next_put ? 0 : buf.len;
+        if (feed(byte))
+            return true;
+        if (before == 0 || buf.len > before)
+            return false;
+        pending_head = 0;
+        pending_len = 0;
+        q[pending_len++] = byte;
+        requeue(before);
+        return drain();
+    }
+
+    if (pending_len == sizeof(pending)) {
+        memmove(pending, pending + pending_head, pending_len - pending_head);
+        pending_len -= pending_head;
+        pending_head = 0;
+    }
+    q[pending_len++] = byte;
+    return drain();
+}
+
+// Drives the state machine with one byte.
+bool Unpacker::feed(uint8_t byte)
 {
     Slice s(buf.data, sizeof(buf.data));
 
@@ -1030,8 +1731,10 @@ bool Unpacker::put(uint8_t byte)
         reset_buffer_on_next_put = false;
     }
 
-    if (buf.len >= max_msg_len)
+    if (buf.len >= max_msg_len) {
+        Count(too_long, 1);
         buf.len = 0; // failed, reset the unpacker
+    }
 
     switch (buf.len) {
         // Header
@@ -1040,12 +1743,14 @@ bool Unpacker::put(uint8_t byte)
                 buf.len = 0; // failed, reset the unpacker
                 return false;
             }
+            header_time = feed_time;
             s[buf.len++] = byte;
             return false;
         }
         // Checksum
         case 1: {
             if (byte != 0xCE) {
+                Count(bad_header, 1);
                 buf.len = 0; // failed, reset the unpacker
                 return false;
             }
@@ -1068,18 +1773,27 @@ bool Unpacker::put(uint8_t byte)
                 // Message length
                 remaining_objects = byte - 0x90;
                 if (remaining_objects > 15) {
+                    Count(bad_length, 1);
                     buf.len = 0; // failed, reset the unpacker
                     return false;
                 }
                 remaining_bytes = 0;
+                binary_length = false;
             } else {
                 if (remaining_bytes > 0) {
                     remaining_bytes--;
+                    if (binary_length) {
+                        // Length of a bin8 object, its bytes follow
+                        remaining_bytes = byte;
+                        binary_length = false;
+                    }
                 } else {
                     if (remaining_objects > 0) {
                         remaining_objects--;
                         remaining_bytes = bytes_of_type(byte);
+                        binary_length = byte == 0xC4;
                         if (remaining_bytes < 0) {
+                            Count(unknown_type, 1);
                             buf.len = 0; // failed, reset the unpacker
                             return false;
                         }
@@ -1094,6 +1808,176 @@ bool Unpacker::put(uint8_t byte)
         }
     }
 
+    return complete();
+}
+
+// Bulk version of put() that consumes bytes from a byte array.
+//
+// Returns true if a message has been deserialized, consumed is set to the
+// number of bytes used.
+bool Unpacker::put(const uint8_t* data, size_t len, size_t& consumed)
+{
+    if (clock)
+        put_time = clock();
+    return put_bytes(data, len, consumed);
+}
+
+// Version of put() that also tells when the bytes were received.
+bool Unpacker::put(const uint8_t* data, size_t len, size_t& consumed, uint64_t time)
+{
+    put_time = time;
+    return put_bytes(data, len, consumed);
+}
+
+// Puts bytes received at put_time.
+bool Unpacker::put_bytes(const uint8_t* data, size_t len, size_t& consumed)
+{
+    size_t pos = 0;
+
+    while (pos < len) {
+        if (pending_head < pending_len) {
+            // Rescan bytes left over by resync first.
+            if (drain()) {
+                consumed = pos;
+                return true;
+            }
+            continue;
+        }
+
+        if (reset_buffer_on_next_put) {
+            buf.len = 0;
+            reset_buffer_on_next_put = false;
+        }
+
+        if (buf.len >= max_msg_len) {
+            Count(too_long, 1);
+            if (resync) {
+                // Payload copied in bulk may hold another header byte.
+                requeue(buf.len);
+                continue;
+            }
+            buf.len = 0; // failed, reset the unpacker
+        }
+
+        if (buf.len == 0) {
+            // Skip garbage until the next header byte.
+            const void* header = memchr(data + pos, 0x92, len - pos);
+            if (header == NULL) {
+                Count(bytes, len - pos);
+                pos = len;
+                break;
+            }
+            Count(bytes, (const uint8_t*)header - data - pos);
+            pos = (const uint8_t*)header - data;
+        } else if (buf.len > 6 && remaining_bytes > 0 && !binary_length) {
+            // Copy the rest of an object's payload at once.
+            size_t n = remaining_bytes;
+            if (n > len - pos)
+                n = len - pos;
+            if (n > (size_t)(max_msg_len - buf.len))
+                n = max_msg_len - buf.len;
+
+            Slice s = Slice(buf.data, sizeof(buf.data)).slice(buf.len, n);
+            memcpy(s.ptr, data + pos, n);
+            crc_body = crc32b(crc_body, s);
+            uint8_t before = buf.len;
+            buf.len += n;
+            remaining_bytes -= n;
+            pos += n;
+            Count(bytes, n);
+
+            if (complete()) {
+                consumed = pos;
+                return true;
+            }
+            if (resync && buf.len == 0)
+                requeue(before + n);
+            continue;
+        }
+
+        if (put_byte(data[pos++])) {
+            consumed = pos;
+            return true;
+        }
+    }
+
+    consumed = pos;
+    return false;
+}
+
+// Feeds the bytes still queued at the end of a stream, then those of a
+// message cut off by it, returns true if a message is ready.
+bool Unpacker::flush(void)
+{
+    if (!resync)
+        return false;
+
+    while (!drain()) {
+        if (reset_buffer_on_next_put || buf.len == 0)
+            return false;
+        requeue(buf.len);
+    }
+    return true;
+}
+
+// Feeds queued bytes in resync mode, returns true if a message is ready.
+//
+// A message rejected while feeding a byte has its bytes after the header
+// queued again, so another header inside them still gets tried.
+bool Unpacker::drain(void)
+{
+    feed_time = pending_time;
+    while (pending_head < pending_len) {
+        uint8_t before = reset_buffer_on_next_put ? 0 : buf.len;
+
+        if (feed(pending[pending_head++]))
+            return true;
+
+        if (before > 0 && buf.len <= before) {
+            // Rejected, rescan the buffered bytes and the current one.
+            pending_head--;
+            requeue(before);
+            feed_time = pending_time;
+        }
+    }
+
+    pending_head = 0;
+    pending_len = 0;
+    return false;
+}
+
+// Resets the buffer and queues its first len bytes (except the header) in
+// front of the pending bytes.
+void Unpacker::requeue(uint8_t len)
+{
+    buf.len = 0;
+
+    // Queued bytes did not arrive before the rejected header byte.
+    pending_time = header_time;
+
+    // Nothing before the next header byte can start a message.
+    const uint8_t* start = (const uint8_t*)memchr(buf.data + 1, 0x92, len - 1);
+    if (start == NULL)
+        return;
+    uint8_t n = buf.data + len - start;
+
+    if (pending_head >= n) {
+        pending_head -= n;
+    } else {
+        uint8_t rest = pending_len - pending_head;
+        Assert(n + rest <= sizeof(pending), "Pending bytes out of bound");
+        memmove(pending + n, pending + pending_head, rest);
+        pending_head = 0;
+        pending_len = n + rest;
+    }
+    memcpy(pending + pending_head, start, n);
+}
+
+// Validates the buffered bytes, returns true if a message is ready.
+bool Unpacker::complete(void)
+{
+    Slice s(buf.data, sizeof(buf.data));
+
     if (buf.len < MIN_MSG_LEN)
         return false; // still too short
 
@@ -1101,18 +1985,47 @@ bool Unpacker::put(uint8_t byte)
         return false; // message not fully received
 
     if (crc_header != crc_body) {
+        if (remaining_objects < 0)
+            Count(bad_length, 1); // below 0x90, rejected by the next byte
+        else
+            Count(crc_mismatch, 1);
         return false; // checksum mismatch
     }
 
-    unpack_ll_status status = unpack_ll_body(s.slice(0, buf.len), msg);
+    // Objects are only located here, get() decodes them on demand.
+    unpack_ll_status status = view_ll_body(s.slice(0, buf.len), msg_view);
     if (status == unpack_ll_success) {
+        msg_decoded = false;
         reset_buffer_on_next_put = true;
+        Count(messages, 1);
+#ifdef MSGLITE_UNPACKER_STATS
+        message_bytes += buf.len;
+#endif
         return true;
     }
+    Count(body_rejected, 1);
     buf.len = 0; // reset the unpacker
     return false;
 }
 
+// Returns a snapshot of the diagnostic counters, see UnpackerStats.
+UnpackerStats Unpacker::stats(void) const
+{
+    UnpackerStats snapshot;
+#ifdef MSGLITE_UNPACKER_STATS
+    snapshot = counters;
+
+    // Bytes still buffered may become part of a message.
+    uint32_t in_flight = pending_len - pending_head;
+    if (!reset_buffer_on_next_put)
+        in_flight += buf.len;
+    snapshot.bytes_discarded = counters.bytes - message_bytes - in_flight;
+#else
+    memset(&snapshot, 0, sizeof(snapshot));
+#endif
+    return snapshot;
+}
+
 // 2. Retrieve a reference to the message. If this function does not
 // follow a put() returning true, the return message can be anything.
 //
@@ -1120,9 +2033,34 @@ bool Unpacker::put(uint8_t byte)
 // change it.
 const Message& Unpacker::get(void)
 {
+    if (reset_buffer_on_next_put && !msg_decoded) {
+        Unpack(view(), msg);
+        msg_decoded = true;
+    }
     return msg;
 }
 
+// 2. (Alternative) Decode the message into a message owned by the caller, such
+// as a free slot of a queue. Returns false if no message is available.
+bool Unpacker::get(Message& out)
+{
+    if (!reset_buffer_on_next_put)
+        return false;
+    if (msg_decoded) {
+        out = msg;
+        return true;
+    }
+    return Unpack(view(), out);
+}
+
+// 2. (Alternative) Retrieve a view of the message, without decoding it. Same
+// as get(), it is only valid until the next call to put().
+const MessageView& Unpacker::view(void)
+{
+    msg_view.data = buf.data;
+    return msg_view;
+}
+
 bool MsgLite::operator==(const Message& lhs, const Message& rhs)
 {
     if (lhs.len > 15 || lhs.len != rhs.len)
@@ -1136,5 +2074,600 @@ bool MsgLite::operator==(const Message& lhs, const Message& rhs)
 // Exposed checksum function used by MsgLite
 uint32_t MsgLite::CRC32B(uint32_t crc, const uint8_t* raw_buf, size_t size)
 {
-    return crc32b(crc, ReadonlySlice(raw_buf, size));
+    return crc32b(crc, raw_buf, size);
+}
+
+// Multiplies two polynomials modulo the CRC32 polynomial (bit-reflected).
+static uint32_t crc32_multiply(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+    for (uint32_t bit = 1U << 31; bit != 0; bit >>= 1) {
+        if (a & bit)
+            product ^= b;
+        b = (b >> 1) ^ (0xEDB88320 & (0U - (b & 1)));
+    }
+    return product;
+}
+
+// Combines checksums of two adjacent chunks, see zlib's crc32_combine().
+uint32_t MsgLite::CRC32B_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+    // Shift crc1 by len2 zero bytes, i.e. multiply it by x^(8 * len2).
+    uint32_t shift = 1U << 31; // x^0
+    uint32_t square = 1U << 23; // x^8
+    while (len2 > 0) {
+        if (len2 & 1)
+            shift = crc32_multiply(shift, square);
+        square = crc32_multiply(square, square);
+        len2 >>= 1;
+    }
+    return crc32_multiply(shift, crc1) ^ crc2;
+}
+
+#ifdef MSGLITE_LARGE_MESSAGES
+// Locates objects of a large message body in a byte array, without checking
+// the header and checksum.
+//
+// Returns true if the body is valid and ends exactly at len.
+static bool view_large_body(const uint8_t* buf, size_t len, LargeMessageView& view)
+{
+    if (len < MIN_MSG_LEN || len > LARGE_MAX_MSG_LEN)
+        return false;
+
+    view.data = buf;
+
+    // Number of objects, fixarray or array16
+    size_t pos = 6;
+    if (buf[pos] >= 0x90 && buf[pos] <= 0x9F) {
+        view.len = buf[pos++] - 0x90;
+    } else if (buf[pos] == 0xDC && len >= 9) {
+        view.len = load_be<uint16_t>(buf + pos + 1);
+        pos += 3;
+    } else {
+        return false;
+    }
+
+    // Message body, each object takes at least one byte
+    for (size_t ii = 0; ii < view.len; ii++) {
+        if (pos >= len)
+            return false;
+
+        size_t payload_len;
+        if (buf[pos] == 0xD9 || buf[pos] == 0xC4) {
+            if (pos + 1 >= len)
+                return false;
+            payload_len = 1 + buf[pos + 1]; // str8 or bin8
+        } else {
+            int8_t n = bytes_of_type(buf[pos]);
+            if (n < 0)
+                return false; // unknown type
+            payload_len = n;
+        }
+        if (payload_len >= len - pos)
+            return false;
+
+        Assert(ii < LARGE_MAX_OBJECTS, "Offset out of bound");
+        view.offset[ii] = pos;
+        pos += 1 + payload_len;
+    }
+    return pos == len;
+}
+
+// Decodes object ii, Binary objects point into data. Returns false if out of
+// range, or if it is a string longer than an Object can hold.
+bool LargeMessageView::get(size_t ii, Object& obj) const
+{
+    if (ii >= len)
+        return false;
+    const uint8_t* ptr = data + offset[ii];
+    if (ptr[0] == 0xD9) {
+        uint8_t str_len = ptr[1];
+        if (str_len > 15)
+            return false;
+        obj.type = Object::String;
+        memcpy(obj.as.String, ptr + 2, str_len);
+        obj.as.String[str_len] = '\0';
+        return true;
+    }
+    if (ptr[0] == 0xC4) {
+        obj.type = Object::Binary;
+        obj.as.Binary.data = ptr + 2;
+        obj.as.Binary.len = ptr[1];
+        return true;
+    }
+    int8_t payload_len = bytes_of_type(ptr[0]);
+    if (payload_len < 0)
+        return false;
+    return decode_object(ReadonlySlice(ptr, 1 + payload_len), obj);
+}
+
+// Points str to the characters of string object ii. Returns false if out of
+// range or not a string.
+bool LargeMessageView::get(size_t ii, const char*& str, size_t& str_len) const
+{
+    if (ii >= len)
+        return false;
+    const uint8_t* ptr = data + offset[ii];
+    if (ptr[0] >= 0xA0 && ptr[0] <= 0xAF) {
+        str = (const char*)ptr + 1;
+        str_len = ptr[0] - 0xA0;
+        return true;
+    }
+    if (ptr[0] == 0xD9) {
+        str = (const char*)ptr + 2;
+        str_len = ptr[1];
+        return true;
+    }
+    return false;
+}
+
+// Serializes count objects as one large message to a byte array.
+//
+// Returns length of data, 0 if an object is invalid or it does not fit.
+size_t MsgLite::Pack(const Object* objs, size_t count, uint8_t* buf, size_t len)
+{
+    if (count > 0xFFFF)
+        return 0;
+
+    size_t header_len = count > 15 ? 9 : 7;
+    size_t msg_size = header_len;
+    for (size_t ii = 0; ii < count; ++ii) {
+        int16_t obj_size = objs[ii].size();
+        if (obj_size < 0)
+            return 0; // invalid object
+        msg_size += obj_size;
+    }
+    if (msg_size > len || msg_size > LARGE_MAX_MSG_LEN)
+        return 0; // buffer size is insufficient or message too long
+
+    // Header and number of objects
+    buf[0] = 0x92;
+    buf[1] = 0xCE;
+    if (count > 15) {
+        buf[6] = 0xDC;
+        store_be(buf + 7, (uint16_t)count);
+    } else {
+        buf[6] = 0x90 + count;
+    }
+
+    // Message Body, within msg_size as that is the sum of the object sizes
+    size_t pos = header_len;
+    for (size_t ii = 0; ii < count; ++ii) {
+        int16_t obj_size = encode_object_at(objs[ii], buf + pos);
+        if (obj_size < 0)
+            return 0;
+        pos += obj_size;
+    }
+
+    // Checksum (CRC32)
+    store_be(buf + 2, crc32b(0, buf + 6, pos - 6));
+    return pos;
+}
+
+// Serializes count objects as one large message to a buffer.
+//
+// Returns true if successful, false if packing fails.
+bool MsgLite::Pack(const Object* objs, size_t count, LargeBuffer& buf)
+{
+    size_t len = Pack(objs, count, buf.data, sizeof(buf.data));
+    if (len == 0)
+        return false;
+    buf.len = len;
+    return true;
+}
+
+// Checks a large message in a byte array and locates its objects.
+//
+// Returns true if successful, false if the data is not a valid message.
+bool MsgLite::Unpack(const uint8_t* buf, size_t len, LargeMessageView& view)
+{
+    if (len < MIN_MSG_LEN || len > LARGE_MAX_MSG_LEN)
+        return false;
+
+    // Header
+    if (buf[0] != 0x92 || buf[1] != 0xCE)
+        return false;
+
+    // Checksum
+    if (crc32b(0, buf + 6, len - 6) != load_be<uint32_t>(buf + 2))
+        return false;
+
+    // Body
+    return view_large_body(buf, len, view);
+}
+
+// Checks a large message in a buffer and locates its objects.
+//
+// Returns true if successful, false if the data is not a valid message.
+bool MsgLite::Unpack(const LargeBuffer& buf, LargeMessageView& view)
+{
+    return Unpack(buf.data, buf.len, view);
+}
+
+// Decodes all objects of a large message view into a Message.
+//
+// Returns true if successful, false if they do not fit.
+bool MsgLite::Unpack(const LargeMessageView& view, Message& msg)
+{
+    if (view.len > 15)
+        return false;
+    msg.len = view.len;
+    for (uint8_t ii = 0; ii < view.len; ++ii) {
+        if (!view.get(ii, msg.obj[ii]))
+            return false;
+    }
+    return true;
+}
+
+// Large message builder into a buffer, whose len is set by finish()
+LargeMessageBuilder::LargeMessageBuilder(LargeBuffer& buf)
+    : data(buf.data), len(sizeof(buf.data)), buffer(&buf)
+{
+    reset();
+}
+
+// Large message builder into a byte array of len bytes, of which at most
+// LARGE_MAX_MSG_LEN are used.
+LargeMessageBuilder::LargeMessageBuilder(uint8_t* buf, size_t len)
+    : data(buf), len(len < LARGE_MAX_MSG_LEN ? len : LARGE_MAX_MSG_LEN), buffer(nullptr)
+{
+    reset();
+}
+
+// Counts one more object of n bytes if it fits, fails otherwise.
+bool LargeMessageBuilder::make_room(size_t n)
+{
+    // The 16th object needs two more bytes for an array16 count.
+    size_t count_len = count == 15 ? 2 : 0;
+    if (failed || count >= 0xFFFF || count_len + n > len - pos) {
+        failed = true;
+        return false;
+    }
+    if (count == 15) {
+        memmove(data + 9, data + 7, pos - 7);
+        pos += 2;
+    }
+    count++;
+    return true;
+}
+
+// Adds a null-terminated string of up to 255 bytes.
+LargeMessageBuilder& LargeMessageBuilder::add(const char* x)
+{
+    return add(x, custom_strnlen(x, 256));
+}
+
+LargeMessageBuilder& LargeMessageBuilder::add(char* x)
+{
+    return add((const char*)x);
+}
+
+// Adds a string of n bytes, as fixstr up to 15 bytes and str8 above.
+LargeMessageBuilder& LargeMessageBuilder::add(const char* x, size_t n)
+{
+    size_t header_len = n > 15 ? 2 : 1;
+    if (n > 255 || memchr(x, '\0', n) != NULL) {
+        failed = true;
+        return *this;
+    }
+    if (!make_room(header_len + n))
+        return *this;
+    if (n > 15) {
+        data[pos++] = 0xD9;
+        data[pos++] = n;
+    } else {
+        data[pos++] = 0xA0 + n;
+    }
+    memcpy(data + pos, x, n);
+    pos += n;
+    return *this;
+}
+
+// Writes the number of objects and the checksum.
+//
+// Returns length of data if serialization is successful, 0 if fails.
+size_t LargeMessageBuilder::finish(void)
+{
+    if (failed)
+        return 0;
+
+    if (count > 15) {
+        data[6] = 0xDC;
+        store_be(data + 7, (uint16_t)count);
+    } else {
+        data[6] = 0x90 + count;
+    }
+    store_be(data + 2, crc32b(0, data + 6, pos - 6));
+
+    if (buffer)
+        buffer->len = pos;
+    return pos;
+}
+
+// Starts another message in the same buffer.
+void LargeMessageBuilder::reset(void)
+{
+    pos = 0;
+    count = 0;
+    failed = len < MIN_MSG_LEN;
+    if (failed)
+        return;
+
+    // Header and checksum type, the rest is filled by finish()
+    data[pos++] = 0x92;
+    data[pos++] = 0xCE;
+    pos = MIN_MSG_LEN;
+}
+
+// Large stream unpacker constructor
+LargeUnpacker::LargeUnpacker(size_t max_msg_len, size_t resync_window)
+{
+    buf.len = 0;
+    reset_buffer_on_next_put = false;
+    if (max_msg_len > LARGE_MAX_MSG_LEN)
+        max_msg_len = LARGE_MAX_MSG_LEN;
+    if (resync_window > max_msg_len)
+        resync_window = max_msg_len;
+    this->max_msg_len = max_msg_len;
+    this->resync_window = resync_window;
+    rejected = 0;
+    rejected_byte = false;
+    pending_head = 0;
+    pending_len = 0;
+}
+
+// 1. Call put() repeatedly to drive the unpacker. It returns true if a
+// message has been deserialized (with a CRC32 checksum pass).
+bool LargeUnpacker::put(uint8_t byte)
+{
+    if (pending_head == pending_len) {
+        // Nothing queued, skip the queue unless a frame gets rejected.
+        if (feed(byte))
+            return true;
+        if (rejected == 0)
+            return false;
+        pending_head = 0;
+        pending_len = 0;
+        if (rejected_byte)
+            pending[pending_len++] = byte;
+        requeue();
+        return drain();
+    }
+
+    if (pending_len == sizeof(pending)) {
+        memmove(pending, pending + pending_head, pending_len - pending_head);
+        pending_len -= pending_head;
+        pending_head = 0;
+    }
+    pending[pending_len++] = byte;
+    return drain();
 }
+
+// Drives the state machine with one byte.
+bool LargeUnpacker::feed(uint8_t byte)
+{
+    if (reset_buffer_on_next_put) {
+        buf.len = 0;
+        reset_buffer_on_next_put = false;
+    }
+
+    if (buf.len >= max_msg_len) {
+        reject(false); // too long
+        return false;
+    }
+
+    switch (buf.len) {
+        // Header
+        case 0: {
+            if (byte != 0x92)
+                return false;
+            break;
+        }
+        // Checksum
+        case 1: {
+            if (byte != 0xCE) {
+                reject(false);
+                return false;
+            }
+            break;
+        }
+        case 2:
+        case 3:
+        case 4:
+        case 5:
+            break;
+        // Message length, fixarray or array16
+        case 6: {
+            remaining_bytes = 0;
+            length_next = false;
+            if (byte >= 0x90 && byte <= 0x9F) {
+                remaining_objects = byte - 0x90;
+                count_bytes = 0;
+            } else if (byte == 0xDC) {
+                remaining_objects = 0;
+                count_bytes = 2;
+            } else {
+                reject(false);
+                return false;
+            }
+            break;
+        }
+        // Body
+        default: {
+            if (count_bytes > 0) {
+                remaining_objects = remaining_objects << 8 | byte;
+                count_bytes--;
+            } else if (remaining_bytes > 0) {
+                remaining_bytes--;
+            } else if (length_next) {
+                remaining_bytes = byte;
+                length_next = false;
+            } else if (remaining_objects > 0) {
+                remaining_objects--;
+                int8_t payload_len = bytes_of_type(byte);
+                if (byte == 0xD9 || byte == 0xC4) {
+                    length_next = true; // str8 or bin8
+                } else if (payload_len >= 0) {
+                    remaining_bytes = payload_len;
+                } else {
+                    reject(false); // unknown type
+                    return false;
+                }
+            } else {
+                reject(false); // this should never happen
+                return false;
+            }
+        }
+    }
+
+    buf.data[buf.len++] = byte;
+    return buf.len >= MIN_MSG_LEN && complete();
+}
+
+// Bulk version of put() that consumes bytes from a byte array.
+//
+// Returns true if a message has been deserialized, consumed is set to the
+// number of bytes used.
+bool LargeUnpacker::put(const uint8_t* data, size_t len, size_t& consumed)
+{
+    size_t pos = 0;
+
+    while (pos < len) {
+        if (pending_head < pending_len) {
+            // Rescan bytes left over by resync first.
+            if (drain()) {
+                consumed = pos;
+                return true;
+            }
+            continue;
+        }
+
+        if (reset_buffer_on_next_put) {
+            buf.len = 0;
+            reset_buffer_on_next_put = false;
+        }
+
+        if (buf.len == 0) {
+            // Skip garbage until the next header byte.
+            const void* header = memchr(data + pos, 0x92, len - pos);
+            if (header == NULL) {
+                pos = len;
+                break;
+            }
+            pos = (const uint8_t*)header - data;
+        } else if (buf.len > 6 && remaining_bytes > 0 && buf.len < max_msg_len) {
+            // Copy the rest of an object's payload at once.
+            size_t n = remaining_bytes;
+            if (n > len - pos)
+                n = len - pos;
+            if (n > max_msg_len - buf.len)
+                n = max_msg_len - buf.len;
+
+            memcpy(buf.data + buf.len, data + pos, n);
+            buf.len += n;
+            remaining_bytes -= n;
+            pos += n;
+
+            if (complete()) {
+                consumed = pos;
+                return true;
+            }
+            if (rejected > 0)
+                requeue();
+            continue;
+        }
+
+        if (put(data[pos++])) {
+            consumed = pos;
+            return true;
+        }
+    }
+
+    consumed = pos;
+    return false;
+}
+
+// Feeds queued bytes, returns true if a message is ready.
+bool LargeUnpacker::drain(void)
+{
+    while (pending_head < pending_len) {
+        if (feed(pending[pending_head++]))
+            return true;
+
+        if (rejected > 0) {
+            // Rescan the start of the frame, then the byte if unused.
+            if (rejected_byte)
+                pending_head--;
+            requeue();
+        }
+    }
+
+    pending_head = 0;
+    pending_len = 0;
+    return false;
+}
+
+// Resets the buffer after its bytes got rejected.
+void LargeUnpacker::reject(bool byte_used)
+{
+    rejected = buf.len;
+    rejected_byte = !byte_used;
+    buf.len = 0;
+}
+
+// Queues the bytes of the rejected frame after its header, up to
+// resync_window of them, in front of the pending bytes.
+void LargeUnpacker::requeue(void)
+{
+    size_t n = rejected - 1;
+    if (n > resync_window)
+        n = resync_window;
+    rejected = 0;
+
+    // Nothing before the next header byte can start a message.
+    const uint8_t* start = (const uint8_t*)memchr(buf.data + 1, 0x92, n);
+    if (start == NULL)
+        return;
+    n = buf.data + 1 + n - start;
+
+    if (pending_head >= n) {
+        pending_head -= n;
+    } else {
+        size_t rest = pending_len - pending_head;
+        Assert(n + rest <= sizeof(pending), "Pending bytes out of bound");
+        memmove(pending + n, pending + pending_head, rest);
+        pending_head = 0;
+        pending_len = n + rest;
+    }
+    memcpy(pending + pending_head, start, n);
+}
+
+// Validates the buffered bytes, returns true if a message is ready.
+bool LargeUnpacker::complete(void)
+{
+    if (count_bytes > 0 || length_next || remaining_objects > 0 || remaining_bytes > 0)
+        return false; // message not fully received
+
+    uint32_t crc = load_be<uint32_t>(buf.data + 2);
+    if (crc32b(0, buf.data + 6, buf.len - 6) == crc && view_large_body(buf.data, buf.len, msg_view)) {
+        reset_buffer_on_next_put = true;
+        return true;
+    }
+
+    reject(true); // checksum mismatch
+    return false;
+}
+
+// 2. Retrieve a view of the message. It is only valid until the next call
+// to put().
+const LargeMessageView& LargeUnpacker::view(void)
+{
+    return msg_view;
+}
+
+// 2. (Alternative) Decode the message into a Message, if it fits.
+bool LargeUnpacker::get(Message& msg)
+{
+    return reset_buffer_on_next_put && Unpack(msg_view, msg);
+}
+#endif
@@ -2,9 +2,17 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <type_traits>
 
 namespace MsgLite {
+    // Bytes of a Binary object. They are not owned by the object and must
+    // outlive it, like the bytes behind a MessageView.
+    struct Blob {
+        const uint8_t* data;
+        uint8_t len;
+    };
+
     struct Object {
         enum {
             Untyped, // Default value, not used in real messages
@@ -19,7 +27,8 @@ namespace MsgLite {
             Int64,   // Signed 64-bit integer
             Float,   // 32-bit floating point number
             Double,  // 64-bit floating point number
-            String   // Character array of up to 15 bytes (cannot hold '\0')
+            String,  // Character array of up to 15 bytes (cannot hold '\0')
+            Binary   // Byte array of up to 238 bytes (MessagePack bin8), not copied
         } type;
 
         union {
@@ -35,6 +44,7 @@ namespace MsgLite {
             float Float;
             double Double;
             char String[16];
+            Blob Binary;
         } as;
 
         // Constructors
@@ -51,9 +61,11 @@ namespace MsgLite {
         Object(float x);
         Object(double x);
         Object(const char* x); // String will be trimmed to a maximum of 15 bytes.
+        Object(Blob x);
+        Object(const uint8_t* data, uint8_t len); // Binary, data is not copied
 
         // Returns byte size after serialization, -1 if invalid type.
-        int8_t size() const;
+        int16_t size() const;
 
         // Checks if they are both valid and have same type/value.
         // This ensures that after serialization, they have the same byte array.
@@ -76,6 +88,7 @@ namespace MsgLite {
         bool cast_to(float& x) const;
         bool cast_to(double& x) const;
         bool cast_to(char* x) const; // Assumes sizeof(x) >= 16
+        bool cast_to(Blob& x) const; // Points to the bytes, no copy
 
         // Dummy converting functions that do nothing and return false.
         // They are required by Message::parse().
@@ -91,6 +104,7 @@ namespace MsgLite {
         bool cast_to(const float& x) const;
         bool cast_to(const double& x) const;
         bool cast_to(const char* x) const;
+        bool cast_to(const Blob& x) const;
     };
 
     bool operator==(const Object& lhs, const Object& rhs);
@@ -182,6 +196,82 @@ namespace MsgLite {
 
     bool operator==(const Message& lhs, const Message& rhs);
 
+    // MessageView gives access to a deserialized message without copying it.
+    // It only records where each object starts in the bytes, and decodes an
+    // object when it is asked for.
+    //
+    // The bytes are not owned by the view and must outlive it.
+    struct MessageView {
+        uint8_t len;         // Number of objects
+        const uint8_t* data; // Bytes holding the serialized objects
+        uint8_t offset[15];  // Position of each object's type byte in data
+
+        // Constructor
+        MessageView(void)
+        {
+            len = 0;
+            data = nullptr;
+        }
+
+        // Decodes object ii. Returns false if out of range.
+        bool get(uint8_t ii, Object& obj) const;
+
+        // Decodes object ii and converts it, same as Object::cast_to().
+        template <typename Type>
+        bool get(uint8_t ii, Type& x) const
+        {
+            Object obj;
+            return get(ii, obj) && obj.cast_to(x);
+        }
+
+        // Points str to the characters of String object ii, which are not
+        // null-terminated. Returns false if out of range or not a String.
+        bool get(uint8_t ii, const char*& str, uint8_t& str_len) const;
+
+    private:
+        // Support functions for parse()
+        bool parse_from(uint8_t ii) const
+        {
+            return ii == len; // always true
+        }
+        template <typename Type, typename... Types>
+        bool parse_from(uint8_t ii, Type& first, Types&... others) const
+        {
+            Object obj;
+            if (!get(ii, obj))
+                return false;
+
+            // Const input is used as filter.
+            if (std::is_const<Type>::value) {
+                if (obj == Object(first))
+                    return parse_from(ii + 1, others...);
+                return false;
+            }
+
+            // Non-const input is parsed from message.
+            bool ok = obj.cast_to(first);
+            if (ok)
+                return parse_from(ii + 1, others...);
+            return false;
+        }
+
+    public:
+        // Same as Message::parse(), but only decodes objects until the
+        // first mismatch.
+        bool parse(void) const
+        {
+            return len == 0;
+        }
+        template <typename Type, typename... Types>
+        bool parse(Type& first, Types&... others) const
+        {
+            if (len != 1 + sizeof...(others)) {
+                return false;
+            }
+            return parse_from(0, first, others...);
+        }
+    };
+
     const int MIN_MSG_LEN = (1 + (1 + 4) + (1 + 0));             // = 7
     const int MAX_MSG_LEN = (1 + (1 + 4) + (1 + 15 * (15 + 1))); // = 247
 
@@ -191,6 +281,72 @@ namespace MsgLite {
         uint8_t data[MAX_MSG_LEN];
     };
 
+    // CompactMessage holds the same objects as Message in less memory, 241
+    // instead of 368 bytes, for messages kept in queues or caches.
+    //
+    // Each object is stored as its own serialization: the MessagePack type
+    // byte, which also records the length of a String, followed by up to 15
+    // payload bytes. Sizes are known without strnlen() and packing is a copy.
+    // A Binary object is copied in, so it can hold at most 14 bytes.
+    struct CompactMessage {
+        uint8_t len;
+        uint8_t obj[15][16];
+
+        // Constructors
+        CompactMessage(void)
+        {
+            len = 0;
+        }
+        // The message is left empty (len = 0) if any object is invalid.
+        template <typename Type, typename... Types>
+        explicit CompactMessage(Type first, Types... others)
+        {
+            static_assert(1 + sizeof...(others) <= 15, "The number of objects exceeds the limit.");
+            len = 0;
+            Object tmp[] = { Object(first), Object(others)... };
+            for (uint8_t ii = 0; ii < 1 + sizeof...(others); ii++) {
+                if (!set(ii, tmp[ii]))
+                    return;
+            }
+            len = 1 + sizeof...(others);
+        }
+
+        // Stores x as object ii (ii < 15) without changing len.
+        //
+        // Returns false if x is invalid.
+        bool set(uint8_t ii, const Object& x);
+
+        // Converting functions between Message and CompactMessage.
+        //
+        // Returns false if any object is invalid, leaving this message
+        // unchanged.
+        bool from(const Message& msg);
+        bool to(Message& msg) const;
+
+        // Returns a view of the objects, see MessageView.
+        MessageView view(void) const;
+
+        // Same as get() and parse() of MessageView.
+        template <typename Type>
+        bool get(uint8_t ii, Type& x) const
+        {
+            return view().get(ii, x);
+        }
+        template <typename... Types>
+        bool parse(Types&... args) const
+        {
+            return view().parse(args...);
+        }
+
+        // Returns byte size after serialization, -1 if invalid message.
+        int16_t size() const;
+
+        // Same as operator== of Message.
+        friend bool operator==(const CompactMessage& lhs, const CompactMessage& rhs);
+    };
+
+    bool operator==(const CompactMessage& lhs, const CompactMessage& rhs);
+
     // Serializes message and writes bytes to a byte array.
     //
     // Returns length of data if serialization is successful, -1 if fails.
@@ -201,6 +357,30 @@ namespace MsgLite {
     // Returns true if successful, false if packing fails.
     bool Pack(const Message& msg, Buffer& buf);
 
+    // Serializes message to a region that wraps around the end of a ring
+    // buffer: the first len bytes go to buf and the rest continues at wrap,
+    // such as the start of the ring.
+    //
+    // Returns length of data if serialization is successful, -1 if fails.
+    int16_t Pack(const Message& msg, uint8_t* buf, size_t len, uint8_t* wrap, size_t wrap_len);
+
+    // Where a batch Pack() wrote a message.
+    struct Frame {
+        size_t offset; // Position in the byte array
+        int16_t len;   // Length of data, -1 if the message is invalid
+    };
+
+    // Serializes messages back-to-back to a byte array, so that they can be
+    // sent with a single write. Invalid messages are skipped, and packing
+    // stops at the first message that does not fit in the remaining space.
+    //
+    // written receives the total length of data. If frames is not null,
+    // frames[ii] receives where message ii is, for each message handled.
+    //
+    // Returns the number of messages handled, less than count if the byte
+    // array is full.
+    size_t Pack(const Message* msgs, size_t count, uint8_t* buf, size_t len, size_t& written, Frame* frames = nullptr);
+
     // Deserializes data from a byte array.
     //
     // Returns true if successful, false if unpacking fails.
@@ -211,6 +391,37 @@ namespace MsgLite {
     // Returns true if successful, false if unpacking fails.
     bool Unpack(const Buffer& buf, Message& msg);
 
+    // Checks data in a byte array and locates its objects without decoding.
+    // The view points into the byte array.
+    //
+    // Returns true if successful, false if unpacking fails.
+    bool Unpack(const uint8_t* buf, uint8_t len, MessageView& view);
+
+    // Checks data in a buffer and locates its objects without decoding.
+    // The view points into the buffer.
+    //
+    // Returns true if successful, false if unpacking fails.
+    bool Unpack(const Buffer& buf, MessageView& view);
+
+    // Checks for a message at the start of a byte array that may hold more
+    // bytes after it, such as a capture file. A message is found if and only
+    // if an Unpacker would accept it starting from the first byte.
+    //
+    // Returns the length of the message, 0 if there is none.
+    uint8_t FrameLength(const uint8_t* buf, size_t len);
+
+    // Same as Pack() and Unpack() of Message. A failed Unpack() leaves msg
+    // unchanged, such as for a binary object too long for its slot.
+    int16_t Pack(const CompactMessage& msg, uint8_t* buf, uint8_t len);
+    bool Pack(const CompactMessage& msg, Buffer& buf);
+    bool Unpack(const uint8_t* buf, uint8_t len, CompactMessage& msg);
+    bool Unpack(const Buffer& buf, CompactMessage& msg);
+
+    // Decodes all objects of a message view.
+    //
+    // Returns true if successful, false if the view is invalid.
+    bool Unpack(const MessageView& view, Message& msg);
+
     // Stream packer.
     class Packer {
     public:
@@ -231,6 +442,232 @@ namespace MsgLite {
         uint8_t pos;
     };
 
+    // Contiguous bytes of a PackerQueue, such as one entry of writev()
+    struct Region {
+        const uint8_t* data;
+        size_t len;
+    };
+
+    // Stream packer queueing many messages in a ring of N bytes, so that a
+    // transmitter can take as many bytes as it can send at once:
+    //
+    //     MsgLite::PackerQueue<1024> queue;
+    //     queue.put(msg1);
+    //     queue.put(msg2);
+    //     n = uart_write(buf, queue.get(buf, sizeof(buf)));
+    //
+    // A message is queued whole or not at all. Bytes can also be sent in
+    // place: peek() returns the queued bytes as up to two regions (the ring
+    // may wrap), and consume() drops those sent, even part of a message.
+    template <size_t N>
+    class PackerQueue {
+    public:
+        PackerQueue(void)
+            : head(0), used(0), total_put(0), total_sent(0)
+        {
+        }
+
+        // 1. Serializes a message at the end of the queue.
+        //
+        // Returns false if the message is invalid or there is not enough
+        // space left for it.
+        bool put(const Message& msg)
+        {
+            // Serialized in place, the free space may wrap.
+            size_t tail = (head + used) % N;
+            size_t first = N - used < N - tail ? N - used : N - tail;
+            int16_t len = Pack(msg, ring + tail, first, ring, N - used - first);
+            if (len < 0)
+                return false;
+            used += len;
+            total_put += len;
+            return true;
+        }
+
+        // 1. (Alternative) Queues bytes already serialized, such as a Buffer.
+        //
+        // Returns false if there is not enough space left for them.
+        bool put(const uint8_t* data, size_t len)
+        {
+            if (len > N - used)
+                return false;
+            size_t tail = (head + used) % N;
+            size_t first = len < N - tail ? len : N - tail;
+            memcpy(ring + tail, data, first);
+            memcpy(ring, data + first, len - first);
+            used += len;
+            total_put += len;
+            return true;
+        }
+
+        // 2. Moves up to n bytes to out.
+        //
+        // Returns the number of bytes moved, 0 if the queue is empty.
+        size_t get(uint8_t* out, size_t n)
+        {
+            Region regions[2];
+            uint8_t count = peek(regions);
+            size_t moved = 0;
+            for (uint8_t ii = 0; ii < count && moved < n; ++ii) {
+                size_t len = regions[ii].len < n - moved ? regions[ii].len : n - moved;
+                memcpy(out + moved, regions[ii].data, len);
+                moved += len;
+            }
+            consume(moved);
+            return moved;
+        }
+
+        // 2. (Alternative) Same as Packer::get(), returns one byte or -1 if
+        // the queue is empty.
+        int get(void)
+        {
+            if (used == 0)
+                return -1;
+            uint8_t byte = ring[head];
+            consume(1);
+            return byte;
+        }
+
+        // 2. (Alternative) Returns the queued bytes in order as up to two
+        // regions, without removing them.
+        //
+        // Returns the number of regions, 0 if the queue is empty.
+        uint8_t peek(Region regions[2]) const
+        {
+            if (used == 0)
+                return 0;
+            size_t first = used < N - head ? used : N - head;
+            regions[0].data = ring + head;
+            regions[0].len = first;
+            if (first == used)
+                return 1;
+            regions[1].data = ring;
+            regions[1].len = used - first;
+            return 2;
+        }
+
+        // Removes the first n bytes, after they have been sent from peek()'s
+        // regions. n is the number of bytes actually written, which may end
+        // in the middle of a message.
+        void consume(size_t n)
+        {
+            if (n > used)
+                n = used;
+            head = (head + n) % N;
+            used -= n;
+            total_sent += n;
+            if (used == 0)
+                head = 0; // keeps the next messages in one region
+        }
+
+        // Bytes queued, and bytes of space left
+        size_t size(void) const { return used; }
+        size_t space(void) const { return N - used; }
+
+        // Bytes ever queued and ever removed. A message put() while queued()
+        // becomes x has been fully sent once sent() reaches x.
+        uint64_t queued(void) const { return total_put; }
+        uint64_t sent(void) const { return total_sent; }
+
+    private:
+        uint8_t ring[N];
+        size_t head, used;
+        uint64_t total_put, total_sent;
+    };
+
+    // Double buffer for a DMA transmitter, made of two halves of H bytes
+    // contiguous in memory. Messages are packed into one half (the back)
+    // while the DMA controller sends the other one (the front), and flip()
+    // swaps them when the DMA controller is done with the front.
+    //
+    // With a one-shot DMA, start a transfer of the region flip() returns,
+    // from the transfer complete interrupt or when the DMA is idle:
+    //
+    //     MsgLite::Region next = buffer.flip();
+    //     if (next.len > 0)
+    //         dma_start(next.data, next.len);
+    //
+    // With a circular DMA running over data() in half-transfer mode, call
+    // flip() once before starting the DMA, so that messages go to the second
+    // half while the first one is sent. Then call flip() from both the half
+    // and full transfer interrupts and ignore its result. The DMA always
+    // sends whole halves, so the bytes after the messages of a half are
+    // zeros, which unpackers skip as garbage.
+    //
+    // put() and flip() must not run at the same time, for example the DMA
+    // interrupt should be masked during put().
+    template <size_t H>
+    class DoubleBuffer {
+    public:
+        DoubleBuffer(void)
+            : back(0)
+        {
+            memset(buf, 0, sizeof(buf));
+            used[0] = used[1] = 0;
+        }
+
+        // Serializes a message at the end of the back half.
+        //
+        // Returns false if the message is invalid or there is not enough
+        // space left for it.
+        bool put(const Message& msg)
+        {
+            uint8_t* half = buf + back * H;
+            int16_t len = Pack(msg, half + used[back], H - used[back], nullptr, 0);
+            if (len < 0)
+                return false;
+            used[back] += len;
+            return true;
+        }
+
+        // Makes the back half the front one, and returns its bytes to send.
+        // The old front half is cleared for the next messages.
+        Region flip(void)
+        {
+            uint8_t front = back;
+            back ^= 1;
+            memset(buf + back * H, 0, used[back]);
+            used[back] = 0;
+
+            Region region;
+            region.data = buf + front * H;
+            region.len = used[front];
+            return region;
+        }
+
+        // Bytes waiting in the back half
+        size_t size(void) const { return used[back]; }
+
+        // Both halves, for a circular DMA
+        const uint8_t* data(void) const { return buf; }
+        static constexpr size_t capacity = 2 * H;
+
+    private:
+        uint8_t buf[2 * H];
+        size_t used[2];
+        uint8_t back;
+    };
+
+    // Snapshot of an Unpacker's diagnostic counters. They are only kept if
+    // MSGLITE_UNPACKER_STATS is defined (for all files including msglite.h),
+    // otherwise they read as zero and cost nothing.
+    //
+    // Rejections count attempts: with resync, bytes of a rejected message are
+    // rescanned and may be rejected again for another reason.
+    struct UnpackerStats {
+        uint64_t bytes;           // Bytes put
+        uint64_t bytes_discarded; // Bytes put that are not in a message
+        uint64_t messages;        // Messages accepted
+
+        // Rejections by reason
+        uint64_t bad_header;    // 0x92 not followed by 0xCE
+        uint64_t bad_length;    // Number of objects byte not 0x90 to 0x9F
+        uint64_t unknown_type;  // Type byte that bytes_of_type() does not know
+        uint64_t too_long;      // Cut off at max_msg_len
+        uint64_t crc_mismatch;  // Checksum not matching the received bytes
+        uint64_t body_rejected; // Body not decodable after the checksum passed
+    };
+
     // Stream unpacker.
     class Unpacker {
     public:
@@ -242,6 +679,45 @@ namespace MsgLite {
         // retrieve the message.
         bool put(uint8_t byte);
 
+        // Bulk version of put() that consumes bytes from a byte array, such as
+        // a whole read() buffer. Garbage between messages is skipped with
+        // memchr() and object payloads are copied in one go.
+        //
+        // It stops right after a message has been deserialized and returns
+        // true, so get() can be called before the remaining bytes are fed.
+        // The number of bytes used is stored in consumed, which equals len if
+        // no message is available.
+        //
+        // Feeding the same bytes through either version of put() gives
+        // exactly the same messages.
+        bool put(const uint8_t* data, size_t len, size_t& consumed);
+
+        // In resync mode, put() returns at most one message per call, and
+        // rescanned bytes left after it are only fed by the next put(). At
+        // the end of a stream, call flush() until it returns false to get the
+        // messages still among them or inside a message cut off by the end,
+        // each followed by a get() as for put().
+        bool flush(void);
+
+        // Versions of put() that also tell when the bytes were received, for
+        // example in microseconds of a hardware timer or nanoseconds of a
+        // monotonic clock. The time is kept for later calls without it.
+        bool put(uint8_t byte, uint64_t time);
+        bool put(const uint8_t* data, size_t len, size_t& consumed, uint64_t time);
+
+        // Alternatively, time is read from a clock function once per call to
+        // put(), or never if it is null (default).
+        void set_clock(uint64_t (*clock)(void));
+
+        // Returns when the header byte of the message was received, valid
+        // after a put() returning true. The latency of a message is measured
+        // from this time.
+        //
+        // In resync mode, a message found by rescanning the bytes of a
+        // rejected one is given the time of the rejected one, which may be a
+        // bit earlier than when its own header byte arrived.
+        uint64_t timestamp(void) const;
+
         // 2. Retrieve a reference to the message. If this function does not
         // follow a put() returning true, the return message can be anything.
         //
@@ -249,8 +725,29 @@ namespace MsgLite {
         // change it.
         const Message& get(void);
 
+        // 2. (Alternative) Decode the message straight into a message owned
+        // by the caller, such as a free slot of a queue, without going through
+        // the internal one. Binary objects still point into buf, so their
+        // bytes must be copied out before the next call to put().
+        //
+        // Returns true if successful, false if no message is available.
+        bool get(Message& msg);
+
+        // 2. (Alternative) Retrieve a view of the message, which decodes
+        // objects only when asked for. Same as get(), it is only valid until
+        // the next call to put().
+        const MessageView& view(void);
+
+        // Returns a snapshot of the diagnostic counters, see UnpackerStats.
+        UnpackerStats stats(void) const;
+
         // Constructor
-        Unpacker(uint8_t max_msg_len = MAX_MSG_LEN);
+        //
+        // With resync enabled, bytes buffered by a rejected message are
+        // rescanned, so a header inside them is still tried once. Without it,
+        // they are dropped as garbage and one corrupted message may swallow
+        // the next valid one.
+        Unpacker(uint8_t max_msg_len = MAX_MSG_LEN, bool resync = false);
 
     public:
         // Exposed internal buffer. After a successful put(), it contains the
@@ -258,13 +755,877 @@ namespace MsgLite {
         Buffer buf;
 
     private:
+        // put() once the receive time is known
+        bool put_byte(uint8_t byte);
+        bool put_bytes(const uint8_t* data, size_t len, size_t& consumed);
+
+        // Drives the state machine with one byte.
+        bool feed(uint8_t byte);
+
+        // Validates the buffered bytes, returns true if a message is ready.
+        bool complete(void);
+
+        // Support functions for resync
+        bool drain(void);
+        void requeue(uint8_t len);
+
         bool reset_buffer_on_next_put;
         uint8_t max_msg_len;
-        int8_t remaining_objects, remaining_bytes;
+        int8_t remaining_objects;
+        int16_t remaining_bytes;
+        bool binary_length; // next byte is the length of a bin8
         uint32_t crc_header, crc_body;
         Message msg;
+        MessageView msg_view;
+        bool msg_decoded;
+
+        // Bytes waiting to be rescanned in resync mode.
+        bool resync;
+        uint8_t pending_head, pending_len;
+        uint8_t pending[MAX_MSG_LEN + 1];
+
+        // Receive times: of the bytes being put, of the byte being fed, of the
+        // header byte in the buffer and of the oldest rescanned byte.
+        uint64_t (*clock)(void);
+        uint64_t put_time, feed_time, header_time, pending_time;
+
+#ifdef MSGLITE_UNPACKER_STATS
+        UnpackerStats counters; // bytes_discarded is computed by stats()
+        uint64_t message_bytes;
+#endif
     };
 
     // Checksum function used by MsgLite
     uint32_t CRC32B(uint32_t crc, const uint8_t* buf, size_t size);
+
+    // Combines checksums of two adjacent chunks, so that
+    //
+    //     CRC32B_combine(CRC32B(0, a, len_a), CRC32B(0, b, len_b), len_b)
+    //
+    // equals the checksum of a followed by b. Chunks of a large buffer can
+    // then be checked in parallel.
+    uint32_t CRC32B_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+    // Field codecs used by Schema. Each one provides:
+    //
+    //   in_type, out_type       Argument types of Schema::pack() and unpack()
+    //   type_byte               MessagePack type byte (the first one if many)
+    //   max_size                Upper bound of byte size after serialization
+    //   size(x)                 Byte size after serialization
+    //   pack(p, x)              Writes the object, returns its size
+    //   unpack(p, len, x)       Reads the object from at most len bytes,
+    //                           returns its size, 0 if it does not match
+    template <typename T>
+    struct SchemaField;
+
+    template <typename T, uint8_t TypeByte>
+    struct SchemaNumber {
+        typedef const T& in_type;
+        typedef T& out_type;
+        static constexpr uint8_t type_byte = TypeByte;
+        static constexpr uint8_t max_size = 1 + sizeof(T);
+
+        // Unsigned integer of the same size, for endian conversion
+        typedef typename std::conditional<sizeof(T) == 1, uint8_t,
+            typename std::conditional<sizeof(T) == 2, uint16_t,
+                typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type>::type>::type bits_type;
+
+        static uint8_t size(in_type)
+        {
+            return max_size;
+        }
+        static uint8_t pack(uint8_t* p, in_type x)
+        {
+            bits_type bits;
+            memcpy(&bits, &x, sizeof(T));
+            p[0] = TypeByte;
+            for (size_t ii = 0; ii < sizeof(T); ++ii)
+                p[1 + ii] = (uint8_t)(bits >> (8 * (sizeof(T) - 1 - ii)));
+            return max_size;
+        }
+        static uint8_t unpack(const uint8_t* p, uint8_t len, out_type x)
+        {
+            if (len < max_size || p[0] != TypeByte)
+                return 0;
+            bits_type bits = 0;
+            for (size_t ii = 0; ii < sizeof(T); ++ii)
+                bits = (bits_type)(bits << 8 | p[1 + ii]);
+            memcpy(&x, &bits, sizeof(T));
+            return max_size;
+        }
+    };
+    template <>
+    struct SchemaField<uint8_t> : SchemaNumber<uint8_t, 0xCC> {
+    };
+    template <>
+    struct SchemaField<uint16_t> : SchemaNumber<uint16_t, 0xCD> {
+    };
+    template <>
+    struct SchemaField<uint32_t> : SchemaNumber<uint32_t, 0xCE> {
+    };
+    template <>
+    struct SchemaField<uint64_t> : SchemaNumber<uint64_t, 0xCF> {
+    };
+    template <>
+    struct SchemaField<int8_t> : SchemaNumber<int8_t, 0xD0> {
+    };
+    template <>
+    struct SchemaField<int16_t> : SchemaNumber<int16_t, 0xD1> {
+    };
+    template <>
+    struct SchemaField<int32_t> : SchemaNumber<int32_t, 0xD2> {
+    };
+    template <>
+    struct SchemaField<int64_t> : SchemaNumber<int64_t, 0xD3> {
+    };
+    template <>
+    struct SchemaField<float> : SchemaNumber<float, 0xCA> {
+    };
+    template <>
+    struct SchemaField<double> : SchemaNumber<double, 0xCB> {
+    };
+
+    template <>
+    struct SchemaField<bool> {
+        typedef bool in_type;
+        typedef bool& out_type;
+        static constexpr uint8_t type_byte = 0xC2; // or 0xC3
+        static constexpr uint8_t max_size = 1;
+
+        static uint8_t size(in_type)
+        {
+            return 1;
+        }
+        static uint8_t pack(uint8_t* p, in_type x)
+        {
+            p[0] = x ? 0xC3 : 0xC2;
+            return 1;
+        }
+        static uint8_t unpack(const uint8_t* p, uint8_t len, out_type x)
+        {
+            if (len < 1 || (p[0] != 0xC2 && p[0] != 0xC3))
+                return 0;
+            x = p[0] == 0xC3;
+            return 1;
+        }
+    };
+
+    // Strings are trimmed to a maximum of 15 bytes, same as Object.
+    struct SchemaString {
+        typedef const char* in_type;
+        static constexpr uint8_t type_byte = 0xA0; // to 0xAF
+        static constexpr uint8_t max_size = 1 + 15;
+
+        static uint8_t length(in_type x)
+        {
+            uint8_t n = 0;
+            while (n < 15 && x[n] != '\0')
+                n++;
+            return n;
+        }
+        static uint8_t size(in_type x)
+        {
+            return 1 + length(x);
+        }
+        static uint8_t pack(uint8_t* p, in_type x)
+        {
+            uint8_t n = length(x);
+            p[0] = 0xA0 + n;
+            memcpy(p + 1, x, n);
+            return 1 + n;
+        }
+    };
+
+    // A const string is used as filter when unpacking, like a const argument
+    // of Message::parse().
+    template <>
+    struct SchemaField<const char*> : SchemaString {
+        typedef const char* out_type;
+
+        static uint8_t unpack(const uint8_t* p, uint8_t len, out_type x)
+        {
+            uint8_t n = length(x);
+            if (len < 1 + n || p[0] != 0xA0 + n || memcmp(p + 1, x, n) != 0)
+                return 0;
+            return 1 + n;
+        }
+    };
+
+    // A non-const string is copied out when unpacking. Assumes sizeof(x) >= 16.
+    template <>
+    struct SchemaField<char*> : SchemaString {
+        typedef char* out_type;
+
+        static uint8_t unpack(const uint8_t* p, uint8_t len, out_type x)
+        {
+            if (len < 1 || p[0] < 0xA0 || p[0] > 0xAF)
+                return 0;
+            uint8_t n = p[0] - 0xA0;
+            if (len < 1 + n)
+                return 0;
+            memcpy(x, p + 1, n);
+            x[n] = '\0';
+            return 1 + n;
+        }
+    };
+
+    // Binary objects are not copied when unpacking, x points to the bytes.
+    template <>
+    struct SchemaField<Blob> {
+        typedef const Blob& in_type;
+        typedef Blob& out_type;
+        static constexpr uint8_t type_byte = 0xC4;
+        static constexpr int16_t max_size = MAX_MSG_LEN - MIN_MSG_LEN;
+
+        static uint16_t size(in_type x)
+        {
+            return 2 + x.len;
+        }
+        static uint16_t pack(uint8_t* p, in_type x)
+        {
+            p[0] = 0xC4;
+            p[1] = x.len;
+            if (x.len > 0)
+                memcpy(p + 2, x.data, x.len);
+            return 2 + x.len;
+        }
+        static uint8_t unpack(const uint8_t* p, uint8_t len, out_type x)
+        {
+            if (len < 2 || p[0] != 0xC4 || len < 2 + p[1])
+                return 0;
+            x.data = p + 2;
+            x.len = p[1];
+            return 2 + p[1];
+        }
+    };
+
+    // Support functions for Schema, one object per recursion
+    template <typename... Types>
+    struct SchemaFields {
+        static constexpr int16_t max_size = 0;
+
+        static int16_t size(void)
+        {
+            return 0;
+        }
+        static void pack(uint8_t* p)
+        {
+            (void)p;
+        }
+        static bool unpack(const uint8_t* p, uint8_t len)
+        {
+            (void)p;
+            return len == 0; // no bytes left over
+        }
+    };
+    template <typename Type, typename... Types>
+    struct SchemaFields<Type, Types...> {
+        typedef SchemaField<Type> Field;
+        typedef SchemaFields<Types...> Others;
+
+        static constexpr int16_t max_size = Field::max_size + Others::max_size;
+
+        static int16_t size(typename Field::in_type first, typename SchemaField<Types>::in_type... others)
+        {
+            return Field::size(first) + Others::size(others...);
+        }
+        static void pack(uint8_t* p, typename Field::in_type first, typename SchemaField<Types>::in_type... others)
+        {
+            p += Field::pack(p, first);
+            Others::pack(p, others...);
+        }
+        static bool unpack(const uint8_t* p, uint8_t len, typename Field::out_type first, typename SchemaField<Types>::out_type... others)
+        {
+            uint8_t n = Field::unpack(p, len, first);
+            if (n == 0)
+                return false;
+            return Others::unpack(p + n, len - n, others...);
+        }
+    };
+
+    // Schema is a codec for messages with a fixed shape, such as
+    //
+    //     typedef MsgLite::Schema<const char*, float, float, float, uint32_t> Imu;
+    //     Imu::pack(buf, "imu", x, y, z, timestamp);
+    //     Imu::unpack(buf, "imu", x, y, z, timestamp);
+    //
+    // Objects are written and read in straight-line code, with no per-object
+    // switch and one type byte check per object. The bytes are the same as
+    // Pack() and Unpack() of the equivalent Message.
+    template <typename... Types>
+    class Schema {
+        static_assert(sizeof...(Types) <= 15, "The number of objects exceeds the limit.");
+
+        typedef SchemaFields<Types...> Fields;
+
+    public:
+        // Upper bound of byte size after serialization. It is exact if there
+        // is no string or binary.
+        static constexpr int16_t max_size = MIN_MSG_LEN + Fields::max_size;
+
+        // Returns byte size after serialization.
+        static int16_t size(typename SchemaField<Types>::in_type... values)
+        {
+            return MIN_MSG_LEN + Fields::size(values...);
+        }
+
+        // Serializes objects and writes bytes to a byte array.
+        //
+        // Returns length of data if serialization is successful, -1 if fails.
+        static int16_t pack(uint8_t* buf, uint8_t len, typename SchemaField<Types>::in_type... values)
+        {
+            int16_t msg_size = size(values...);
+            if (msg_size > len || msg_size > MAX_MSG_LEN)
+                return -1; // buffer size is insufficient or message too long
+
+            buf[0] = 0x92;
+            buf[1] = 0xCE;
+            buf[6] = 0x90 + sizeof...(Types);
+            Fields::pack(buf + MIN_MSG_LEN, values...);
+
+            uint32_t crc = CRC32B(0, buf + 6, msg_size - 6);
+            buf[2] = (uint8_t)(crc >> 24);
+            buf[3] = (uint8_t)(crc >> 16);
+            buf[4] = (uint8_t)(crc >> 8);
+            buf[5] = (uint8_t)crc;
+            return msg_size;
+        }
+
+        // Serializes objects and writes bytes to a buffer.
+        //
+        // Returns true if successful, false if packing fails.
+        static bool pack(Buffer& buf, typename SchemaField<Types>::in_type... values)
+        {
+            int16_t len = pack(buf.data, sizeof(buf.data), values...);
+            if (len < 0)
+                return false;
+            buf.len = (uint8_t)len;
+            return true;
+        }
+
+        // Deserializes objects from a byte array. Const strings are used as
+        // filters.
+        //
+        // Returns true if successful, false if unpacking fails or the message
+        // has another shape. Even if it fails, part of the arguments can be
+        // already changed.
+        static bool unpack(const uint8_t* buf, uint8_t len, typename SchemaField<Types>::out_type... values)
+        {
+            if (len < MIN_MSG_LEN || len > MAX_MSG_LEN)
+                return false;
+            if (buf[0] != 0x92 || buf[1] != 0xCE || buf[6] != 0x90 + sizeof...(Types))
+                return false;
+
+            uint32_t crc = (uint32_t)buf[2] << 24 | (uint32_t)buf[3] << 16 | (uint32_t)buf[4] << 8 | (uint32_t)buf[5];
+            if (CRC32B(0, buf + 6, len - 6) != crc)
+                return false;
+
+            return Fields::unpack(buf + MIN_MSG_LEN, len - MIN_MSG_LEN, values...);
+        }
+
+        // Deserializes objects from a buffer.
+        //
+        // Returns true if successful, false if unpacking fails.
+        static bool unpack(const Buffer& buf, typename SchemaField<Types>::out_type... values)
+        {
+            return unpack(buf.data, buf.len, values...);
+        }
+    };
+
+    // MessageBuilder serializes objects one by one straight into a buffer,
+    // without building a Message first:
+    //
+    //     MsgLite::Buffer buf;
+    //     MsgLite::MessageBuilder(buf).add("imu").add(x).add(y).add(z).finish();
+    //
+    // The bytes are the same as Pack() of the equivalent Message. Objects
+    // are written as they are added, the number of objects and the checksum
+    // by finish(). An error (too many objects, not enough space or an invalid
+    // string) is kept until finish() reports it.
+    class MessageBuilder {
+    public:
+        // Builds into a buffer, whose len is set by finish().
+        MessageBuilder(Buffer& buf);
+
+        // Builds into a byte array of len bytes.
+        MessageBuilder(uint8_t* buf, uint8_t len);
+
+        // Adds one object. The type is the same as the argument, which can be
+        // any type of Object, and strings are trimmed to a maximum of 15
+        // bytes like Object.
+        template <typename T>
+        MessageBuilder& add(T x)
+        {
+            typedef SchemaField<T> Field;
+            size_t n = Field::size(x);
+            if (count >= 15 || n > (size_t)(len - pos)) {
+                failed = true;
+                return *this;
+            }
+            pos += Field::pack(data + pos, x);
+            count++;
+            return *this;
+        }
+
+        // Adds a string of n bytes, which fails if n exceeds 15 or the string
+        // contains '\0' (it could not be held by an Object).
+        MessageBuilder& add(const char* x, uint8_t n);
+
+        // Writes the number of objects and the checksum.
+        //
+        // Returns length of data if serialization is successful, -1 if fails.
+        int16_t finish(void);
+
+        // Starts another message in the same buffer.
+        void reset(void);
+
+    private:
+        uint8_t* data;
+        uint8_t len, pos, count;
+        bool failed;
+        Buffer* buffer; // null for a byte array
+    };
+
+    // Dispatcher routes messages to handlers by their leading String object
+    // (the tag) and the types of the other objects. For example:
+    //
+    //     MsgLite::Dispatcher<64> dispatcher;
+    //     dispatcher.on<float, float, float, uint32_t>("imu", on_imu, &state);
+    //     ...
+    //     if (unpacker.put(byte))
+    //         dispatcher.dispatch(unpacker.view());
+    //
+    // Tags are looked up in a perfect hash table that on() rebuilds, so a
+    // dispatch costs two hashes and one comparison of the tag, whatever the
+    // number of handlers. N (up to 127) is the maximum number of handlers.
+    template <uint8_t N>
+    class Dispatcher {
+        static_assert(0 < N && N <= 127, "N must be between 1 and 127");
+
+    public:
+        typedef void (*Handler)(const MessageView& msg, void* context);
+
+        // Constructor
+        Dispatcher(void)
+        {
+            count = 0;
+            memset(slot, EMPTY, sizeof(slot));
+            memset(seed, 0, sizeof(seed)); // read by find() even for empty buckets
+        }
+
+        // Registers a handler for messages [tag, Types...], with Types as in
+        // Schema. Strings can be either const char* or char*.
+        //
+        // Returns false if the dispatcher is full, or if the same tag and
+        // types are already registered.
+        template <typename... Types>
+        bool on(const char* tag, Handler handler, void* context = nullptr)
+        {
+            static_assert(sizeof...(Types) <= 14, "The number of objects exceeds the limit.");
+            const uint8_t signature[] = { SchemaField<Types>::type_byte..., 0 };
+            return add(tag, signature, sizeof...(Types), handler, context);
+        }
+
+        // Calls the handler registered for the message.
+        //
+        // Returns true if a handler is called, false if none matches.
+        bool dispatch(const MessageView& msg) const
+        {
+            const char* tag;
+            uint8_t tag_len;
+            if (!msg.get(0, tag, tag_len))
+                return false;
+
+            uint8_t idx = find(tag, tag_len);
+            for (; idx != EMPTY; idx = entries[idx].next) {
+                const Entry& e = entries[idx];
+                if (e.signature_len + 1 != msg.len)
+                    continue;
+
+                bool matched = true;
+                for (uint8_t ii = 0; ii < e.signature_len && matched; ++ii)
+                    matched = same_type(e.signature[ii], msg.data[msg.offset[ii + 1]]);
+                if (matched) {
+                    e.handler(msg, e.context);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        static const uint8_t EMPTY = 0xFF;
+        static const uint8_t SLOTS = 2 * N;
+
+        struct Entry {
+            char tag[15];
+            uint8_t tag_len;
+            uint8_t signature[14];
+            uint8_t signature_len;
+            uint8_t next; // next entry with the same tag
+            Handler handler;
+            void* context;
+        };
+
+        Entry entries[N];
+        uint8_t count;
+
+        // Two-level perfect hash (hash and displace): a tag's bucket gives
+        // the seed of its second hash, which gives its slot.
+        uint16_t seed[N];
+        uint8_t slot[SLOTS];
+
+        static uint32_t hash(const char* tag, uint8_t len, uint32_t seed)
+        {
+            uint32_t h = 2166136261U ^ (seed * 0x9E3779B9U); // FNV-1a
+            for (uint8_t ii = 0; ii < len; ++ii) {
+                h ^= (uint8_t)tag[ii];
+                h *= 16777619U;
+            }
+            return h ^ (h >> 16);
+        }
+
+        static bool same_type(uint8_t expected, uint8_t type_byte)
+        {
+            if (expected == 0xA0)
+                return 0xA0 <= type_byte && type_byte <= 0xAF; // String
+            if (expected == 0xC2)
+                return type_byte == 0xC2 || type_byte == 0xC3; // Bool
+            return expected == type_byte;
+        }
+
+        // Returns the first entry with the tag, EMPTY if none.
+        uint8_t find(const char* tag, uint8_t tag_len) const
+        {
+            if (count == 0)
+                return EMPTY;
+            uint8_t bucket = hash(tag, tag_len, 0) % N;
+            uint8_t idx = slot[hash(tag, tag_len, seed[bucket]) % SLOTS];
+            if (idx == EMPTY || entries[idx].tag_len != tag_len || memcmp(entries[idx].tag, tag, tag_len) != 0)
+                return EMPTY;
+            return idx;
+        }
+
+        bool add(const char* tag, const uint8_t* signature, uint8_t signature_len, Handler handler, void* context)
+        {
+            if (count >= N)
+                return false;
+
+            Entry& e = entries[count];
+            e.tag_len = SchemaString::length(tag);
+            memcpy(e.tag, tag, e.tag_len);
+            memcpy(e.signature, signature, signature_len);
+            e.signature_len = signature_len;
+            e.next = EMPTY;
+            e.handler = handler;
+            e.context = context;
+
+            // Chain it after the entries with the same tag, if any.
+            uint8_t idx = find(e.tag, e.tag_len);
+            if (idx != EMPTY) {
+                for (;; idx = entries[idx].next) {
+                    const Entry& other = entries[idx];
+                    if (other.signature_len == signature_len && memcmp(other.signature, signature, signature_len) == 0)
+                        return false; // already registered
+                    if (other.next == EMPTY)
+                        break;
+                }
+                entries[idx].next = count++;
+                return true;
+            }
+
+            count++;
+            if (!rebuild()) {
+                count--;
+                rebuild();
+                return false;
+            }
+            return true;
+        }
+
+        // Returns true if entry idx is the first one with its tag.
+        bool is_first(uint8_t idx) const
+        {
+            for (uint8_t ii = 0; ii < count; ++ii) {
+                if (entries[ii].next == idx)
+                    return false;
+            }
+            return true;
+        }
+
+        // Finds a seed for each bucket so that all tags get distinct slots,
+        // starting with the largest buckets.
+        bool rebuild(void)
+        {
+            uint8_t bucket_of[N], bucket_size[N] = {}, max_size = 0;
+            memset(slot, EMPTY, sizeof(slot));
+            for (uint8_t ii = 0; ii < count; ++ii) {
+                if (!is_first(ii))
+                    continue;
+                bucket_of[ii] = hash(entries[ii].tag, entries[ii].tag_len, 0) % N;
+                if (++bucket_size[bucket_of[ii]] > max_size)
+                    max_size = bucket_size[bucket_of[ii]];
+            }
+
+            for (uint8_t size = max_size; size > 0; --size) {
+                for (uint8_t bucket = 0; bucket < N; ++bucket) {
+                    if (bucket_size[bucket] != size)
+                        continue;
+                    if (!place(bucket, bucket_of))
+                        return false;
+                }
+            }
+            return true;
+        }
+
+        // Finds a seed that puts the tags of a bucket into free slots.
+        bool place(uint8_t bucket, const uint8_t* bucket_of)
+        {
+            for (uint32_t s = 1; s <= 0xFFFF; ++s) {
+                uint8_t placed = 0, placed_slot[N];
+                bool ok = true;
+                for (uint8_t ii = 0; ii < count && ok; ++ii) {
+                    if (!is_first(ii) || bucket_of[ii] != bucket)
+                        continue;
+                    uint8_t target = hash(entries[ii].tag, entries[ii].tag_len, s) % SLOTS;
+                    if (slot[target] != EMPTY) {
+                        ok = false;
+                        break;
+                    }
+                    slot[target] = ii;
+                    placed_slot[placed++] = target;
+                }
+                if (ok) {
+                    seed[bucket] = s;
+                    return true;
+                }
+                while (placed > 0)
+                    slot[placed_slot[--placed]] = EMPTY;
+            }
+            return false;
+        }
+    };
+
+    // Helpers for the source files, not part of the API.
+    namespace Internal {
+        // std::index_sequence is C++14, so build one here (in log depth), for
+        // tables generated at compile time.
+        template <size_t... Is>
+        struct index_list {
+        };
+        template <typename A, typename B>
+        struct concat_index_list;
+        template <size_t... A, size_t... B>
+        struct concat_index_list<index_list<A...>, index_list<B...>> {
+            typedef index_list<A..., (sizeof...(A) + B)...> type;
+        };
+        template <size_t N>
+        struct make_index_list {
+            typedef typename concat_index_list<typename make_index_list<N / 2>::type, typename make_index_list<N - N / 2>::type>::type type;
+        };
+        template <>
+        struct make_index_list<0> {
+            typedef index_list<> type;
+        };
+        template <>
+        struct make_index_list<1> {
+            typedef index_list<0> type;
+        };
+    }
+
+#ifdef MSGLITE_LARGE_MESSAGES
+    // Large profile for host-to-host links, such as Ethernet bridges or USB
+    // CDC, enabled by defining MSGLITE_LARGE_MESSAGES (for all files
+    // including msglite.h). Frames keep the header and checksum, but may hold
+    // up to 65535 objects (MessagePack array16, 0xDC + 2 bytes), strings of up
+    // to 255 bytes (str8, 0xD9 + 1 byte) and up to LARGE_MAX_MSG_LEN bytes.
+    //
+    // The shorter encodings are used whenever they fit, so a frame of at most
+    // 15 objects and strings of at most 15 bytes is the same as in the default
+    // profile, and every default frame is a valid large frame. Peers on the
+    // default profile reject the larger frames.
+#ifndef MSGLITE_LARGE_MAX_MSG_LEN
+#define MSGLITE_LARGE_MAX_MSG_LEN 4096
+#endif
+    const size_t LARGE_MAX_MSG_LEN = MSGLITE_LARGE_MAX_MSG_LEN;
+    static_assert(LARGE_MAX_MSG_LEN >= MAX_MSG_LEN && LARGE_MAX_MSG_LEN <= 0xFFFF, "MSGLITE_LARGE_MAX_MSG_LEN must be 247 to 65535");
+
+    // Each object takes at least one byte after the 9-byte header.
+    const size_t LARGE_MAX_OBJECTS = LARGE_MAX_MSG_LEN - (1 + (1 + 4) + (1 + 2));
+
+    // Buffer provides a byte array capable of storing any large message.
+    struct LargeBuffer {
+        size_t len;
+        uint8_t data[LARGE_MAX_MSG_LEN];
+    };
+
+    // Same as MessageView, for large messages.
+    struct LargeMessageView {
+        size_t len;                          // Number of objects
+        const uint8_t* data;                 // Bytes holding the serialized objects
+        uint16_t offset[LARGE_MAX_OBJECTS]; // Position of each object's type byte in data
+
+        // Constructor
+        LargeMessageView(void)
+        {
+            len = 0;
+            data = nullptr;
+        }
+
+        // Decodes object ii. Returns false if out of range, or if it is a
+        // string longer than an Object can hold.
+        bool get(size_t ii, Object& obj) const;
+
+        // Decodes object ii and converts it, same as Object::cast_to().
+        template <typename Type>
+        bool get(size_t ii, Type& x) const
+        {
+            Object obj;
+            return get(ii, obj) && obj.cast_to(x);
+        }
+
+        // Points str to the characters of string object ii, of any length,
+        // which are not null-terminated. Returns false if out of range or not
+        // a string.
+        bool get(size_t ii, const char*& str, size_t& str_len) const;
+    };
+
+    // Serializes count objects as one large message to a byte array.
+    //
+    // Returns length of data, 0 if an object is invalid or it does not fit.
+    size_t Pack(const Object* objs, size_t count, uint8_t* buf, size_t len);
+
+    // Same, to a large buffer. Returns true if successful.
+    bool Pack(const Object* objs, size_t count, LargeBuffer& buf);
+
+    // Checks a large message in a byte array and locates its objects without
+    // decoding. The view points into the byte array.
+    //
+    // Returns true if successful, false if unpacking fails.
+    bool Unpack(const uint8_t* buf, size_t len, LargeMessageView& view);
+    bool Unpack(const LargeBuffer& buf, LargeMessageView& view);
+
+    // Decodes all objects of a large message view, which must fit in a
+    // Message (15 objects, strings of 15 bytes).
+    //
+    // Returns true if successful, false otherwise.
+    bool Unpack(const LargeMessageView& view, Message& msg);
+
+    // Same as MessageBuilder, for large messages.
+    //
+    // Objects start right after a fixarray byte, as in a default message, and
+    // move two bytes forward when a 16th object needs an array16 count.
+    class LargeMessageBuilder {
+    public:
+        // Builds into a buffer, whose len is set by finish().
+        LargeMessageBuilder(LargeBuffer& buf);
+
+        // Builds into a byte array of len bytes.
+        LargeMessageBuilder(uint8_t* buf, size_t len);
+
+        // Adds one number or bool, same as MessageBuilder.
+        template <typename T>
+        LargeMessageBuilder& add(T x)
+        {
+            typedef SchemaField<T> Field;
+            if (make_room(Field::size(x)))
+                pos += Field::pack(data + pos, x);
+            return *this;
+        }
+
+        // Adds a null-terminated string, which fails beyond 255 bytes.
+        LargeMessageBuilder& add(const char* x);
+        LargeMessageBuilder& add(char* x);
+
+        // Adds a string of n bytes, which fails if n exceeds 255 or the
+        // string contains '\0'.
+        LargeMessageBuilder& add(const char* x, size_t n);
+
+        // Writes the number of objects and the checksum.
+        //
+        // Returns length of data if serialization is successful, 0 if fails.
+        size_t finish(void);
+
+        // Starts another message in the same buffer.
+        void reset(void);
+
+    private:
+        // Counts one more object of n bytes if it fits, fails otherwise.
+        bool make_room(size_t n);
+
+        uint8_t* data;
+        size_t len, pos, count;
+        bool failed;
+        LargeBuffer* buffer; // null for a byte array
+    };
+
+    // Same as Unpacker, for large messages, without receive times and
+    // diagnostic counters. The unpacker holds about 4 * LARGE_MAX_MSG_LEN
+    // bytes.
+    class LargeUnpacker {
+    public:
+        // 1. Call put() repeatedly to drive the unpacker. It returns true if a
+        // message has been deserialized (with a CRC32 checksum pass).
+        bool put(uint8_t byte);
+
+        // Bulk version of put(), same as Unpacker.
+        bool put(const uint8_t* data, size_t len, size_t& consumed);
+
+        // 2. Retrieve a view of the message. It is only valid until the next
+        // call to put().
+        const LargeMessageView& view(void);
+
+        // 2. (Alternative) Decode the message into a Message, if it fits.
+        //
+        // Returns true if successful, false otherwise.
+        bool get(Message& msg);
+
+        // Constructor
+        //
+        // A rejected frame can swallow a valid one that starts inside it.
+        // Rescanning all of its bytes (as the resync mode of Unpacker does)
+        // costs up to max_msg_len bytes per rejection, so only the first
+        // resync_window bytes after its header are rescanned and the rest is
+        // dropped. With 0 (default), nothing is rescanned.
+        //
+        // The byte that causes a rejection is always examined again, so a
+        // header right after a broken frame is not lost.
+        LargeUnpacker(size_t max_msg_len = LARGE_MAX_MSG_LEN, size_t resync_window = 0);
+
+    public:
+        // Exposed internal buffer. After a successful put(), it contains the
+        // message's serialization bytes.
+        LargeBuffer buf;
+
+    private:
+        // Drives the state machine with one byte.
+        bool feed(uint8_t byte);
+
+        // Validates the buffered bytes, returns true if a message is ready.
+        bool complete(void);
+
+        // Resets the buffer after its bytes got rejected.
+        void reject(bool byte_used);
+
+        // Support functions for resync
+        bool drain(void);
+        void requeue(void);
+
+        bool reset_buffer_on_next_put;
+        size_t max_msg_len, resync_window;
+        size_t remaining_objects, remaining_bytes;
+        uint8_t count_bytes; // of array16 still to come
+        bool length_next;    // next byte is the length of a str8 or bin8
+        LargeMessageView msg_view;
+
+        // Rejected frame, to be rescanned: its length and whether the byte
+        // causing the rejection is still to be examined.
+        size_t rejected;
+        bool rejected_byte;
+
+        // Bytes waiting to be rescanned.
+        size_t pending_head, pending_len;
+        uint8_t pending[LARGE_MAX_MSG_LEN + 1];
+    };
+#endif
 }
@@ -0,0 +1,1288 @@
+#include "msglite_host.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <new>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace MsgLite;
+
+// A worker decodes one batch while put() fills the other. A batch is a
+// sequence of records, each a RecordHeader followed by len bytes.
+struct UnpackerPool::Worker {
+    UnpackerPool* pool;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;  // bytes to decode or stopping
+    pthread_cond_t space; // batch swapped or decoded
+    uint8_t* batch[2];
+    uint8_t filling; // index of the batch put() appends to
+    size_t used;     // bytes in the batch put() appends to
+    bool busy;       // decoding the other batch
+    bool stopping;
+};
+
+struct RecordHeader {
+    uint32_t channel;
+    uint32_t len;
+};
+
+UnpackerPool::UnpackerPool(uint32_t channels, uint8_t workers, Sink sink, void* context, bool resync, size_t batch_size)
+    : channels(channels), workers(workers), sink(sink), context(context), resync(resync), batch_size(batch_size),
+      unpackers(nullptr), worker(nullptr), started(0)
+{
+}
+
+UnpackerPool::~UnpackerPool()
+{
+    stop();
+    release(workers);
+}
+
+bool UnpackerPool::start(void)
+{
+    if (started || unpackers || workers == 0 || batch_size <= sizeof(RecordHeader))
+        return false;
+
+    unpackers = (Unpacker*)malloc(channels * sizeof(Unpacker));
+    if (!unpackers)
+        return false;
+    for (uint32_t ii = 0; ii < channels; ++ii)
+        new (&unpackers[ii]) Unpacker(MAX_MSG_LEN, resync);
+
+    worker = (Worker*)calloc(workers, sizeof(Worker));
+    if (!worker) {
+        release(0);
+        return false;
+    }
+
+    for (uint8_t ii = 0; ii < workers; ++ii) {
+        Worker& w = worker[ii];
+        w.pool = this;
+        if (pthread_mutex_init(&w.mutex, nullptr) != 0) {
+            release(ii);
+            return false;
+        }
+        if (pthread_cond_init(&w.work, nullptr) != 0) {
+            pthread_mutex_destroy(&w.mutex);
+            release(ii);
+            return false;
+        }
+        if (pthread_cond_init(&w.space, nullptr) != 0) {
+            pthread_cond_destroy(&w.work);
+            pthread_mutex_destroy(&w.mutex);
+            release(ii);
+            return false;
+        }
+        w.batch[0] = (uint8_t*)malloc(batch_size);
+        w.batch[1] = (uint8_t*)malloc(batch_size);
+        if (!w.batch[0] || !w.batch[1]) {
+            release(ii + 1);
+            return false;
+        }
+    }
+
+    for (; started < workers; ++started) {
+        if (pthread_create(&worker[started].thread, nullptr, run, &worker[started]) != 0) {
+            stop();
+            release(workers);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Frees what start() allocated, with the mutex and conditions of the first
+// initialized workers, so that start() can be called again.
+void UnpackerPool::release(uint8_t initialized)
+{
+    if (worker) {
+        for (uint8_t ii = 0; ii < workers; ++ii) {
+            if (ii < initialized) {
+                pthread_mutex_destroy(&worker[ii].mutex);
+                pthread_cond_destroy(&worker[ii].work);
+                pthread_cond_destroy(&worker[ii].space);
+            }
+            free(worker[ii].batch[0]);
+            free(worker[ii].batch[1]);
+        }
+        free(worker);
+        worker = nullptr;
+    }
+    if (unpackers) {
+        for (uint32_t ii = 0; ii < channels; ++ii)
+            unpackers[ii].~Unpacker();
+        free(unpackers);
+        unpackers = nullptr;
+    }
+}
+
+bool UnpackerPool::put(uint32_t channel, const uint8_t* data, size_t len)
+{
+    if (!started || channel >= channels)
+        return false;
+
+    Worker& w = worker[channel % workers];
+    pthread_mutex_lock(&w.mutex);
+    while (len > 0) {
+        while (batch_size - w.used <= sizeof(RecordHeader))
+            pthread_cond_wait(&w.space, &w.mutex);
+
+        size_t n = batch_size - w.used - sizeof(RecordHeader);
+        if (n > len)
+            n = len;
+        if (n > UINT32_MAX)
+            n = UINT32_MAX;
+
+        RecordHeader header = { channel, (uint32_t)n };
+        uint8_t* p = w.batch[w.filling] + w.used;
+        memcpy(p, &header, sizeof(header));
+        memcpy(p + sizeof(header), data, n);
+        w.used += sizeof(header) + n;
+        data += n;
+        len -= n;
+        pthread_cond_signal(&w.work);
+    }
+    pthread_mutex_unlock(&w.mutex);
+    return true;
+}
+
+void UnpackerPool::flush(void)
+{
+    for (uint8_t ii = 0; ii < started; ++ii) {
+        Worker& w = worker[ii];
+        pthread_mutex_lock(&w.mutex);
+        while (w.used != 0 || w.busy)
+            pthread_cond_wait(&w.space, &w.mutex);
+        pthread_mutex_unlock(&w.mutex);
+    }
+}
+
+void UnpackerPool::stop(void)
+{
+    for (uint8_t ii = 0; ii < started; ++ii) {
+        Worker& w = worker[ii];
+        pthread_mutex_lock(&w.mutex);
+        w.stopping = true;
+        pthread_cond_signal(&w.work);
+        pthread_mutex_unlock(&w.mutex);
+        pthread_join(w.thread, nullptr);
+    }
+    started = 0;
+}
+
+void* UnpackerPool::run(void* arg)
+{
+    Worker& w = *(Worker*)arg;
+    UnpackerPool& pool = *w.pool;
+
+    pthread_mutex_lock(&w.mutex);
+    for (;;) {
+        while (w.used == 0 && !w.stopping)
+            pthread_cond_wait(&w.work, &w.mutex);
+        if (w.used == 0)
+            break; // stopping, and all bytes decoded
+
+        // Swap batches so put() can go on while this one is decoded.
+        const uint8_t* p = w.batch[w.filling];
+        const uint8_t* end = p + w.used;
+        w.filling ^= 1;
+        w.used = 0;
+        w.busy = true;
+        pthread_cond_broadcast(&w.space);
+        pthread_mutex_unlock(&w.mutex);
+
+        while (p < end) {
+            RecordHeader header;
+            memcpy(&header, p, sizeof(header));
+            p += sizeof(header);
+
+            Unpacker& unpacker = pool.unpackers[header.channel];
+            size_t len = header.len;
+            while (len > 0) {
+                size_t consumed;
+                if (unpacker.put(p, len, consumed))
+                    pool.sink(header.channel, unpacker.get(), pool.context);
+                p += consumed;
+                len -= consumed;
+            }
+        }
+
+        pthread_mutex_lock(&w.mutex);
+        w.busy = false;
+        pthread_cond_broadcast(&w.space);
+    }
+    pthread_mutex_unlock(&w.mutex);
+    return nullptr;
+}
+
+struct Reactor::Channel {
+    int fd; // -1 once removed
+    Callback on_message;
+    Closed on_closed;
+    void* context;
+    Channel* next;
+    Unpacker unpacker;
+};
+
+Reactor::Reactor(size_t read_size)
+    : epoll_fd(epoll_create1(EPOLL_CLOEXEC)), read_size(read_size), read_buf((uint8_t*)malloc(read_size)),
+      channels(nullptr), removed(nullptr)
+{
+}
+
+Reactor::~Reactor()
+{
+    Channel* lists[] = { channels, removed };
+    for (Channel* ch : lists) {
+        while (ch) {
+            Channel* next = ch->next;
+            ch->~Channel();
+            free(ch);
+            ch = next;
+        }
+    }
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    free(read_buf);
+}
+
+bool Reactor::add(int fd, Callback on_message, void* context, Closed on_closed, bool resync)
+{
+    if (epoll_fd < 0 || !read_buf || fd < 0)
+        return false;
+    for (Channel* ch = channels; ch; ch = ch->next) {
+        if (ch->fd == fd)
+            return false; // already registered
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return false;
+
+    // On failure, the fd is given back with its original flags.
+    Channel* ch = (Channel*)malloc(sizeof(Channel));
+    if (!ch) {
+        fcntl(fd, F_SETFL, flags);
+        return false;
+    }
+    ch->fd = fd;
+    ch->on_message = on_message;
+    ch->on_closed = on_closed;
+    ch->context = context;
+    new (&ch->unpacker) Unpacker(MAX_MSG_LEN, resync);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = ch;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        free(ch);
+        fcntl(fd, F_SETFL, flags);
+        return false;
+    }
+    ch->next = channels;
+    channels = ch;
+    return true;
+}
+
+bool Reactor::remove(int fd)
+{
+    for (Channel** link = &channels; *link; link = &(*link)->next) {
+        Channel* ch = *link;
+        if (ch->fd != fd)
+            continue;
+
+        // Events already returned by epoll may still point to it, so it is
+        // only freed when poll() returns.
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        *link = ch->next;
+        ch->fd = -1;
+        ch->next = removed;
+        removed = ch;
+        return true;
+    }
+    return false;
+}
+
+int Reactor::poll(int timeout)
+{
+    const int max_events = 64;
+    struct epoll_event events[max_events];
+
+    int n = epoll_wait(epoll_fd, events, max_events, timeout);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+
+    int delivered = 0;
+    for (int ii = 0; ii < n; ++ii) {
+        Channel* ch = (Channel*)events[ii].data.ptr;
+        if (ch->fd < 0)
+            continue; // removed by a callback
+        if (!read_channel(ch, delivered) && ch->fd >= 0) {
+            int fd = ch->fd;
+            remove(fd);
+            if (ch->on_closed)
+                ch->on_closed(fd, ch->context);
+        }
+    }
+
+    while (removed) {
+        Channel* next = removed->next;
+        removed->~Channel();
+        free(removed);
+        removed = next;
+    }
+    return delivered;
+}
+
+// Reads until the fd would block, a bounded number of times so that busy fds
+// do not starve the others.
+//
+// Returns false on end of file or error.
+bool Reactor::read_channel(Channel* ch, int& delivered)
+{
+    const int max_reads = 16;
+
+    for (int ii = 0; ii < max_reads; ++ii) {
+        ssize_t n = read(ch->fd, read_buf, read_size);
+        if (n == 0) {
+            // End of file, messages may still wait in the unpacker.
+            while (ch->unpacker.flush()) {
+                ch->on_message(ch->fd, ch->unpacker.get(), ch->context);
+                delivered++;
+                if (ch->fd < 0)
+                    return true; // removed by the callback
+            }
+            return false;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK; // EIO for a hung up pty
+        }
+
+        for (size_t pos = 0, consumed; pos < (size_t)n; pos += consumed) {
+            if (ch->unpacker.put(read_buf + pos, n - pos, consumed)) {
+                ch->on_message(ch->fd, ch->unpacker.get(), ch->context);
+                delivered++;
+                if (ch->fd < 0)
+                    return true; // removed by the callback
+            }
+        }
+        if ((size_t)n < read_size)
+            return true; // most likely drained
+    }
+    return true;
+}
+
+// Chunks are handed out to threads one at a time. Each one lists every
+// position where a message starts in it, even inside another message: the
+// lists are merged in file order afterwards, skipping those overlapping the
+// previous message, the same way a resyncing Unpacker does.
+struct CaptureReader::Search {
+    const CaptureReader* reader;
+    size_t chunk_size;
+    size_t chunk_count;
+    std::atomic<size_t> next_chunk;
+    std::atomic<bool> failed;
+
+    struct Found {
+        CapturedFrame* list;
+        size_t count;
+        size_t capacity;
+    } * found;
+};
+
+CaptureReader::CaptureReader(void)
+    : file_data(nullptr), file_size(0), mapped(false), frame_list(nullptr), frame_count(0)
+{
+}
+
+CaptureReader::~CaptureReader()
+{
+    close();
+}
+
+bool CaptureReader::open(const char* path)
+{
+    close();
+
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        ::close(fd);
+        return false;
+    }
+
+    if (st.st_size > 0) {
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        file_data = (const uint8_t*)p;
+        file_size = st.st_size;
+        mapped = true;
+    }
+    ::close(fd);
+    return true;
+}
+
+void CaptureReader::open(const uint8_t* data, size_t size)
+{
+    close();
+    file_data = data;
+    file_size = size;
+}
+
+void CaptureReader::close(void)
+{
+    if (mapped)
+        munmap((void*)file_data, file_size);
+    file_data = nullptr;
+    file_size = 0;
+    mapped = false;
+
+    free(frame_list);
+    frame_list = nullptr;
+    frame_count = 0;
+}
+
+bool CaptureReader::recover(uint8_t threads, size_t chunk_size)
+{
+    free(frame_list);
+    frame_list = nullptr;
+    frame_count = 0;
+    if (chunk_size == 0)
+        return false;
+
+    Search search;
+    search.reader = this;
+    search.chunk_size = chunk_size;
+    search.chunk_count = (file_size + chunk_size - 1) / chunk_size;
+    search.next_chunk = 0;
+    search.failed = false;
+    search.found = (Search::Found*)calloc(search.chunk_count + 1, sizeof(Search::Found));
+    if (!search.found)
+        return false;
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : cpus > 255 ? 255 : cpus;
+    }
+    if (threads > search.chunk_count)
+        threads = search.chunk_count > 0 ? search.chunk_count : 1;
+
+    // This thread is one of them. If a thread cannot be created, the others
+    // take over its chunks.
+    pthread_t thread[255];
+    uint8_t started = 0;
+    for (; started + 1 < threads; ++started) {
+        if (pthread_create(&thread[started], nullptr, run, &search) != 0)
+            break;
+    }
+    run(&search);
+    for (uint8_t ii = 0; ii < started; ++ii)
+        pthread_join(thread[ii], nullptr);
+
+    size_t total = 0;
+    for (size_t ii = 0; ii < search.chunk_count; ++ii)
+        total += search.found[ii].count;
+    if (!search.failed)
+        frame_list = (CapturedFrame*)malloc((total + 1) * sizeof(CapturedFrame));
+
+    if (frame_list) {
+        size_t pos = 0; // end of the last message
+        for (size_t ii = 0; ii < search.chunk_count; ++ii) {
+            const Search::Found& found = search.found[ii];
+            for (size_t jj = 0; jj < found.count; ++jj) {
+                if (found.list[jj].offset < pos)
+                    continue; // inside the last message
+                frame_list[frame_count++] = found.list[jj];
+                pos = found.list[jj].offset + found.list[jj].len;
+            }
+        }
+    }
+
+    for (size_t ii = 0; ii < search.chunk_count; ++ii)
+        free(search.found[ii].list);
+    free(search.found);
+    return frame_list != nullptr;
+}
+
+bool CaptureReader::get(size_t ii, MessageView& view) const
+{
+    if (ii >= frame_count)
+        return false;
+    return Unpack(file_data + frame_list[ii].offset, frame_list[ii].len, view);
+}
+
+void* CaptureReader::run(void* arg)
+{
+    Search& search = *(Search*)arg;
+    const uint8_t* data = search.reader->file_data;
+    const uint8_t* end = data + search.reader->file_size;
+
+    for (;;) {
+        size_t chunk = search.next_chunk.fetch_add(1, std::memory_order_relaxed);
+        if (chunk >= search.chunk_count || search.failed)
+            break;
+
+        // Messages may run past the chunk, into the next one.
+        const uint8_t* p = data + chunk * search.chunk_size;
+        const uint8_t* stop = end - p > (ptrdiff_t)search.chunk_size ? p + search.chunk_size : end;
+        Search::Found& found = search.found[chunk];
+        while (p < stop) {
+            p = (const uint8_t*)memchr(p, 0x92, stop - p);
+            if (!p)
+                break;
+
+            uint8_t len = FrameLength(p, end - p);
+            if (len > 0) {
+                if (found.count == found.capacity) {
+                    size_t capacity = found.capacity ? 2 * found.capacity : 256;
+                    void* list = realloc(found.list, capacity * sizeof(CapturedFrame));
+                    if (!list) {
+                        search.failed = true;
+                        return nullptr;
+                    }
+                    found.list = (CapturedFrame*)list;
+                    found.capacity = capacity;
+                }
+                found.list[found.count].offset = p - data;
+                found.list[found.count].len = len;
+                found.count++;
+            }
+            p++;
+        }
+    }
+    return nullptr;
+}
+
+static const char LOG_MAGIC[8] = { 'M', 'S', 'G', 'L', 'O', 'G', '1', '\n' };
+static const size_t LOG_HEADER_LEN = 16;
+static const size_t RECORD_HEADER_LEN = 13;
+static const size_t INDEX_ENTRY_LEN = 24;
+
+static void to_le(uint8_t* p, uint64_t x, int n)
+{
+    for (int ii = 0; ii < n; ++ii)
+        p[ii] = (uint8_t)(x >> (8 * ii));
+}
+
+static uint64_t from_le(const uint8_t* p, int n)
+{
+    uint64_t x = 0;
+    for (int ii = n - 1; ii >= 0; --ii)
+        x = (x << 8) | p[ii];
+    return x;
+}
+
+// Returns path + ".idx" in memory to be freed, nullptr if allocation fails.
+static char* index_path(const char* path)
+{
+    size_t len = strlen(path);
+    char* idx = (char*)malloc(len + 5);
+    if (idx) {
+        memcpy(idx, path, len);
+        memcpy(idx + len, ".idx", 5);
+    }
+    return idx;
+}
+
+CaptureLogWriter::CaptureLogWriter(uint32_t block)
+    : block(block ? block : 1), log(nullptr), index(nullptr), records(0), offset(0), last_timestamp(0)
+{
+}
+
+CaptureLogWriter::~CaptureLogWriter()
+{
+    close();
+}
+
+bool CaptureLogWriter::open(const char* path)
+{
+    close();
+
+    char* idx = index_path(path);
+    if (!idx)
+        return false;
+
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_size > 0) {
+        // Append to an existing log, with its block size.
+        CaptureLogReader existing;
+        if (!existing.open(path)) {
+            free(idx);
+            return false; // not a log, leave it alone
+        }
+        block = existing.block;
+        records = existing.records;
+        offset = existing.end;
+        last_timestamp = 0;
+        if (records > 0) {
+            LogCursor last = existing.at(records - 1);
+            LogRecord rec;
+            if (existing.read(last, rec))
+                last_timestamp = rec.timestamp;
+        }
+
+        index = fopen(idx, "wb");
+        for (size_t ii = 0; index && ii < existing.index_len; ++ii) {
+            uint8_t entry[INDEX_ENTRY_LEN];
+            to_le(entry, existing.index[ii].timestamp, 8);
+            to_le(entry + 8, existing.index[ii].record, 8);
+            to_le(entry + 16, existing.index[ii].offset, 8);
+            fwrite(entry, 1, sizeof(entry), index);
+        }
+        existing.close();
+
+        if (truncate(path, offset) == 0)
+            log = fopen(path, "ab");
+    } else {
+        records = 0;
+        offset = LOG_HEADER_LEN;
+        last_timestamp = 0;
+
+        uint8_t header[LOG_HEADER_LEN] = {};
+        memcpy(header, LOG_MAGIC, sizeof(LOG_MAGIC));
+        to_le(header + 8, block, 4);
+        log = fopen(path, "wb");
+        if (log && fwrite(header, 1, sizeof(header), log) != sizeof(header)) {
+            fclose(log);
+            log = nullptr;
+        }
+        index = fopen(idx, "wb");
+    }
+    free(idx);
+
+    if (!log || !index) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool CaptureLogWriter::append(uint64_t timestamp, uint32_t channel, const uint8_t* frame, uint8_t len)
+{
+    if (!log || FrameLength(frame, len) != len || timestamp < last_timestamp)
+        return false;
+
+    if (records % block == 0) {
+        uint8_t entry[INDEX_ENTRY_LEN];
+        to_le(entry, timestamp, 8);
+        to_le(entry + 8, records, 8);
+        to_le(entry + 16, offset, 8);
+        if (fwrite(entry, 1, sizeof(entry), index) != sizeof(entry))
+            return false;
+    }
+
+    uint8_t header[RECORD_HEADER_LEN];
+    to_le(header, timestamp, 8);
+    to_le(header + 8, channel, 4);
+    header[12] = len;
+    if (fwrite(header, 1, sizeof(header), log) != sizeof(header) || fwrite(frame, 1, len, log) != len)
+        return false;
+
+    records++;
+    offset += sizeof(header) + len;
+    last_timestamp = timestamp;
+    return true;
+}
+
+bool CaptureLogWriter::append(uint64_t timestamp, uint32_t channel, const Buffer& buf)
+{
+    return append(timestamp, channel, buf.data, buf.len);
+}
+
+bool CaptureLogWriter::flush(void)
+{
+    if (!log)
+        return false;
+    bool ok = fflush(index) == 0;
+    return fflush(log) == 0 && ok;
+}
+
+void CaptureLogWriter::close(void)
+{
+    if (log)
+        fclose(log);
+    if (index)
+        fclose(index);
+    log = nullptr;
+    index = nullptr;
+}
+
+CaptureLogReader::CaptureLogReader(void)
+    : data(nullptr), size(0), end(0), block(0), records(0), index(nullptr), index_len(0)
+{
+}
+
+CaptureLogReader::~CaptureLogReader()
+{
+    close();
+}
+
+bool CaptureLogReader::add_index(const IndexEntry& entry, size_t& capacity)
+{
+    if (index_len == capacity) {
+        size_t new_capacity = capacity ? 2 * capacity : 64;
+        void* p = realloc(index, new_capacity * sizeof(IndexEntry));
+        if (!p)
+            return false;
+        index = (IndexEntry*)p;
+        capacity = new_capacity;
+    }
+    index[index_len++] = entry;
+    return true;
+}
+
+bool CaptureLogReader::open(const char* path)
+{
+    close();
+
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < LOG_HEADER_LEN) {
+        ::close(fd);
+        return false;
+    }
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    data = (const uint8_t*)p;
+    size = st.st_size;
+
+    block = from_le(data + 8, 4);
+    if (memcmp(data, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0 || block == 0) {
+        close();
+        return false;
+    }
+
+    // Load the index as far as it is consistent.
+    size_t capacity = 0;
+    char* idx = index_path(path);
+    FILE* f = idx ? fopen(idx, "rb") : nullptr;
+    free(idx);
+    if (f) {
+        uint8_t raw[INDEX_ENTRY_LEN];
+        while (fread(raw, 1, sizeof(raw), f) == sizeof(raw)) {
+            IndexEntry entry = { from_le(raw, 8), from_le(raw + 8, 8), from_le(raw + 16, 8) };
+            if (entry.record != index_len * (uint64_t)block || entry.offset < LOG_HEADER_LEN || entry.offset >= size)
+                break;
+            if (!add_index(entry, capacity)) {
+                fclose(f);
+                close();
+                return false;
+            }
+        }
+        fclose(f);
+    }
+
+    // Count and index the records after the last indexed block.
+    records = index_len ? index[index_len - 1].record : 0;
+    end = index_len ? index[index_len - 1].offset : LOG_HEADER_LEN;
+    for (;;) {
+        if (end + RECORD_HEADER_LEN > size)
+            break;
+        uint8_t len = data[end + 12];
+        if (end + RECORD_HEADER_LEN + len > size || FrameLength(data + end + RECORD_HEADER_LEN, len) != len)
+            break; // cut short or corrupted
+
+        if (records % block == 0 && records / block == index_len) {
+            IndexEntry entry = { from_le(data + end, 8), records, end };
+            if (!add_index(entry, capacity)) {
+                close();
+                return false;
+            }
+        }
+        records++;
+        end += RECORD_HEADER_LEN + len;
+    }
+
+    // Drop entries of blocks without records.
+    if (index_len > (records + block - 1) / block)
+        index_len = (records + block - 1) / block;
+    return true;
+}
+
+void CaptureLogReader::close(void)
+{
+    if (data)
+        munmap((void*)data, size);
+    free(index);
+    data = nullptr;
+    size = end = 0;
+    block = 0;
+    records = 0;
+    index = nullptr;
+    index_len = 0;
+}
+
+LogCursor CaptureLogReader::at(size_t record) const
+{
+    LogCursor cursor = { records, end };
+    if (record >= records)
+        return cursor;
+
+    const IndexEntry& entry = index[record / block];
+    cursor.record = entry.record;
+    cursor.offset = entry.offset;
+    while (cursor.record < record) {
+        cursor.offset += RECORD_HEADER_LEN + data[cursor.offset + 12];
+        cursor.record++;
+    }
+    return cursor;
+}
+
+LogCursor CaptureLogReader::seek(uint64_t timestamp) const
+{
+    // First block starting at or after the timestamp. Matching records may
+    // start in the block before it.
+    size_t lo = 0, hi = index_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index[mid].timestamp < timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    LogCursor cursor = at(lo > 0 ? (lo - 1) * (size_t)block : 0);
+    while (cursor.record < records && from_le(data + cursor.offset, 8) < timestamp) {
+        cursor.offset += RECORD_HEADER_LEN + data[cursor.offset + 12];
+        cursor.record++;
+    }
+    return cursor;
+}
+
+bool CaptureLogReader::read(LogCursor& cursor, LogRecord& rec) const
+{
+    if (cursor.record >= records)
+        return false;
+
+    const uint8_t* p = data + cursor.offset;
+    rec.timestamp = from_le(p, 8);
+    rec.channel = from_le(p + 8, 4);
+    rec.len = p[12];
+    rec.frame = p + RECORD_HEADER_LEN;
+    cursor.record++;
+    cursor.offset += RECORD_HEADER_LEN + rec.len;
+    return true;
+}
+
+uint64_t MsgLite::MonotonicClock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+LatencyHistogram::LatencyHistogram(void)
+{
+    reset();
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other)
+{
+    for (size_t ii = 0; ii < BUCKETS; ++ii)
+        buckets[ii] += other.buckets[ii];
+    if (other.low < low)
+        low = other.low;
+    if (other.high > high)
+        high = other.high;
+    total += other.total;
+}
+
+void LatencyHistogram::reset(void)
+{
+    memset(buckets, 0, sizeof(buckets));
+    total = 0;
+    low = UINT64_MAX;
+    high = 0;
+}
+
+uint64_t LatencyHistogram::bucket_max(size_t bucket)
+{
+    if (bucket < (2u << SUB_BITS))
+        return bucket;
+    uint8_t group = bucket >> SUB_BITS;
+    uint64_t first = (uint64_t)((1u << SUB_BITS) + (bucket & ((1u << SUB_BITS) - 1))) << (group - 1);
+    return first + ((uint64_t)1 << (group - 1)) - 1;
+}
+
+uint64_t LatencyHistogram::quantile(double q) const
+{
+    if (total == 0)
+        return 0;
+
+    // Rank of the value, from 1 to total
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank < q * total)
+        rank++;
+    if (rank < 1)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+
+    uint64_t seen = 0;
+    for (size_t ii = 0; ii < BUCKETS; ++ii) {
+        seen += buckets[ii];
+        if (seen >= rank) {
+            uint64_t value = bucket_max(ii);
+            if (value > high)
+                value = high;
+            if (value < low)
+                value = low;
+            return value;
+        }
+    }
+    return high;
+}
+
+// Scales a probability to compare with LossyChannel::random().
+static uint64_t threshold(double p)
+{
+    if (p <= 0)
+        return 0;
+    if (p >= 1)
+        return UINT64_MAX;
+    return (uint64_t)(p * 18446744073709551616.0);
+}
+
+LossyChannel::LossyChannel(const ChannelErrors& errors, uint64_t seed)
+{
+    // Given a byte has a flipped bit, the first one is bit ii with a
+    // probability proportional to (1 - p)^ii p. The others follow normally.
+    double p = errors.bit_error_rate;
+    double none = 1, first[8];
+    for (int ii = 0; ii < 8; ++ii) {
+        first[ii] = none * p;
+        none *= 1 - p;
+    }
+    double any = 1 - none, cumulative = 0;
+    for (int ii = 0; ii < 8; ++ii) {
+        cumulative += any > 0 ? first[ii] / any : 0;
+        flip_first[ii] = ii == 7 ? UINT64_MAX : threshold(cumulative);
+    }
+    flip_byte = threshold(any);
+    flip_bit = threshold(p);
+    drop = threshold(errors.drop_rate);
+    insert = threshold(errors.insert_rate);
+    burst = threshold(errors.burst_rate);
+    burst_len = errors.burst_len;
+
+    state = seed;
+    burst_left = 0;
+    memset(&counters, 0, sizeof(counters));
+}
+
+size_t LossyChannel::transmit(const uint8_t* data, size_t len, uint8_t* out)
+{
+    size_t pos = 0;
+    for (size_t ii = 0; ii < len; ++ii) {
+        uint8_t byte = data[ii];
+
+        if (insert && random() < insert) {
+            out[pos++] = (uint8_t)random();
+            counters.bytes_inserted++;
+        }
+        if (drop && random() < drop) {
+            counters.bytes_dropped++;
+            continue;
+        }
+
+        if (burst_left == 0 && burst && random() < burst) {
+            burst_left = burst_len;
+            counters.bursts++;
+        }
+        if (burst_left > 0) {
+            byte = (uint8_t)random();
+            burst_left--;
+        }
+
+        if (flip_byte && random() < flip_byte) {
+            uint64_t r = random();
+            int bit = 0;
+            while (r >= flip_first[bit])
+                bit++;
+            byte ^= 0x80 >> bit;
+            counters.bits_flipped++;
+            for (bit++; bit < 8; ++bit) {
+                if (random() < flip_bit) {
+                    byte ^= 0x80 >> bit;
+                    counters.bits_flipped++;
+                }
+            }
+        }
+
+        out[pos++] = byte;
+    }
+
+    counters.bytes_in += len;
+    counters.bytes_out += pos;
+    return pos;
+}
+
+int16_t LossyChannel::send(const Message& msg, uint8_t* out)
+{
+    uint8_t raw[MAX_MSG_LEN];
+    int16_t len = Pack(msg, raw, sizeof(raw));
+    if (len < 0)
+        return -1;
+    return transmit(raw, len, out);
+}
+
+// States of DfaUnpacker: the frame header, then DFA_BODY + objects * 16 +
+// bytes left of the current object's payload. DFA_BODY itself is a frame
+// with nothing left, to be checked like DFA_NEGATIVE. After a bin8 type byte,
+// DFA_BIN_LENGTH + objects waits for its length byte, which leads to
+// DFA_BIN_DATA + objects: feed() then counts the payload bytes itself and
+// goes back to DFA_BODY + objects * 16. States from DFA_BIN_DATA to DFA_BODY
+// are the ones that stop a run of table steps.
+static const uint16_t DFA_IDLE = 0;
+static const uint16_t DFA_HEADER = 1;
+static const uint16_t DFA_CRC = 2; // to DFA_CRC + 3
+static const uint16_t DFA_LENGTH = DFA_CRC + 4;
+static const uint16_t DFA_DEAD = DFA_LENGTH + 1;      // checksum mismatch, the next byte is dropped
+static const uint16_t DFA_BIN_DATA = DFA_LENGTH + 2;  // to DFA_BIN_DATA + 14, left at once
+static const uint16_t DFA_NEGATIVE = DFA_BIN_DATA + 15; // length byte below 0x90, which Unpacker also checks
+static const uint16_t DFA_BODY = DFA_NEGATIVE + 1;
+static const uint16_t DFA_BIN_LENGTH = DFA_BODY + 16 * 16;
+static const uint16_t DFA_STATES = DFA_BIN_LENGTH + 15;
+
+// Byte classes: payload width of a type byte (0 to 15), 0xCE (also a type
+// byte of width 4), length byte 0x90 + n, header byte 0x92 (also a length
+// byte), length byte below 0x90, bin8 type byte 0xC4, and anything else
+static const uint8_t DFA_WIDTH = 0;
+static const uint8_t DFA_CE = DFA_WIDTH + 16;
+static const uint8_t DFA_COUNT = DFA_CE + 1;
+static const uint8_t DFA_0x92 = DFA_COUNT + 16;
+static const uint8_t DFA_BELOW_0x90 = DFA_0x92 + 1;
+static const uint8_t DFA_OTHER = DFA_0x92 + 2;
+static const uint8_t DFA_BIN = DFA_0x92 + 3;
+static const uint8_t DFA_CLASSES = DFA_0x92 + 4;
+
+constexpr uint8_t dfa_class(size_t byte)
+{
+    return byte == 0x92           ? DFA_0x92
+        : byte == 0xCE            ? DFA_CE
+        : byte >= 0x90 && byte <= 0x9F ? DFA_COUNT + (byte - 0x90)
+        : byte >= 0x10 && byte < 0x90  ? DFA_BELOW_0x90
+        : byte >= 0xA0 && byte <= 0xAF ? DFA_WIDTH + (byte - 0xA0)
+        : byte == 0xC2 || byte == 0xC3 ? DFA_WIDTH + 0
+        : byte == 0xCC || byte == 0xD0 ? DFA_WIDTH + 1
+        : byte == 0xCD || byte == 0xD1 ? DFA_WIDTH + 2
+        : byte == 0xCA || byte == 0xD2 ? DFA_WIDTH + 4
+        : byte == 0xCB || byte == 0xCF || byte == 0xD3 ? DFA_WIDTH + 8
+        : byte == 0xC4                 ? DFA_BIN
+                                       : DFA_OTHER;
+}
+
+// Number of objects of a length byte class, -1 if it is not one
+constexpr int dfa_count(size_t c)
+{
+    return c == DFA_0x92 ? 2 : c >= DFA_COUNT && c < DFA_COUNT + 16 ? (int)(c - DFA_COUNT) : -1;
+}
+
+// Payload width of a type byte class, -1 if it is not one
+constexpr int dfa_width(size_t c)
+{
+    return c == DFA_CE ? 4 : c < DFA_WIDTH + 16 ? (int)c : -1;
+}
+
+// A rejected byte is dropped, not tried as a header byte, as in Unpacker.
+constexpr uint16_t dfa_next(size_t s, size_t c)
+{
+    return s == DFA_IDLE ? (c == DFA_0x92 ? DFA_HEADER : DFA_IDLE)
+        : s == DFA_HEADER ? (c == DFA_CE ? DFA_CRC : DFA_IDLE)
+        : s < DFA_LENGTH  ? s + 1
+        : s == DFA_LENGTH ? (dfa_count(c) >= 0 ? DFA_BODY + 16 * dfa_count(c) : c == DFA_BELOW_0x90 ? DFA_NEGATIVE : DFA_IDLE)
+        : s <= DFA_BODY   ? DFA_IDLE
+        : s >= DFA_BIN_LENGTH ? DFA_BIN_DATA + (s - DFA_BIN_LENGTH)
+        : (s - DFA_BODY) % 16 > 0 ? s - 1
+        : dfa_width(c) >= 0 ? s - 16 + dfa_width(c)
+        : c == DFA_BIN      ? DFA_BIN_LENGTH + (s - DFA_BODY) / 16 - 1
+                            : DFA_IDLE;
+}
+
+struct DfaTables {
+    uint8_t byte_class[256];
+    uint16_t next[DFA_STATES * DFA_CLASSES];
+};
+template <size_t... Bytes, size_t... Is>
+constexpr DfaTables make_dfa_tables(Internal::index_list<Bytes...>, Internal::index_list<Is...>)
+{
+    return DfaTables { { dfa_class(Bytes)... }, { dfa_next(Is / DFA_CLASSES, Is % DFA_CLASSES)... } };
+}
+static constexpr DfaTables dfa = make_dfa_tables(Internal::make_index_list<256>::type(), Internal::make_index_list<DFA_STATES * DFA_CLASSES>::type());
+
+DfaUnpacker::DfaUnpacker(uint8_t max_msg_len)
+{
+    buf.len = 0;
+    reset_buffer_on_next_put = false;
+    if (max_msg_len > MAX_MSG_LEN)
+        max_msg_len = MAX_MSG_LEN;
+    this->max_msg_len = max_msg_len;
+    state = DFA_IDLE;
+    bin_left = 0;
+    msg_decoded = true;
+}
+
+// Moves the state machine by one byte, returns true if a frame ended.
+inline bool DfaUnpacker::feed(uint8_t byte)
+{
+    if (reset_buffer_on_next_put || buf.len >= max_msg_len) {
+        buf.len = 0;
+        reset_buffer_on_next_put = false;
+        state = DFA_IDLE;
+        bin_left = 0;
+    }
+
+    if (bin_left > 0) {
+        buf.data[buf.len++] = byte;
+        return --bin_left == 0 && state == DFA_BODY;
+    }
+
+    state = dfa.next[state * DFA_CLASSES + dfa.byte_class[byte]];
+    buf.data[buf.len] = byte;
+    buf.len = (buf.len + 1) & (state == DFA_IDLE ? 0 : 0xFF);
+    if ((uint16_t)(state - DFA_BIN_DATA) > DFA_BODY - DFA_BIN_DATA)
+        return false;
+    if (state < DFA_NEGATIVE) {
+        // Length byte of a bin8
+        bin_left = byte;
+        state = DFA_BODY + 16 * (state - DFA_BIN_DATA);
+        return bin_left == 0 && state == DFA_BODY;
+    }
+    return true;
+}
+
+bool DfaUnpacker::put(uint8_t byte)
+{
+    return feed(byte) && complete();
+}
+
+bool DfaUnpacker::put(const uint8_t* data, size_t len, size_t& consumed)
+{
+    size_t pos = 0;
+    while (pos < len) {
+        if (reset_buffer_on_next_put) {
+            buf.len = 0;
+            reset_buffer_on_next_put = false;
+            state = DFA_IDLE;
+            bin_left = 0;
+        }
+        if (state == DFA_IDLE) {
+            // Skip garbage until the next header byte.
+            const void* header = memchr(data + pos, 0x92, len - pos);
+            if (header == NULL) {
+                pos = len;
+                break;
+            }
+            pos = (const uint8_t*)header - data;
+        }
+
+        uint16_t next = state;
+        uint8_t used = buf.len;
+        if (bin_left > 0 && used < max_msg_len) {
+            // Rest of a bin8 payload, copied at once
+            size_t n = bin_left;
+            if (n > len - pos)
+                n = len - pos;
+            if (n > (size_t)(max_msg_len - used))
+                n = max_msg_len - used;
+            memcpy(buf.data + used, data + pos, n);
+            buf.len += n;
+            bin_left -= n;
+            pos += n;
+            if (bin_left == 0 && state == DFA_BODY && complete()) {
+                consumed = pos;
+                return true;
+            }
+            continue;
+        }
+        bin_left = 0;
+
+        // Same steps as feed(), on locals, until the frame ends or dies, or
+        // a bin8 length byte comes.
+        do {
+            if (used >= max_msg_len) {
+                used = 0;
+                next = DFA_IDLE;
+            }
+            uint8_t byte = data[pos++];
+            next = dfa.next[next * DFA_CLASSES + dfa.byte_class[byte]];
+            buf.data[used] = byte;
+            used = (used + 1) & (next == DFA_IDLE ? 0 : 0xFF);
+        } while (pos < len && next != DFA_IDLE && (uint16_t)(next - DFA_BIN_DATA) > DFA_BODY - DFA_BIN_DATA);
+        if ((uint16_t)(next - DFA_BIN_DATA) < DFA_NEGATIVE - DFA_BIN_DATA) {
+            bin_left = buf.data[used - 1];
+            next = DFA_BODY + 16 * (next - DFA_BIN_DATA);
+        }
+        state = next;
+        buf.len = used;
+
+        if (bin_left == 0 && (uint16_t)(next - DFA_NEGATIVE) <= DFA_BODY - DFA_NEGATIVE && complete()) {
+            consumed = pos;
+            return true;
+        }
+    }
+
+    consumed = pos;
+    return false;
+}
+
+// Checks a frame that ended, returns true if it is a message.
+bool DfaUnpacker::complete(void)
+{
+    // The framing is already checked, so only the checksum can fail.
+    if (state == DFA_BODY && Unpack(buf.data, buf.len, msg_view)) {
+        msg_decoded = false;
+        reset_buffer_on_next_put = true;
+        return true;
+    }
+
+    // With a length byte below 0x90, a matching checksum resets at once,
+    // otherwise the next byte is dropped like after any checksum mismatch.
+    uint32_t crc = (uint32_t)buf.data[2] << 24 | (uint32_t)buf.data[3] << 16 | (uint32_t)buf.data[4] << 8 | buf.data[5];
+    if (state == DFA_NEGATIVE && CRC32B(0, buf.data + 6, buf.len - 6) == crc) {
+        buf.len = 0;
+        state = DFA_IDLE;
+    } else {
+        state = DFA_DEAD;
+    }
+    return false;
+}
+
+const Message& DfaUnpacker::get(void)
+{
+    if (reset_buffer_on_next_put && !msg_decoded) {
+        Unpack(msg_view, msg);
+        msg_decoded = true;
+    }
+    return msg;
+}
+
+bool DfaUnpacker::get(Message& out)
+{
+    if (!reset_buffer_on_next_put)
+        return false;
+    if (msg_decoded) {
+        out = msg;
+        return true;
+    }
+    return Unpack(msg_view, out);
+}
@@ -0,0 +1,682 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "msglite.h"
+
+// Optional extensions for hosts running POSIX threads. Unlike msglite.h,
+// they allocate memory and are not meant for microcontrollers.
+namespace MsgLite {
+    // UnpackerPool decodes many byte streams (channels) with worker threads.
+    // Each channel has its own Unpacker and always goes to the same worker,
+    // channel % workers, so messages of a channel keep their order.
+    //
+    //     void on_message(uint32_t channel, const MsgLite::Message& msg, void* context);
+    //
+    //     MsgLite::UnpackerPool pool(256, 4, on_message, nullptr);
+    //     if (!pool.start())
+    //         ...
+    //     pool.put(channel, data, len); // from the reading threads
+    //
+    // The sink is called from the worker threads, concurrently for channels
+    // of different workers.
+    class UnpackerPool {
+    public:
+        typedef void (*Sink)(uint32_t channel, const Message& msg, void* context);
+
+        // Constructor
+        //
+        // batch_size is the number of bytes each worker buffers before put()
+        // has to wait.
+        UnpackerPool(uint32_t channels, uint8_t workers, Sink sink, void* context, bool resync = false, size_t batch_size = 65536);
+        ~UnpackerPool();
+
+        // Allocates the unpackers and starts the workers.
+        //
+        // Returns true if successful, false if allocation or thread creation
+        // fails, in which case everything is freed and it may be retried.
+        bool start(void);
+
+        // Hands bytes of a channel to its worker. Waits if the worker is
+        // behind by more than batch_size bytes.
+        //
+        // Bytes of one channel must be put by one thread at a time.
+        //
+        // Returns false if the channel is invalid or the pool is not started.
+        bool put(uint32_t channel, const uint8_t* data, size_t len);
+
+        // Waits until all bytes put so far have been decoded.
+        void flush(void);
+
+        // Decodes the remaining bytes and stops the workers.
+        void stop(void);
+
+    private:
+        struct Worker;
+
+        static void* run(void* arg);
+        void release(uint8_t initialized);
+
+        uint32_t channels;
+        uint8_t workers;
+        Sink sink;
+        void* context;
+        bool resync;
+        size_t batch_size;
+
+        Unpacker* unpackers;
+        Worker* worker;
+        uint8_t started;
+
+        UnpackerPool(const UnpackerPool&) = delete;
+        UnpackerPool& operator=(const UnpackerPool&) = delete;
+    };
+
+    // Assumed cache line size, to keep indices written by different threads
+    // apart.
+    static const size_t CACHE_LINE = 64;
+
+    // MessageRing is a bounded lock-free queue of N (a power of two) message
+    // slots for one producer thread and one consumer thread. Messages are
+    // decoded straight into the slots, so nothing is copied or locked:
+    //
+    //     // Producer                        // Consumer
+    //     if (unpacker.put(byte)) {          while (Message* msg = ring.front()) {
+    //         Message* slot = ring.reserve();    ...
+    //         if (slot && unpacker.get(*slot))   ring.release();
+    //             ring.publish();            }
+    //     }
+    //
+    // Indices are cache-line aligned, so the ring must not be allocated with
+    // new before C++17. Static or stack storage is fine.
+    template <size_t N>
+    class MessageRing {
+        static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of two");
+
+    public:
+        MessageRing(void) : tail(0), head_cache(0), head(0), tail_cache(0) {}
+
+        // Producer: returns the next free slot, nullptr if the ring is full.
+        // The slot is not visible to the consumer until publish().
+        Message* reserve(void)
+        {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head_cache == N) {
+                head_cache = head.load(std::memory_order_acquire);
+                if (t - head_cache == N)
+                    return nullptr;
+            }
+            return &slots[t & (N - 1)];
+        }
+
+        // Producer: hands the slot returned by reserve() to the consumer.
+        void publish(void)
+        {
+            tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        // Consumer: returns the oldest published message, nullptr if none.
+        Message* front(void)
+        {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail_cache) {
+                tail_cache = tail.load(std::memory_order_acquire);
+                if (h == tail_cache)
+                    return nullptr;
+            }
+            return &slots[h & (N - 1)];
+        }
+
+        // Consumer: gives the slot returned by front() back to the producer.
+        void release(void)
+        {
+            head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+    private:
+        // Written by the producer
+        alignas(CACHE_LINE) std::atomic<size_t> tail;
+        size_t head_cache;
+
+        // Written by the consumer
+        alignas(CACHE_LINE) std::atomic<size_t> head;
+        size_t tail_cache;
+
+        alignas(CACHE_LINE) Message slots[N];
+    };
+
+    // MessageQueue is the same as MessageRing, but for many producer threads
+    // (such as one per reader) and one consumer thread. Each slot carries a
+    // sequence number telling whether it is free or published, so producers
+    // can fill slots in parallel and publish them in any order.
+    template <size_t N>
+    class MessageQueue {
+        static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of two");
+
+    public:
+        MessageQueue(void) : tail(0), head(0)
+        {
+            for (size_t ii = 0; ii < N; ++ii)
+                slots[ii].seq.store(ii, std::memory_order_relaxed);
+        }
+
+        // Producer: returns a free slot, nullptr if the queue is full.
+        Message* reserve(void)
+        {
+            size_t t = tail.load(std::memory_order_relaxed);
+            for (;;) {
+                Slot& slot = slots[t & (N - 1)];
+                intptr_t diff = (intptr_t)(slot.seq.load(std::memory_order_acquire) - t);
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed))
+                        return &slot.msg;
+                } else if (diff < 0) {
+                    return nullptr; // the consumer has not released it yet
+                } else {
+                    t = tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Producer: hands a slot returned by reserve() to the consumer.
+        void publish(Message* msg)
+        {
+            Slot& slot = *reinterpret_cast<Slot*>(msg);
+            slot.seq.store(slot.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        // Consumer: returns the oldest reserved message if it is published,
+        // nullptr otherwise.
+        Message* front(void)
+        {
+            Slot& slot = slots[head & (N - 1)];
+            if (slot.seq.load(std::memory_order_acquire) != head + 1)
+                return nullptr;
+            return &slot.msg;
+        }
+
+        // Consumer: gives the slot returned by front() back to the producers.
+        void release(void)
+        {
+            slots[head & (N - 1)].seq.store(head + N, std::memory_order_release);
+            head++;
+        }
+
+    private:
+        struct alignas(CACHE_LINE) Slot {
+            Message msg; // first, so publish() can find its slot
+            std::atomic<size_t> seq;
+        };
+
+        // Written by the producers
+        alignas(CACHE_LINE) std::atomic<size_t> tail;
+
+        // Written by the consumer
+        alignas(CACHE_LINE) size_t head;
+
+        Slot slots[N];
+    };
+
+    // Reactor services many file descriptors (tty, pty, pipe, socket) from
+    // one thread with epoll. Each fd gets its own Unpacker; readable fds are
+    // read in large non-blocking batches and decoded messages are passed to
+    // the fd's callback:
+    //
+    //     MsgLite::Reactor reactor;
+    //     reactor.add(fd, on_message, &state);
+    //     for (;;)
+    //         reactor.poll(-1);
+    class Reactor {
+    public:
+        typedef void (*Callback)(int fd, const Message& msg, void* context);
+        typedef void (*Closed)(int fd, void* context);
+
+        // Constructor
+        //
+        // read_size is the largest number of bytes read at once.
+        Reactor(size_t read_size = 65536);
+        ~Reactor();
+
+        // Registers an fd, which is switched to non-blocking mode. on_closed,
+        // if not null, is called when the fd reaches end of file or fails,
+        // after which it is removed from the reactor. It is never closed by
+        // the reactor.
+        //
+        // Returns false if the fd is already registered or epoll fails.
+        bool add(int fd, Callback on_message, void* context, Closed on_closed = nullptr, bool resync = false);
+
+        // Unregisters an fd. It can be called from the callbacks.
+        //
+        // Returns false if the fd is not registered.
+        bool remove(int fd);
+
+        // Waits up to timeout milliseconds (-1 for no limit) for readable fds,
+        // then reads and decodes them.
+        //
+        // Returns the number of messages delivered, -1 if epoll fails.
+        int poll(int timeout);
+
+    private:
+        struct Channel;
+
+        int epoll_fd;
+        size_t read_size;
+        uint8_t* read_buf;
+        Channel* channels; // registered
+        Channel* removed;  // freed when poll() returns
+
+        bool read_channel(Channel* ch, int& delivered);
+
+        Reactor(const Reactor&) = delete;
+        Reactor& operator=(const Reactor&) = delete;
+    };
+
+    // Where CaptureReader found a message in a capture file.
+    struct CapturedFrame {
+        size_t offset; // Position of the header byte in the file
+        uint8_t len;   // Length of the message
+    };
+
+    // CaptureReader recovers the messages of a raw capture file, which may be
+    // gigabytes of link traffic with corrupted bytes. The file is mapped into
+    // memory and split into chunks searched by parallel threads.
+    //
+    // It finds exactly the messages that feeding the whole file to an
+    // Unpacker with resync enabled gives, in file order, counting those its
+    // flush() returns once the file has been fed:
+    //
+    //     MsgLite::CaptureReader capture;
+    //     if (capture.open("link.bin") && capture.recover()) {
+    //         MsgLite::MessageView view;
+    //         for (size_t ii = 0; ii < capture.count(); ++ii)
+    //             if (capture.get(ii, view))
+    //                 ...
+    //     }
+    class CaptureReader {
+    public:
+        CaptureReader(void);
+        ~CaptureReader();
+
+        // Maps a file into memory, read-only.
+        //
+        // Returns false if the file cannot be opened or mapped.
+        bool open(const char* path);
+
+        // Uses a byte array instead of a file. It must outlive the reader.
+        void open(const uint8_t* data, size_t size);
+
+        // Unmaps the file and drops the frames.
+        void close(void);
+
+        // Searches the whole file with a number of threads (0 for one per
+        // online CPU) and chunks of chunk_size bytes each.
+        //
+        // Returns false if allocation or thread creation fails.
+        bool recover(uint8_t threads = 0, size_t chunk_size = 4 << 20);
+
+        // Frames found by recover(), in file order.
+        size_t count(void) const { return frame_count; }
+        const CapturedFrame* frames(void) const { return frame_list; }
+
+        // Locates the objects of frame ii.
+        //
+        // Returns false if ii is out of range.
+        bool get(size_t ii, MessageView& view) const;
+
+        // Contents of the file
+        const uint8_t* data(void) const { return file_data; }
+        size_t size(void) const { return file_size; }
+
+    private:
+        struct Search;
+
+        static void* run(void* arg);
+
+        const uint8_t* file_data;
+        size_t file_size;
+        bool mapped;
+
+        CapturedFrame* frame_list;
+        size_t frame_count;
+
+        CaptureReader(const CaptureReader&) = delete;
+        CaptureReader& operator=(const CaptureReader&) = delete;
+    };
+
+    // A message stored in a capture log. frame points into the mapped file.
+    struct LogRecord {
+        uint64_t timestamp; // Receive time, in the unit chosen by the writer
+        uint32_t channel;   // Link the message came from
+        uint8_t len;        // Length of the message
+        const uint8_t* frame;
+    };
+
+    // Position in a capture log
+    struct LogCursor {
+        size_t record; // Number of the record
+        size_t offset; // Position of the record in the file
+    };
+
+    // CaptureLogWriter appends messages to a capture log. The log stores each
+    // serialized message as is, CRC included, after a header with its receive
+    // timestamp, channel and length:
+    //
+    //     File header:  "MSGLOG1" 0x0A, block (4 bytes), 0 (4 bytes)
+    //     Record:       timestamp (8 bytes), channel (4 bytes), len, message
+    //
+    // Numbers are little-endian. Every block records, an entry is added to a
+    // sparse index kept in a second file, path + ".idx":
+    //
+    //     Index entry:  timestamp (8 bytes), record (8 bytes), offset (8 bytes)
+    //
+    // Timestamps must not decrease, so that the index can be searched by time.
+    class CaptureLogWriter {
+    public:
+        CaptureLogWriter(uint32_t block = 256);
+        ~CaptureLogWriter();
+
+        // Creates a log, or opens an existing one to append to it. A record
+        // cut short by a crash is dropped, and a stale index is rebuilt.
+        //
+        // Returns false if the files cannot be opened or the log is invalid.
+        bool open(const char* path);
+
+        // Appends a message.
+        //
+        // Returns false if it is not one valid message, if its timestamp is
+        // older than the last record's, or if writing fails.
+        bool append(uint64_t timestamp, uint32_t channel, const uint8_t* frame, uint8_t len);
+        bool append(uint64_t timestamp, uint32_t channel, const Buffer& buf);
+
+        // Writes buffered records to the files.
+        //
+        // Returns false if writing fails.
+        bool flush(void);
+
+        // Flushes and closes the files.
+        void close(void);
+
+    private:
+        uint32_t block;
+        FILE* log;
+        FILE* index;
+        size_t records;
+        size_t offset; // end of the log
+        uint64_t last_timestamp;
+
+        CaptureLogWriter(const CaptureLogWriter&) = delete;
+        CaptureLogWriter& operator=(const CaptureLogWriter&) = delete;
+    };
+
+    // CaptureLogReader maps a capture log into memory and seeks it by record
+    // number or by time in O(log n) with its index. Records are read with a
+    // cursor, without copying:
+    //
+    //     MsgLite::CaptureLogReader log;
+    //     MsgLite::LogRecord rec;
+    //     MsgLite::LogCursor cursor = log.seek(start_time);
+    //     while (log.read(cursor, rec) && rec.timestamp < end_time)
+    //         if (rec.channel == 7)
+    //             ...
+    class CaptureLogReader {
+    public:
+        CaptureLogReader(void);
+        ~CaptureLogReader();
+
+        // Maps a log written by CaptureLogWriter and loads its index. Records
+        // missing from the index are indexed in memory, and a record cut short
+        // ends the log.
+        //
+        // Returns false if the log cannot be opened or is invalid.
+        bool open(const char* path);
+
+        // Unmaps the log.
+        void close(void);
+
+        // Number of records
+        size_t count(void) const { return records; }
+
+        // Returns a cursor to a record, or to the end if out of range.
+        LogCursor at(size_t record) const;
+
+        // Returns a cursor to the first record with a timestamp no less than
+        // the given one, or to the end if there is none.
+        LogCursor seek(uint64_t timestamp) const;
+
+        // Reads the record at the cursor and moves the cursor to the next one.
+        //
+        // Returns false at the end of the log.
+        bool read(LogCursor& cursor, LogRecord& rec) const;
+
+    private:
+        friend class CaptureLogWriter;
+
+        struct IndexEntry {
+            uint64_t timestamp;
+            uint64_t record;
+            uint64_t offset;
+        };
+
+        const uint8_t* data;
+        size_t size;
+        size_t end; // end of the last whole record
+        uint32_t block;
+        size_t records;
+        IndexEntry* index;
+        size_t index_len;
+
+        bool add_index(const IndexEntry& entry, size_t& capacity);
+
+        CaptureLogReader(const CaptureLogReader&) = delete;
+        CaptureLogReader& operator=(const CaptureLogReader&) = delete;
+    };
+
+    // Sends the bytes of a PackerQueue to a file descriptor with one
+    // writev(), and removes the bytes written. On a non-blocking fd, the
+    // rest stays queued for the next call.
+    //
+    // Returns the number of bytes written, 0 if the queue is empty, -1 if
+    // writev() fails (errno is EAGAIN if the fd is full).
+    template <size_t N>
+    ssize_t WriteQueue(int fd, PackerQueue<N>& queue)
+    {
+        Region regions[2];
+        uint8_t count = queue.peek(regions);
+        if (count == 0)
+            return 0;
+
+        struct iovec iov[2];
+        for (uint8_t ii = 0; ii < count; ++ii) {
+            iov[ii].iov_base = (void*)regions[ii].data;
+            iov[ii].iov_len = regions[ii].len;
+        }
+        ssize_t written = writev(fd, iov, count);
+        if (written > 0)
+            queue.consume(written);
+        return written;
+    }
+
+    // Nanoseconds of CLOCK_MONOTONIC, which can be the clock of an Unpacker:
+    //
+    //     unpacker.set_clock(MsgLite::MonotonicClock);
+    uint64_t MonotonicClock(void);
+
+    // LatencyHistogram counts latencies (or any unsigned values) in log-linear
+    // buckets: values below 64 are counted exactly, larger ones in 32 buckets
+    // per power of two, so quantiles are within 1/32 (3%) of the real ones.
+    //
+    // Recording is a few instructions and does not allocate. It is not thread
+    // safe, each thread should record into its own histogram and merge them:
+    //
+    //     MsgLite::LatencyHistogram total;
+    //     for (int ii = 0; ii < threads; ++ii)
+    //         total.merge(histogram[ii]);
+    //     printf("p50 %llu p99 %llu p999 %llu\n", total.quantile(0.5), total.quantile(0.99), total.quantile(0.999));
+    class LatencyHistogram {
+    public:
+        LatencyHistogram(void);
+
+        // Counts one value.
+        void record(uint64_t value)
+        {
+            buckets[bucket_of(value)]++;
+            if (value < low)
+                low = value;
+            if (value > high)
+                high = value;
+            total++;
+        }
+
+        // Adds the counts of another histogram.
+        void merge(const LatencyHistogram& other);
+
+        // Clears the counts.
+        void reset(void);
+
+        // Number of values, smallest and largest value (0 if empty)
+        uint64_t count(void) const { return total; }
+        uint64_t min(void) const { return total ? low : 0; }
+        uint64_t max(void) const { return high; }
+
+        // Returns the value that q (0 to 1) of the values are no greater than,
+        // such as quantile(0.99) for p99, rounded up to its bucket's largest
+        // value. Returns 0 if empty.
+        uint64_t quantile(double q) const;
+
+        static const uint8_t SUB_BITS = 5;
+        static const size_t BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+
+    private:
+        // Values of 2^e to 2^(e+1) - 1 are split in 2^SUB_BITS buckets by the
+        // SUB_BITS bits after the leading one.
+        static size_t bucket_of(uint64_t value)
+        {
+            if (value < (2u << SUB_BITS))
+                return value;
+            uint8_t group = 63 - __builtin_clzll(value) - SUB_BITS + 1;
+            return ((size_t)group << SUB_BITS) + (value >> (group - 1)) - (1u << SUB_BITS);
+        }
+
+        // Largest value of a bucket
+        static uint64_t bucket_max(size_t bucket);
+
+        uint64_t buckets[BUCKETS];
+        uint64_t total, low, high;
+    };
+
+    // Error rates of a simulated link, as probabilities from 0 to 1
+    struct ChannelErrors {
+        double bit_error_rate; // each bit is flipped
+        double drop_rate;      // each byte is lost
+        double insert_rate;    // a random byte is inserted before each byte
+        double burst_rate;     // a burst starts at each byte
+        uint16_t burst_len;    // bytes replaced by random ones in a burst
+    };
+
+    // What a simulated link did to the bytes sent through it
+    struct ChannelStats {
+        uint64_t bytes_in;
+        uint64_t bytes_out;
+        uint64_t bits_flipped;
+        uint64_t bytes_dropped;
+        uint64_t bytes_inserted;
+        uint64_t bursts;
+    };
+
+    // LossyChannel simulates a noisy link by damaging the bytes sent through
+    // it. Errors come from a pseudo-random generator, so the same seed and
+    // rates always give the same output:
+    //
+    //     MsgLite::ChannelErrors errors = { 1e-4, 1e-5, 1e-5, 1e-6, 16 };
+    //     MsgLite::LossyChannel channel(errors, seed);
+    //     int16_t n = channel.send(msg, out);
+    //
+    // Bursts and bit flips can overlap. A burst carries on across calls.
+    class LossyChannel {
+    public:
+        LossyChannel(const ChannelErrors& errors, uint64_t seed);
+
+        // Sends len bytes and writes what comes out of the link to out, which
+        // must hold 2 * len bytes (every byte may get one inserted before it).
+        //
+        // Returns the number of bytes written.
+        size_t transmit(const uint8_t* data, size_t len, uint8_t* out);
+
+        // Serializes a message with Pack() and sends it. out must hold
+        // 2 * MAX_MSG_LEN bytes.
+        //
+        // Returns the number of bytes written, -1 if the message is invalid.
+        int16_t send(const Message& msg, uint8_t* out);
+
+        // Returns what the link did so far.
+        const ChannelStats& stats(void) const { return counters; }
+
+        // Returns the next pseudo-random number (splitmix64). Exposed so the
+        // caller can draw its test data from the same seed.
+        uint64_t random(void)
+        {
+            uint64_t z = (state += 0x9E3779B97F4A7C15u);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
+            return z ^ (z >> 31);
+        }
+
+    private:
+        // Probabilities scaled to compare with random()
+        uint64_t flip_byte; // at least one bit of a byte is flipped
+        uint64_t flip_first[8]; // the first flipped bit is at most this one
+        uint64_t flip_bit, drop, insert, burst;
+        uint16_t burst_len;
+
+        uint64_t state;
+        uint16_t burst_left;
+        ChannelStats counters;
+    };
+
+    // DfaUnpacker is an alternative to Unpacker (without resync) whose framing
+    // is a precomputed state machine: each byte is mapped to one of a few
+    // classes, and a transition table indexed by state and class gives the
+    // next state, with no branch on the byte itself. Only the end of a frame
+    // is checked, with one CRC over the whole body. The bytes of a bin8 payload
+    // are counted down instead, since its length is data.
+    //
+    // It accepts and rejects exactly the same messages as Unpacker, byte for
+    // byte, and is used the same way. The tables take about 22 KiB.
+    class DfaUnpacker {
+    public:
+        // Same as Unpacker::put(), returns true if a message is available.
+        bool put(uint8_t byte);
+        bool put(const uint8_t* data, size_t len, size_t& consumed);
+
+        // Same as Unpacker::get() and view(), valid until the next put().
+        const Message& get(void);
+        bool get(Message& msg);
+        const MessageView& view(void) const { return msg_view; }
+
+        // Constructor, see Unpacker.
+        DfaUnpacker(uint8_t max_msg_len = MAX_MSG_LEN);
+
+    public:
+        // Exposed internal buffer. After a successful put(), it contains the
+        // message's serialization bytes.
+        Buffer buf;
+
+    private:
+        // Moves the state machine by one byte, returns true if a frame ended.
+        bool feed(uint8_t byte);
+
+        // Checks a frame that ended, returns true if it is a message.
+        bool complete(void);
+
+        bool reset_buffer_on_next_put;
+        uint8_t max_msg_len;
+        uint16_t state;
+        uint8_t bin_left; // bytes of a bin8 payload, not run through the tables
+        Message msg;
+        MessageView msg_view;
+        bool msg_decoded;
+    };
+}
@@ -0,0 +1,912 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "msglite.h"
+#include "msglite_host.h"
+
+// Prevents the compiler from optimizing away a benchmarked result.
+static volatile uint32_t sink;
+
+// Makes the compiler assume *p has changed, so work on it is not hoisted.
+static inline void clobber(const void* p)
+{
+    asm volatile("" : : "r"(p) : "memory");
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Time stamp counter on x86, which runs at a fixed reference rate rather
+// than the core clock. Elsewhere, cycles are not reported.
+static double now_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+struct Result {
+    double ns;     // per iteration
+    double cycles; // per iteration, 0 if unknown
+};
+
+// Runs fn(iterations) after a warm-up and returns the best time per
+// iteration out of several repetitions.
+template <typename Fn>
+static Result measure(Fn fn, long iterations)
+{
+    const int repetitions = 5;
+
+    fn(iterations / 10 + 1); // warm-up
+
+    Result best = { 0, 0 };
+    for (int ii = 0; ii < repetitions; ++ii) {
+        double start = now_ns(), start_cycles = now_cycles();
+        fn(iterations);
+        double cycles = (now_cycles() - start_cycles) / iterations;
+        double elapsed = (now_ns() - start) / iterations;
+        if (ii == 0 || elapsed < best.ns)
+            best = { elapsed, cycles };
+    }
+    return best;
+}
+
+static bool json;
+static int reported;
+
+// Prints a result given the messages and bytes handled per iteration, 0 if
+// not applicable.
+static void report(const char* name, Result r, double msgs, double bytes)
+{
+    double ns_per_msg = msgs > 0 ? r.ns / msgs : 0;
+    double mb_per_s = bytes > 0 ? bytes / r.ns * 1e3 : 0;
+    double cycles_per_byte = bytes > 0 ? r.cycles / bytes : 0;
+
+    if (json) {
+        printf("%s\n  {\"name\": \"%s\"", reported ? "," : "[", name);
+        if (msgs > 0)
+            printf(", \"ns_per_msg\": %.2f", ns_per_msg);
+        if (bytes > 0)
+            printf(", \"mb_per_s\": %.1f", mb_per_s);
+        if (bytes > 0 && r.cycles > 0)
+            printf(", \"cycles_per_byte\": %.3f", cycles_per_byte);
+        printf("}");
+    } else {
+        if (reported == 0)
+            printf("%-44s %13s %12s %14s\n", "", "ns/msg", "MB/s", "cycles/byte");
+        printf("%-44s ", name);
+        msgs > 0 ? printf("%13.1f ", ns_per_msg) : printf("%13s ", "-");
+        bytes > 0 ? printf("%12.1f ", mb_per_s) : printf("%12s ", "-");
+        bytes > 0 && r.cycles > 0 ? printf("%14.2f\n", cycles_per_byte) : printf("%14s\n", "-");
+    }
+    reported++;
+}
+
+// Message shapes of the functional tests
+static MsgLite::Message shapes[3];
+static const char* shape_names[3] = { "empty", "numeric", "largest" };
+static MsgLite::Buffer shape_bufs[3];
+static int shape;
+
+static void bench_pack_unpack(void)
+{
+    const long N = 1000000;
+
+    shapes[0] = MsgLite::Message();
+    shapes[1] = MsgLite::Message(true, (uint8_t)1, (uint16_t)2, (uint32_t)3, (uint64_t)4, (int8_t)-5, (int16_t)-6, (int32_t)-7, (int64_t)-8, 9.0f, 10.0, 11.0f, 12.0, (uint32_t)13, (int64_t)-14);
+    shapes[2] = MsgLite::Message("helloworldhello", "helloworldhello", "helloworldhello", "helloworldhello", "helloworldhello", "helloworldhello", "helloworldhello", "helloworldhello", "helloworldhello", "helloworldhello", "helloworldhello", "helloworldhello", "helloworldhello", "helloworldhello", "helloworldhello");
+
+    char name[64];
+    for (shape = 0; shape < 3; ++shape) {
+        MsgLite::Pack(shapes[shape], shape_bufs[shape]);
+        const double len = shape_bufs[shape].len;
+
+        snprintf(name, sizeof(name), "Pack() %s", shape_names[shape]);
+        report(name, measure([](long n) {
+            MsgLite::Buffer buf;
+            for (long ii = 0; ii < n; ++ii) {
+                clobber(&shapes[shape]);
+                MsgLite::Pack(shapes[shape], buf);
+                sink += buf.data[2];
+            }
+        }, N), 1, len);
+
+        snprintf(name, sizeof(name), "Unpack() %s", shape_names[shape]);
+        report(name, measure([](long n) {
+            MsgLite::Message msg;
+            for (long ii = 0; ii < n; ++ii) {
+                clobber(&shape_bufs[shape]);
+                sink += MsgLite::Unpack(shape_bufs[shape], msg);
+            }
+        }, N), 1, len);
+
+        snprintf(name, sizeof(name), "Unpack() %s into MessageView", shape_names[shape]);
+        report(name, measure([](long n) {
+            MsgLite::MessageView view;
+            for (long ii = 0; ii < n; ++ii) {
+                clobber(&shape_bufs[shape]);
+                sink += MsgLite::Unpack(shape_bufs[shape], view);
+            }
+        }, N), 1, len);
+    }
+}
+
+static uint8_t crc_data[1 << 20];
+static size_t crc_len;
+
+static void bench_crc(void)
+{
+    for (size_t ii = 0; ii < sizeof(crc_data); ++ii)
+        crc_data[ii] = (uint8_t)(ii * 2654435761U >> 24);
+
+    const size_t lens[] = { 16, 240, 4096, 1 << 20 };
+    char name[64];
+    for (size_t len : lens) {
+        crc_len = len;
+        snprintf(name, sizeof(name), "CRC32B() %zu bytes", len);
+        report(name, measure([](long n) {
+            for (long ii = 0; ii < n; ++ii) {
+                clobber(crc_data);
+                sink += MsgLite::CRC32B(0, crc_data, crc_len);
+            }
+        }, (256 << 20) / len), 0, len);
+    }
+}
+
+// Streams of data_static.bin (clean) and data_robustness.bin (lossy), the
+// former repeated to about 1 MiB
+static uint8_t stream[4 << 20];
+static size_t stream_len;
+static bool stream_resync;
+
+static bool load_stream(const char* path)
+{
+    FILE* fd = fopen(path, "rb");
+    if (!fd)
+        return false;
+    size_t file_len = fread(stream, 1, sizeof(stream), fd);
+    fclose(fd);
+    if (file_len == 0 || file_len == sizeof(stream))
+        return false;
+    for (stream_len = file_len; stream_len + file_len <= (1 << 20); stream_len += file_len)
+        memcpy(stream + stream_len, stream, file_len);
+    return true;
+}
+
+static size_t count_stream_msgs(void)
+{
+    MsgLite::Unpacker unpacker(MsgLite::MAX_MSG_LEN, stream_resync);
+    size_t cnt = 0;
+    for (size_t ii = 0; ii < stream_len; ++ii)
+        cnt += unpacker.put(stream[ii]);
+    return cnt;
+}
+
+static void bench_unpacker(void)
+{
+    const char* paths[] = { "./test/data_static.bin", "./test/data_robustness.bin" };
+    const char* data_names[] = { "clean", "lossy" };
+    char name[64];
+    for (int data = 0; data < 2; ++data) {
+        if (!load_stream(paths[data]))
+            continue;
+
+        for (int resync = 0; resync < 2; ++resync) {
+            stream_resync = resync;
+            const char* mode = resync ? ", resync" : "";
+            size_t msgs = count_stream_msgs();
+
+            snprintf(name, sizeof(name), "Unpacker put(byte) %s%s", data_names[data], mode);
+            report(name, measure([](long n) {
+                for (long ii = 0; ii < n; ++ii) {
+                    MsgLite::Unpacker unpacker(MsgLite::MAX_MSG_LEN, stream_resync);
+                    for (size_t jj = 0; jj < stream_len; ++jj)
+                        sink += unpacker.put(stream[jj]);
+                }
+            }, 20), msgs, stream_len);
+
+            snprintf(name, sizeof(name), "Unpacker put(data, len) %s%s", data_names[data], mode);
+            report(name, measure([](long n) {
+                for (long ii = 0; ii < n; ++ii) {
+                    MsgLite::Unpacker unpacker(MsgLite::MAX_MSG_LEN, stream_resync);
+                    for (size_t pos = 0, consumed; pos < stream_len; pos += consumed)
+                        sink += unpacker.put(stream + pos, stream_len - pos, consumed);
+                }
+            }, 20), msgs, stream_len);
+        }
+
+        stream_resync = false;
+        size_t msgs = count_stream_msgs();
+        snprintf(name, sizeof(name), "DfaUnpacker put(byte) %s", data_names[data]);
+        report(name, measure([](long n) {
+            for (long ii = 0; ii < n; ++ii) {
+                MsgLite::DfaUnpacker unpacker;
+                for (size_t jj = 0; jj < stream_len; ++jj)
+                    sink += unpacker.put(stream[jj]);
+            }
+        }, 20), msgs, stream_len);
+
+        snprintf(name, sizeof(name), "DfaUnpacker put(data, len) %s", data_names[data]);
+        report(name, measure([](long n) {
+            for (long ii = 0; ii < n; ++ii) {
+                MsgLite::DfaUnpacker unpacker;
+                for (size_t pos = 0, consumed; pos < stream_len; pos += consumed)
+                    sink += unpacker.put(stream + pos, stream_len - pos, consumed);
+            }
+        }, 20), msgs, stream_len);
+    }
+}
+
+// Fixed telemetry frame: ["imu", float, float, float, uint32_t]
+typedef MsgLite::Schema<const char*, float, float, float, uint32_t> Imu;
+
+static void bench_schema(void)
+{
+    const long N = 2000000;
+
+    MsgLite::Buffer imu;
+    Imu::pack(imu, "imu", 1.0f, 2.0f, 3.0f, 4);
+    const double imu_len = imu.len;
+
+    report("Pack() imu", measure([](long n) {
+        MsgLite::Buffer buf;
+        for (long ii = 0; ii < n; ++ii) {
+            MsgLite::Message msg("imu", 1.0f, 2.0f, (float)ii, (uint32_t)ii);
+            MsgLite::Pack(msg, buf);
+            sink += buf.data[2];
+        }
+    }, N), 1, imu_len);
+
+    report("Schema::pack() imu", measure([](long n) {
+        MsgLite::Buffer buf;
+        for (long ii = 0; ii < n; ++ii) {
+            Imu::pack(buf, "imu", 1.0f, 2.0f, (float)ii, (uint32_t)ii);
+            sink += buf.data[2];
+        }
+    }, N), 1, imu_len);
+
+    report("MessageBuilder imu", measure([](long n) {
+        MsgLite::Buffer buf;
+        for (long ii = 0; ii < n; ++ii) {
+            MsgLite::MessageBuilder(buf).add("imu").add(1.0f).add(2.0f).add((float)ii).add((uint32_t)ii).finish();
+            sink += buf.data[2];
+        }
+    }, N), 1, imu_len);
+
+    static MsgLite::Buffer frame;
+    Imu::pack(frame, "imu", 1.0f, 2.0f, 3.0f, 4);
+
+    report("Unpack() + parse() imu", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii) {
+            MsgLite::Message msg;
+            float x, y, z;
+            uint32_t t;
+            if (MsgLite::Unpack(frame, msg) && msg.parse("imu", x, y, z, t))
+                sink += t;
+        }
+    }, N), 1, imu_len);
+
+    report("Schema::unpack() imu", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii) {
+            float x, y, z;
+            uint32_t t;
+            if (Imu::unpack(frame, "imu", x, y, z, t))
+                sink += t;
+        }
+    }, N), 1, imu_len);
+}
+
+static void on_tag(const MsgLite::MessageView& msg, void* context)
+{
+    int32_t value;
+    if (msg.get(1, value))
+        *(uint32_t*)context += value;
+}
+
+static const int kinds = 64;
+static char tags[kinds][16];
+static MsgLite::Dispatcher<kinds> dispatcher;
+static uint32_t total;
+static MsgLite::MessageView view;
+
+static void bench_dispatcher(void)
+{
+    const long N = 2000000;
+
+    for (int ii = 0; ii < kinds; ++ii) {
+        snprintf(tags[ii], sizeof(tags[ii]), "kind%d", ii);
+        dispatcher.on<int32_t>(tags[ii], on_tag, &total);
+    }
+
+    // Worst case for a parse() chain: the last kind tried
+    MsgLite::Buffer frame;
+    MsgLite::Pack(MsgLite::Message(tags[kinds - 1], (int32_t)1), frame);
+    MsgLite::Unpack(frame, view);
+
+    report("parse() chain, 64 kinds", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii) {
+            clobber(&view);
+            int32_t value;
+            for (int jj = 0; jj < kinds; ++jj) {
+                const char(&tag)[16] = tags[jj]; // const, so used as filter
+                if (view.parse(tag, value)) {
+                    total += value;
+                    break;
+                }
+            }
+        }
+    }, N / 10), 1, 0);
+
+    report("Dispatcher::dispatch(), 64 kinds", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii) {
+            clobber(&view);
+            dispatcher.dispatch(view);
+        }
+    }, N), 1, 0);
+
+    sink += total;
+}
+
+static MsgLite::Message batch[256];
+static uint8_t batch_buf[256 * MsgLite::MAX_MSG_LEN];
+static MsgLite::PackerQueue<4096> tx_queue;
+static const size_t tx_ring_len = 4096 + 7;
+static uint8_t tx_ring[tx_ring_len];
+
+static void bench_batch_pack(void)
+{
+    const long N = 20000;
+
+    for (int ii = 0; ii < 256; ++ii)
+        batch[ii] = MsgLite::Message("imu", 1.0f, 2.0f, (float)ii, (uint32_t)ii);
+
+    report("Pack() x256 into one array", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii) {
+            size_t written = 0;
+            for (int jj = 0; jj < 256; ++jj)
+                written += MsgLite::Pack(batch[jj], batch_buf + written, MsgLite::MAX_MSG_LEN);
+            sink += written;
+        }
+    }, N), 256, 256.0 * batch[0].size());
+
+    report("Batch Pack() x256", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii) {
+            size_t written;
+            MsgLite::Pack(batch, 256, batch_buf, sizeof(batch_buf), written);
+            sink += written;
+        }
+    }, N), 256, 256.0 * batch[0].size());
+
+    // Transmit path: queue the messages and take the bytes out
+    report("Packer put() + get() per byte x256", measure([](long n) {
+        MsgLite::Packer packer;
+        for (long ii = 0; ii < n; ++ii) {
+            size_t written = 0;
+            for (int jj = 0; jj < 256; ++jj) {
+                packer.put(batch[jj]);
+                for (int c; (c = packer.get()) != -1;)
+                    batch_buf[written++] = c;
+            }
+            sink += written;
+        }
+    }, N), 256, 256.0 * batch[0].size());
+
+    // Ring of 4096 + 7 bytes, so that messages keep wrapping at new places
+    report("Pack() to Buffer + copy into ring x256", measure([](long n) {
+        size_t tail = 0;
+        for (long ii = 0; ii < n; ++ii) {
+            for (int jj = 0; jj < 256; ++jj) {
+                MsgLite::Buffer buf;
+                MsgLite::Pack(batch[jj], buf);
+                size_t first = buf.len < tx_ring_len - tail ? buf.len : tx_ring_len - tail;
+                memcpy(tx_ring + tail, buf.data, first);
+                memcpy(tx_ring, buf.data + first, buf.len - first);
+                tail = (tail + buf.len) % tx_ring_len;
+            }
+            sink += tail;
+        }
+    }, N), 256, 256.0 * batch[0].size());
+
+    report("Pack() wrapping into ring x256", measure([](long n) {
+        size_t tail = 0;
+        for (long ii = 0; ii < n; ++ii) {
+            for (int jj = 0; jj < 256; ++jj) {
+                int16_t len = MsgLite::Pack(batch[jj], tx_ring + tail, tx_ring_len - tail, tx_ring, tail);
+                tail = (tail + len) % tx_ring_len;
+            }
+            sink += tail;
+        }
+    }, N), 256, 256.0 * batch[0].size());
+
+    report("PackerQueue<4096> put() + get(out, n) x256", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii) {
+            size_t written = 0;
+            for (int jj = 0; jj < 256; ++jj) {
+                while (!tx_queue.put(batch[jj]))
+                    written += tx_queue.get(batch_buf + written, sizeof(batch_buf) - written);
+            }
+            written += tx_queue.get(batch_buf + written, sizeof(batch_buf) - written);
+            sink += written;
+        }
+    }, N), 256, 256.0 * batch[0].size());
+}
+
+// Synthetic traffic: each channel streams imu frames, put in 4 KiB reads.
+static const uint32_t pool_channels = 256;
+static const size_t pool_stream_len = 64 * 1024;
+static uint8_t pool_streams[pool_channels][pool_stream_len];
+static size_t pool_msgs;
+static volatile uint32_t pool_received;
+
+static void count_message(uint32_t channel, const MsgLite::Message& msg, void* context)
+{
+    (void)channel;
+    (void)msg;
+    (void)context;
+    __atomic_fetch_add(&pool_received, 1, __ATOMIC_RELAXED);
+}
+
+static void bench_unpacker_pool(void)
+{
+    pool_msgs = 0;
+    for (uint32_t ch = 0; ch < pool_channels; ++ch) {
+        size_t len = 0;
+        for (uint32_t seq = 0;; ++seq) {
+            MsgLite::Buffer buf;
+            Imu::pack(buf, "imu", 1.0f, 2.0f, (float)ch, seq);
+            if (len + buf.len > pool_stream_len)
+                break;
+            memcpy(pool_streams[ch] + len, buf.data, buf.len);
+            len += buf.len;
+            pool_msgs++;
+        }
+        memset(pool_streams[ch] + len, 0, pool_stream_len - len);
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (uint8_t workers = 1; workers <= 8; workers *= 2) {
+        MsgLite::UnpackerPool pool(pool_channels, workers, count_message, nullptr);
+        if (!pool.start())
+            return;
+
+        static MsgLite::UnpackerPool* running;
+        running = &pool;
+        Result r = measure([](long n) {
+            for (long ii = 0; ii < n; ++ii) {
+                for (size_t pos = 0; pos < pool_stream_len; pos += 4096) {
+                    for (uint32_t ch = 0; ch < pool_channels; ++ch)
+                        running->put(ch, pool_streams[ch] + pos, 4096);
+                }
+                running->flush();
+            }
+        }, 10);
+
+        char name[64];
+        snprintf(name, sizeof(name), "UnpackerPool %u worker(s), %ld cpu(s)", workers, cpus);
+        report(name, r, pool_msgs, pool_channels * pool_stream_len);
+    }
+    sink += pool_received;
+}
+
+// Receive path cost per message, with the consumer side run inline: a
+// mutex-protected deep copy of get() against decoding into a ring slot.
+static MsgLite::MessageRing<256> ring;
+static MsgLite::Message locked_queue[256];
+static pthread_mutex_t locked_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t ring_stream[256 * 32];
+static size_t ring_stream_len;
+
+static void bench_message_ring(void)
+{
+    ring_stream_len = 0;
+    for (uint32_t ii = 0; ii < 256; ++ii) {
+        MsgLite::Buffer buf;
+        Imu::pack(buf, "imu", 1.0f, 2.0f, 3.0f, ii);
+        memcpy(ring_stream + ring_stream_len, buf.data, buf.len);
+        ring_stream_len += buf.len;
+    }
+
+    report("get() + copy under mutex", measure([](long n) {
+        MsgLite::Unpacker unpacker;
+        for (long ii = 0; ii < n; ++ii) {
+            uint32_t count = 0;
+            for (size_t pos = 0, consumed; pos < ring_stream_len; pos += consumed) {
+                if (unpacker.put(ring_stream + pos, ring_stream_len - pos, consumed)) {
+                    pthread_mutex_lock(&locked_queue_mutex);
+                    locked_queue[count++] = unpacker.get();
+                    pthread_mutex_unlock(&locked_queue_mutex);
+                }
+            }
+            sink += locked_queue[count - 1].len;
+        }
+    }, 20000), 256, ring_stream_len);
+
+    report("get() into MessageRing slot", measure([](long n) {
+        MsgLite::Unpacker unpacker;
+        for (long ii = 0; ii < n; ++ii) {
+            for (size_t pos = 0, consumed; pos < ring_stream_len; pos += consumed) {
+                if (unpacker.put(ring_stream + pos, ring_stream_len - pos, consumed)) {
+                    MsgLite::Message* slot = ring.reserve();
+                    if (slot && unpacker.get(*slot))
+                        ring.publish();
+                }
+            }
+            while (MsgLite::Message* msg = ring.front()) {
+                sink += msg->len;
+                ring.release();
+            }
+        }
+    }, 20000), 256, ring_stream_len);
+}
+
+// Lossy capture: data_robustness.bin repeated to 64 MiB
+static void bench_capture_reader(void)
+{
+    MsgLite::CaptureReader file;
+    if (!file.open("./test/data_robustness.bin") || file.size() == 0)
+        return;
+
+    const size_t size = 64 << 20;
+    static uint8_t* capture;
+    static size_t capture_size;
+    capture = (uint8_t*)malloc(size);
+    if (!capture)
+        return;
+    for (capture_size = 0; capture_size + file.size() <= size; capture_size += file.size())
+        memcpy(capture + capture_size, file.data(), file.size());
+
+    Result r = measure([](long n) {
+        for (long ii = 0; ii < n; ++ii) {
+            MsgLite::Unpacker unpacker(MsgLite::MAX_MSG_LEN, true);
+            for (size_t pos = 0, consumed; pos < capture_size; pos += consumed)
+                sink += unpacker.put(capture + pos, capture_size - pos, consumed);
+        }
+    }, 2);
+    report("Unpacker bulk put(), resync, 64 MiB", r, 0, capture_size);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (uint8_t threads = 1; threads <= 8; threads *= 2) {
+        static uint8_t running_threads;
+        running_threads = threads;
+        r = measure([](long n) {
+            MsgLite::CaptureReader reader;
+            reader.open(capture, capture_size);
+            for (long ii = 0; ii < n; ++ii) {
+                reader.recover(running_threads);
+                sink += reader.count();
+            }
+        }, 2);
+
+        char name[64];
+        snprintf(name, sizeof(name), "CaptureReader %u thread(s), %ld cpu(s)", threads, cpus);
+        report(name, r, 0, capture_size);
+    }
+    free(capture);
+}
+
+static MsgLite::LatencyHistogram histogram;
+
+static void bench_latency(void)
+{
+    if (!load_stream("./test/data_static.bin"))
+        return;
+    size_t msgs = count_stream_msgs();
+
+    // Clean stream read in 4 KiB blocks, each stamped with the monotonic
+    // clock, and the latency of each message recorded
+    report("Unpacker put(data, len) clean, clock", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii) {
+            MsgLite::Unpacker unpacker;
+            unpacker.set_clock(MsgLite::MonotonicClock);
+            for (size_t pos = 0; pos < stream_len; pos += 4096) {
+                size_t block = stream_len - pos < 4096 ? stream_len - pos : 4096;
+                for (size_t off = 0, consumed; off < block; off += consumed) {
+                    if (unpacker.put(stream + pos + off, block - off, consumed))
+                        histogram.record(MsgLite::MonotonicClock() - unpacker.timestamp());
+                }
+            }
+        }
+    }, 20), msgs, stream_len);
+
+    static const long values = 1 << 20;
+    report("LatencyHistogram record", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii) {
+            uint64_t value = 1000;
+            for (long jj = 0; jj < values; ++jj) {
+                histogram.record(value);
+                value = value * 6364136223846793005u + 1442695040888963407u;
+                value >>= 40;
+            }
+        }
+    }, 20), values, 0);
+
+    report("LatencyHistogram quantile", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii)
+            sink += histogram.quantile(0.999);
+    }, 10000), 1, 0);
+}
+
+// Message number seq sent over a simulated link
+static MsgLite::Message link_message(uint32_t seq)
+{
+    if (seq % 3 == 0)
+        return MsgLite::Message(seq, "imu", 0.5f * seq, -1.0f, 9.8f);
+    if (seq % 3 == 1)
+        return MsgLite::Message(seq, (uint8_t)seq, true);
+    return MsgLite::Message(seq, "status report", "all systems nominal", (int64_t)seq * 1000);
+}
+
+static const uint32_t link_sent = 20000;
+static uint8_t link_stream[2 * link_sent * 64]; // messages are below 64 bytes
+static size_t link_len;
+static bool link_resync;
+static bool link_seen[link_sent];
+
+// Prints how many of the sent messages were recovered, and how many
+// accepted messages were never sent.
+static void report_recovery(const char* name, uint32_t sent, uint32_t recovered, uint32_t false_accepts)
+{
+    if (json) {
+        printf("%s\n  {\"name\": \"%s\", \"sent\": %u, \"recovered\": %u, \"false_accepts\": %u}", reported ? "," : "[",
+            name, sent, recovered, false_accepts);
+    } else {
+        printf("%-44s recovered %u/%u (%.2f%%), false accepts %u\n", name, recovered, sent, 100.0 * recovered / sent,
+            false_accepts);
+    }
+    reported++;
+}
+
+// Sweeps the bit error rate of a simulated link. Bytes are also dropped and
+// inserted at 1/8 of it, and bursts of 16 random bytes start at 1/64 of it.
+static void bench_lossy_channel(void)
+{
+    const double rates[] = { 0, 1e-6, 1e-5, 1e-4, 1e-3, 1e-2 };
+    char name[64];
+    for (double ber : rates) {
+        MsgLite::ChannelErrors errors = { ber, ber / 8, ber / 8, ber / 64, 16 };
+        MsgLite::LossyChannel channel(errors, 1);
+        link_len = 0;
+        for (uint32_t seq = 0; seq < link_sent; ++seq)
+            link_len += channel.send(link_message(seq), link_stream + link_len);
+
+        for (int resync = 0; resync < 2; ++resync) {
+            link_resync = resync;
+            const char* mode = resync ? ", resync" : "";
+
+            MsgLite::Unpacker unpacker(MsgLite::MAX_MSG_LEN, resync);
+            uint32_t recovered = 0, false_accepts = 0;
+            memset(link_seen, 0, sizeof(link_seen));
+            for (size_t pos = 0, consumed; pos < link_len; pos += consumed) {
+                if (!unpacker.put(link_stream + pos, link_len - pos, consumed))
+                    continue;
+                const MsgLite::Message& msg = unpacker.get();
+                uint32_t seq;
+                if (msg.len > 0 && msg.obj[0].cast_to(seq) && seq < link_sent && msg == link_message(seq)) {
+                    recovered += !link_seen[seq];
+                    link_seen[seq] = true;
+                } else {
+                    false_accepts++;
+                }
+            }
+            snprintf(name, sizeof(name), "Link ber=%g%s", ber, mode);
+            report_recovery(name, link_sent, recovered, false_accepts);
+
+            snprintf(name, sizeof(name), "Link ber=%g put(data, len)%s", ber, mode);
+            report(name, measure([](long n) {
+                for (long ii = 0; ii < n; ++ii) {
+                    MsgLite::Unpacker unpacker(MsgLite::MAX_MSG_LEN, link_resync);
+                    for (size_t pos = 0, consumed; pos < link_len; pos += consumed)
+                        sink += unpacker.put(link_stream + pos, link_len - pos, consumed);
+                }
+            }, 20), link_sent, link_len);
+        }
+    }
+}
+
+#ifdef MSGLITE_LARGE_MESSAGES
+// A record of 600 floats, as one large frame or as 40 default frames of 15.
+static const int record_floats = 600;
+static const int records = 256;
+static uint8_t small_frames[records * (record_floats / 15) * MsgLite::MAX_MSG_LEN];
+static size_t small_frames_len;
+static uint8_t large_frames[records * MsgLite::LARGE_MAX_MSG_LEN];
+static size_t large_frames_len;
+static MsgLite::LargeUnpacker large_unpacker;
+
+static size_t pack_small_record(uint8_t* buf, int seq)
+{
+    size_t len = 0;
+    for (int frame = 0; frame < record_floats / 15; ++frame) {
+        MsgLite::MessageBuilder builder(buf + len, MsgLite::MAX_MSG_LEN);
+        for (int ii = 0; ii < 15; ++ii)
+            builder.add((float)(seq + frame * 15 + ii));
+        len += builder.finish();
+    }
+    return len;
+}
+
+static size_t pack_large_record(uint8_t* buf, int seq)
+{
+    MsgLite::LargeMessageBuilder builder(buf, MsgLite::LARGE_MAX_MSG_LEN);
+    for (int ii = 0; ii < record_floats; ++ii)
+        builder.add((float)(seq + ii));
+    return builder.finish();
+}
+
+static void bench_large(void)
+{
+    small_frames_len = large_frames_len = 0;
+    for (int seq = 0; seq < records; ++seq) {
+        small_frames_len += pack_small_record(small_frames + small_frames_len, seq);
+        large_frames_len += pack_large_record(large_frames + large_frames_len, seq);
+    }
+
+    report("MessageBuilder 600 floats, 40 frames", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii)
+            sink += pack_small_record(small_frames, ii);
+    }, 20000), 1, (double)small_frames_len / records);
+
+    report("LargeMessageBuilder 600 floats, 1 frame", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii)
+            sink += pack_large_record(large_frames, ii);
+    }, 20000), 1, (double)large_frames_len / records);
+
+    report("Unpacker put(data, len) 40 frames", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii) {
+            MsgLite::Unpacker unpacker;
+            for (size_t pos = 0, consumed; pos < small_frames_len; pos += consumed)
+                sink += unpacker.put(small_frames + pos, small_frames_len - pos, consumed);
+        }
+    }, 50), records, small_frames_len);
+
+    report("LargeUnpacker put(data, len) 1 frame", measure([](long n) {
+        for (long ii = 0; ii < n; ++ii) {
+            large_unpacker = MsgLite::LargeUnpacker();
+            for (size_t pos = 0, consumed; pos < large_frames_len; pos += consumed)
+                sink += large_unpacker.put(large_frames + pos, large_frames_len - pos, consumed);
+        }
+    }, 50), records, large_frames_len);
+}
+#endif
+
+// A block of 112 ADC sample bytes, sent as hex digits in 15 strings (the
+// workaround for bytes that may be '\0') or as one bin8 object.
+static uint8_t adc_block[112];
+static MsgLite::Buffer hex_frame, bin_frame;
+
+static void pack_hex_block(MsgLite::Buffer& buf, const uint8_t* block)
+{
+    static const char digits[] = "0123456789abcdef";
+    char hex[2 * sizeof(adc_block)];
+    for (size_t ii = 0; ii < sizeof(adc_block); ++ii) {
+        hex[2 * ii] = digits[block[ii] >> 4];
+        hex[2 * ii + 1] = digits[block[ii] & 0x0F];
+    }
+    MsgLite::MessageBuilder builder(buf);
+    for (size_t pos = 0; pos < sizeof(hex); pos += 15)
+        builder.add(hex + pos, sizeof(hex) - pos < 15 ? sizeof(hex) - pos : 15);
+    builder.finish();
+}
+
+static bool unpack_hex_block(const MsgLite::Buffer& buf, uint8_t* block)
+{
+    MsgLite::MessageView view;
+    if (!MsgLite::Unpack(buf, view))
+        return false;
+    size_t pos = 0;
+    for (uint8_t ii = 0; ii < view.len; ++ii) {
+        const char* str;
+        uint8_t str_len;
+        if (!view.get(ii, str, str_len) || pos + str_len > 2 * sizeof(adc_block))
+            return false;
+        for (uint8_t jj = 0; jj < str_len; ++jj, ++pos) {
+            char c = str[jj];
+            uint8_t nibble = c <= '9' ? c - '0' : c - 'a' + 10;
+            block[pos / 2] = pos % 2 ? block[pos / 2] | nibble : nibble << 4;
+        }
+    }
+    return pos == 2 * sizeof(adc_block);
+}
+
+static void bench_binary(void)
+{
+    const long N = 1000000;
+    for (size_t ii = 0; ii < sizeof(adc_block); ++ii)
+        adc_block[ii] = (uint8_t)(ii * 37);
+    pack_hex_block(hex_frame, adc_block);
+    MsgLite::MessageBuilder(bin_frame).add(MsgLite::Blob { adc_block, sizeof(adc_block) }).finish();
+
+    report("MessageBuilder 112 bytes as hex strings", measure([](long n) {
+        MsgLite::Buffer buf;
+        for (long ii = 0; ii < n; ++ii) {
+            adc_block[0] = (uint8_t)ii;
+            pack_hex_block(buf, adc_block);
+            sink += buf.data[2];
+        }
+    }, N), 1, hex_frame.len);
+
+    report("MessageBuilder 112 bytes as bin8", measure([](long n) {
+        MsgLite::Buffer buf;
+        for (long ii = 0; ii < n; ++ii) {
+            adc_block[0] = (uint8_t)ii;
+            MsgLite::MessageBuilder(buf).add(MsgLite::Blob { adc_block, sizeof(adc_block) }).finish();
+            sink += buf.data[2];
+        }
+    }, N), 1, bin_frame.len);
+
+    report("Unpack() 112 bytes as hex strings", measure([](long n) {
+        uint8_t block[sizeof(adc_block)];
+        for (long ii = 0; ii < n; ++ii) {
+            if (unpack_hex_block(hex_frame, block))
+                sink += block[ii % sizeof(block)];
+        }
+    }, N), 1, hex_frame.len);
+
+    report("Unpack() 112 bytes as bin8", measure([](long n) {
+        uint8_t block[sizeof(adc_block)];
+        for (long ii = 0; ii < n; ++ii) {
+            MsgLite::MessageView view;
+            MsgLite::Blob blob;
+            if (MsgLite::Unpack(bin_frame, view) && view.get(0, blob)) {
+                memcpy(block, blob.data, blob.len);
+                sink += block[ii % sizeof(block)];
+            }
+        }
+    }, N), 1, bin_frame.len);
+}
+
+// Usage: bench [--json] [filter]
+//
+// Runs the groups whose name contains filter, all by default. With --json,
+// results are printed as a JSON array to compare builds.
+int main(int argc, char** argv)
+{
+    const char* filter = "";
+    for (int ii = 1; ii < argc; ++ii) {
+        if (strcmp(argv[ii], "--json") == 0)
+            json = true;
+        else
+            filter = argv[ii];
+    }
+
+    struct {
+        const char* name;
+        void (*run)(void);
+    } groups[] = {
+        { "pack", bench_pack_unpack },
+        { "crc", bench_crc },
+        { "unpacker", bench_unpacker },
+        { "schema", bench_schema },
+        { "dispatcher", bench_dispatcher },
+        { "batch", bench_batch_pack },
+        { "pool", bench_unpacker_pool },
+        { "ring", bench_message_ring },
+        { "capture", bench_capture_reader },
+        { "latency", bench_latency },
+        { "link", bench_lossy_channel },
+#ifdef MSGLITE_LARGE_MESSAGES
+        { "large", bench_large },
+#endif
+        { "binary", bench_binary },
+    };
+    for (auto& group : groups) {
+        if (strstr(group.name, filter))
+            group.run();
+    }
+
+    if (json)
+        printf("%s]\n", reported ? "\n" : "[");
+    return 0;
+}
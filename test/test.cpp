@@ -1,11 +1,20 @@
 #include <cassert>
+#include <cerrno>
 #include <cstring>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
 
 #include "msglite.h"
+#include "msglite_host.h"
 
 void pedantic_checks();
 void print(const MsgLite::Message& msg);
@@ -193,6 +202,73 @@ int main(void)
 
         fclose(fd);
     }
+
+    // test stream unpacker with resync on lossy data
+    if (true) {
+        MsgLite::Unpacker resync_unpacker(40, true);
+
+        FILE* fd = fopen("./test/data_robustness.bin", "rb");
+
+        int c, cnt = 0;
+        while ((c = fgetc(fd)) != EOF) {
+            if (resync_unpacker.put(c))
+                cnt++;
+        }
+        assert(4500 <= cnt && cnt <= 5500);
+        printf("Number of messages unpacked from lossy data stream with resync: %d\n", cnt);
+
+        fclose(fd);
+    }
+
+    // test resync recovers a message whose header is inside a truncated one
+    if (true) {
+        MsgLite::Buffer truncated, valid;
+        MsgLite::Pack(MsgLite::Message("helloworld", (uint32_t)1), truncated);
+        MsgLite::Pack(MsgLite::Message("hello"), valid);
+
+        MsgLite::Unpacker plain, resync(MsgLite::MAX_MSG_LEN, true);
+        int plain_cnt = 0, resync_cnt = 0;
+        for (int ii = 0; ii < 10; ++ii) {
+            plain_cnt += plain.put(truncated.data[ii]);
+            resync_cnt += resync.put(truncated.data[ii]);
+        }
+        for (int ii = 0; ii < valid.len; ++ii) {
+            plain_cnt += plain.put(valid.data[ii]);
+            resync_cnt += resync.put(valid.data[ii]);
+        }
+        assert(plain_cnt == 0);
+        assert(resync_cnt == 1);
+        assert(resync.get().parse("hello"));
+    }
+
+    // test bulk stream unpacker gives the same messages as the byte-wise one
+    for (int resync = 0; resync < 2; ++resync) {
+        const size_t chunk_sizes[] = { 1, 7, 250, 4096 };
+        for (size_t chunk_size : chunk_sizes) {
+            MsgLite::Unpacker bytewise(40, resync), bulk(40, resync);
+
+            FILE* fd = fopen("./test/data_robustness.bin", "rb");
+
+            static uint8_t chunk[4096];
+            size_t len, cnt = 0;
+            while ((len = fread(chunk, 1, chunk_size, fd)) > 0) {
+                size_t pos = 0, consumed;
+                while (pos < len) {
+                    bool ok = bulk.put(chunk + pos, len - pos, consumed);
+                    for (size_t ii = pos; ii < pos + consumed; ++ii)
+                        assert(bytewise.put(chunk[ii]) == (ok && ii == pos + consumed - 1));
+                    if (ok) {
+                        cnt++;
+                        assert(bulk.get() == bytewise.get());
+                    }
+                    pos += consumed;
+                }
+            }
+            assert(4500 <= cnt && cnt <= 5500);
+
+            fclose(fd);
+        }
+    }
 }
 
 void print(const MsgLite::Message& msg)
@@ -252,6 +328,10 @@ void print(const MsgLite::Message& msg)
                 printf("|   %2d: \"%s\" (String)\n", i + 1, msg.obj[i].as.String);
                 break;
             }
+            case MsgLite::Object::Binary: {
+                printf("|   %2d: %d bytes (Binary)\n", i + 1, msg.obj[i].as.Binary.len);
+                break;
+            }
             default: {
                 break;
             }
@@ -435,6 +515,20 @@ void test_checksum()
 {
     const uint8_t x[] = "123456789";
     assert(MsgLite::CRC32B(0, x, 9) == 0xCBF43926);
+
+    // Long and unaligned input must match the byte-at-a-time result
+    static uint8_t y[1000];
+    for (size_t ii = 0; ii < sizeof(y); ++ii)
+        y[ii] = ii * 131 + (ii >> 3);
+    for (size_t offset = 0; offset < 16; ++offset) {
+        uint32_t crc = 0;
+        for (size_t ii = offset; ii < sizeof(y); ++ii)
+            crc = MsgLite::CRC32B(crc, y + ii, 1);
+        assert(MsgLite::CRC32B(0, y + offset, sizeof(y) - offset) == crc);
+        assert(MsgLite::CRC32B(MsgLite::CRC32B(0, y + offset, 333), y + offset + 333, sizeof(y) - offset - 333) == crc);
+        assert(MsgLite::CRC32B_combine(MsgLite::CRC32B(0, y, offset), MsgLite::CRC32B(0, y + offset, sizeof(y) - offset), sizeof(y) - offset) == MsgLite::CRC32B(0, y, sizeof(y)));
+    }
+    assert(MsgLite::CRC32B_combine(MsgLite::CRC32B(0, x, 4), MsgLite::CRC32B(0, x + 4, 5), 5) == 0xCBF43926);
 }
 
 void test_parse()
@@ -476,6 +570,1725 @@ void test_parse()
     assert(MsgLite::Message().parse());
 }
 
+void test_message_view()
+{
+    MsgLite::Message msg("imu", 1.5f, (uint32_t)7, "helloworldhello", true);
+    MsgLite::Buffer buf;
+    assert(MsgLite::Pack(msg, buf));
+
+    MsgLite::MessageView view;
+    assert(MsgLite::Unpack(buf, view));
+    assert(view.len == 5);
+
+    // Typed access
+    float f = 0;
+    uint32_t u = 0;
+    bool b = false;
+    assert(view.get(1, f) && f == 1.5f);
+    assert(view.get(2, u) && u == 7);
+    assert(view.get(4, b) && b);
+    assert(!view.get(1, u));
+    assert(!view.get(5, u));
+
+    // Zero-copy strings
+    const char* str;
+    uint8_t str_len;
+    assert(view.get(0, str, str_len) && str_len == 3 && memcmp(str, "imu", 3) == 0);
+    assert(view.get(3, str, str_len) && str_len == 15 && str == (const char*)buf.data + 22);
+    assert(!view.get(1, str, str_len));
+
+    // Filters
+    char s[16];
+    assert(view.parse("imu", f, u, s, b));
+    assert(strcmp(s, "helloworldhello") == 0);
+    assert(!view.parse("gps", f, u, s, b));
+    assert(!view.parse("imu", f, u, s));
+
+    // Full decoding
+    MsgLite::Message msg2;
+    assert(MsgLite::Unpack(view, msg2));
+    assert(msg == msg2);
+
+    // Checksum mismatch
+    buf.data[10] ^= 1;
+    assert(!MsgLite::Unpack(buf, view));
+
+    // Stream unpacker
+    MsgLite::Unpacker unpacker;
+    MsgLite::Pack(msg, buf);
+    for (int ii = 0; ii < buf.len; ++ii) {
+        if (unpacker.put(buf.data[ii])) {
+            assert(unpacker.view().parse("imu", f, u, s, b));
+            assert(unpacker.get() == msg);
+        }
+    }
+
+    MsgLite::Pack(MsgLite::Message(), buf);
+    assert(MsgLite::Unpack(buf, view) && view.parse());
+}
+
+void test_compact_message()
+{
+    assert(sizeof(MsgLite::CompactMessage) < sizeof(MsgLite::Message) * 2 / 3);
+
+    MsgLite::Message msg(false, true, (uint8_t)1, (uint16_t)2, (uint32_t)3, (uint64_t)4, (int8_t)-1, (int16_t)-2, (int32_t)-3, (int64_t)-4, 1.0f, 2.0, Inf, NaN, "end");
+    MsgLite::CompactMessage compact;
+    assert(compact.from(msg));
+    assert(compact.size() == msg.size());
+
+    // Same serialization as Message
+    MsgLite::Buffer buf, buf2;
+    assert(MsgLite::Pack(msg, buf));
+    assert(MsgLite::Pack(compact, buf2));
+    assert(buf.len == buf2.len && memcmp(buf.data, buf2.data, buf.len) == 0);
+
+    // Round trip
+    MsgLite::CompactMessage compact2;
+    assert(MsgLite::Unpack(buf, compact2));
+    assert(compact == compact2);
+    MsgLite::Message msg2;
+    assert(compact2.to(msg2));
+    assert(msg == msg2);
+
+    // Accessors
+    MsgLite::CompactMessage imu("imu", 1.5f, (uint32_t)7);
+    char s[16];
+    float f;
+    uint32_t u;
+    assert(imu.parse("imu", f, u) && f == 1.5f && u == 7);
+    assert(imu.parse(s, f, u) && strcmp(s, "imu") == 0);
+    assert(!imu.parse("gps", f, u));
+    assert(imu.get(2, u) && !imu.get(1, u));
+    assert(!(imu == compact));
+
+    // Invalid objects
+    MsgLite::Message broken(false);
+    broken.obj[0].as.Uint8 = 2;
+    compact2 = compact;
+    assert(!compact.from(broken));
+    assert(compact == compact2 && compact.len == 15);
+    const uint8_t bytes[15] = { 0 };
+    MsgLite::CompactMessage too_long("imu", MsgLite::Blob { bytes, 15 });
+    assert(too_long.len == 0 && too_long.size() == MsgLite::MIN_MSG_LEN);
+    assert(MsgLite::CompactMessage().parse());
+
+    // A failed Unpack() overwrites no slot, not even those before the binary
+    // object that does not fit.
+    assert(MsgLite::Pack(MsgLite::Message("imu", MsgLite::Blob { bytes, 15 }), buf));
+    compact2 = compact;
+    assert(!MsgLite::Unpack(buf, compact2));
+    assert(compact == compact2 && compact2.len == 15);
+}
+
+void test_schema()
+{
+    typedef MsgLite::Schema<const char*, float, float, float, uint32_t> Imu;
+    static_assert(Imu::max_size == 7 + 16 + 5 * 4, "Imu::max_size");
+
+    // Same bytes as Pack()
+    MsgLite::Buffer buf, buf2;
+    assert(Imu::pack(buf, "imu", 1.0f, -2.5f, 3.25f, 42));
+    assert(MsgLite::Pack(MsgLite::Message("imu", 1.0f, -2.5f, 3.25f, (uint32_t)42), buf2));
+    assert(buf.len == buf2.len && memcmp(buf.data, buf2.data, buf.len) == 0);
+
+    typedef MsgLite::Schema<bool, bool, uint8_t, uint16_t, uint32_t, uint64_t, int8_t, int16_t, int32_t, int64_t, float, double, double, double, const char*> All;
+    assert(All::pack(buf, false, true, 1, 2, 3, 4, -1, -2, -3, -4, 1.0f, 2.0, Inf, NaN, "end"));
+    assert(MsgLite::Pack(MsgLite::Message(false, true, (uint8_t)1, (uint16_t)2, (uint32_t)3, (uint64_t)4, (int8_t)-1, (int16_t)-2, (int32_t)-3, (int64_t)-4, 1.0f, 2.0, Inf, NaN, "end"), buf2));
+    assert(buf.len == buf2.len && memcmp(buf.data, buf2.data, buf.len) == 0);
+    assert(MsgLite::Schema<>::pack(buf) && buf.len == MsgLite::MIN_MSG_LEN);
+
+    // Unpack with filter
+    float x, y, z;
+    uint32_t t;
+    assert(Imu::pack(buf, "imu", 1.0f, -2.5f, 3.25f, 42));
+    assert(Imu::unpack(buf, "imu", x, y, z, t));
+    assert(x == 1.0f && y == -2.5f && z == 3.25f && t == 42);
+    assert(!Imu::unpack(buf, "gps", x, y, z, t));
+    int32_t i;
+    typedef MsgLite::Schema<const char*, float, float, float> ImuWithoutTime;
+    typedef MsgLite::Schema<const char*, float, float, float, int32_t> ImuWithSignedTime;
+    assert(!ImuWithoutTime::unpack(buf, "imu", x, y, z));
+    assert(!ImuWithSignedTime::unpack(buf, "imu", x, y, z, i));
+
+    // Unpack strings
+    char s[16];
+    typedef MsgLite::Schema<char*, float, float, float, uint32_t> AnyImu;
+    assert(AnyImu::unpack(buf, s, x, y, z, t));
+    assert(strcmp(s, "imu") == 0);
+
+    // Checksum mismatch and insufficient space
+    buf.data[10] ^= 1;
+    assert(!Imu::unpack(buf, "imu", x, y, z, t));
+    assert(Imu::pack(buf.data, 10, "imu", x, y, z, t) < 0);
+}
+
+void test_batch_pack()
+{
+    MsgLite::Message msgs[5] = {
+        MsgLite::Message("imu", 1.0f, 2.0f, 3.0f, (uint32_t)4),
+        MsgLite::Message(),
+        MsgLite::Message("gps", 1.0, 2.0),
+        MsgLite::Message(true),
+        MsgLite::Message("last"),
+    };
+    msgs[3].obj[0].type = MsgLite::Object::Untyped; // invalid
+
+    // Same bytes as separate Pack() calls
+    uint8_t buf[1024], expected[1024];
+    size_t expected_len = 0;
+    for (int ii = 0; ii < 5; ++ii) {
+        int16_t n = MsgLite::Pack(msgs[ii], expected + expected_len, 255);
+        if (n > 0)
+            expected_len += n;
+    }
+
+    size_t written;
+    MsgLite::Frame frames[5];
+    assert(MsgLite::Pack(msgs, 5, buf, sizeof(buf), written, frames) == 5);
+    assert(written == expected_len && memcmp(buf, expected, written) == 0);
+    assert(frames[0].offset == 0 && frames[0].len == msgs[0].size());
+    assert(frames[1].offset == (size_t)frames[0].len && frames[1].len == MsgLite::MIN_MSG_LEN);
+    assert(frames[3].len == -1 && frames[4].offset == frames[3].offset);
+
+    for (int ii = 0; ii < 5; ++ii) {
+        if (frames[ii].len > 0) {
+            MsgLite::Message msg;
+            assert(MsgLite::Unpack(buf + frames[ii].offset, frames[ii].len, msg) && msg == msgs[ii]);
+        }
+    }
+
+    // Stops at the first message that does not fit
+    assert(MsgLite::Pack(msgs, 5, buf, frames[2].offset + 1, written) == 2);
+    assert(written == frames[2].offset);
+    assert(MsgLite::Pack(msgs, 5, buf, 0, written) == 0 && written == 0);
+    assert(MsgLite::Pack(msgs, 0, buf, sizeof(buf), written) == 0 && written == 0);
+}
+
+void count_call(const MsgLite::MessageView& msg, void* context)
+{
+    (void)msg;
+    ++*(int*)context;
+}
+
+void test_dispatcher()
+{
+    int imu = 0, imu_v2 = 0, gps = 0, ping = 0;
+    MsgLite::Dispatcher<64> dispatcher;
+    assert((dispatcher.on<float, float, float, uint32_t>("imu", count_call, &imu)));
+    assert((dispatcher.on<float, float, float, uint32_t, bool>("imu", count_call, &imu_v2)));
+    assert((dispatcher.on<double, double, const char*>("gps", count_call, &gps)));
+    assert((dispatcher.on<>("ping", count_call, &ping)));
+    assert((!dispatcher.on<float, float, float, uint32_t>("imu", count_call, &imu)));
+
+    // Many tags still get distinct slots
+    int other = 0;
+    char tag[16];
+    for (int ii = 0; ii < 60; ++ii) {
+        snprintf(tag, sizeof(tag), "tag%d", ii);
+        assert(dispatcher.on<int32_t>(tag, count_call, &other));
+    }
+    assert((!dispatcher.on<int32_t>("full", count_call, &other)));
+
+    MsgLite::Buffer buf;
+    MsgLite::MessageView view;
+    auto route = [&](const MsgLite::Message& msg) {
+        assert(MsgLite::Pack(msg, buf) && MsgLite::Unpack(buf, view));
+        return dispatcher.dispatch(view);
+    };
+    assert(route(MsgLite::Message("imu", 1.0f, 2.0f, 3.0f, (uint32_t)4)) && imu == 1);
+    assert(route(MsgLite::Message("imu", 1.0f, 2.0f, 3.0f, (uint32_t)4, true)) && imu_v2 == 1);
+    assert(route(MsgLite::Message("gps", 1.0, 2.0, "fix")) && gps == 1);
+    assert(route(MsgLite::Message("ping")) && ping == 1);
+    for (int ii = 0; ii < 60; ++ii) {
+        snprintf(tag, sizeof(tag), "tag%d", ii);
+        assert(route(MsgLite::Message(tag, (int32_t)ii)));
+    }
+    assert(other == 60);
+
+    // Unknown tags, wrong types and untagged messages are not routed
+    assert(!route(MsgLite::Message("imx", 1.0f, 2.0f, 3.0f, (uint32_t)4)));
+    assert(!route(MsgLite::Message("imu", 1.0f, 2.0f, 3.0f, (int32_t)4)));
+    assert(!route(MsgLite::Message("imu", 1.0f, 2.0f, 3.0f)));
+    assert(!route(MsgLite::Message("gps", 1.0, 2.0, 3.0)));
+    assert(!route(MsgLite::Message(1.0f, "imu")));
+    assert(!route(MsgLite::Message()));
+    assert(imu == 1 && imu_v2 == 1 && gps == 1 && ping == 1 && other == 60);
+}
+
+struct PoolResult {
+    uint32_t received[16];
+    bool in_order;
+};
+
+void check_order(uint32_t channel, const MsgLite::Message& msg, void* context)
+{
+    // Channels of one worker are only touched by that worker.
+    PoolResult& result = *(PoolResult*)context;
+    uint32_t ch, seq;
+    if (!msg.parse("ch", ch, seq) || ch != channel || seq != result.received[channel])
+        result.in_order = false;
+    result.received[channel]++;
+}
+
+void test_unpacker_pool()
+{
+    // Interleaved channels with garbage between messages, put in uneven
+    // chunks through small batches so put() has to wait for workers.
+    static uint8_t streams[16][200 * 40];
+    size_t stream_len[16] = {}, sent[16] = {};
+    for (uint32_t ch = 0; ch < 16; ++ch) {
+        for (uint32_t seq = 0; seq < 200; ++seq) {
+            MsgLite::Buffer buf;
+            assert(MsgLite::Pack(MsgLite::Message("ch", ch, seq), buf));
+            memcpy(streams[ch] + stream_len[ch], buf.data, buf.len);
+            stream_len[ch] += buf.len;
+            streams[ch][stream_len[ch]++] = (uint8_t)seq;
+        }
+    }
+
+    // Failing allocations leave nothing behind for the destructor.
+    PoolResult result = { {}, true };
+    {
+        MsgLite::UnpackerPool huge(16, 3, check_order, &result, true, SIZE_MAX / 2);
+        assert(!huge.start() && !huge.start());
+    }
+
+    // So does the second thread failing to start in a nearly full address
+    // space, after the first one is stopped. A later start() works.
+    MsgLite::UnpackerPool pool(16, 3, check_order, &result, true, 256);
+    assert(!pool.put(0, streams[0], 1));
+    pthread_attr_t attr;
+    size_t stack_size = 0, pages = 0;
+    assert(pthread_getattr_default_np(&attr) == 0 && pthread_attr_getstacksize(&attr, &stack_size) == 0);
+    pthread_attr_destroy(&attr);
+    FILE* statm = fopen("/proc/self/statm", "r");
+    assert(statm && fscanf(statm, "%zu", &pages) == 1);
+    fclose(statm);
+    struct rlimit saved, limit;
+    assert(getrlimit(RLIMIT_AS, &saved) == 0);
+    limit = saved;
+    limit.rlim_cur = pages * sysconf(_SC_PAGESIZE) + stack_size + (2 << 20);
+    assert(setrlimit(RLIMIT_AS, &limit) == 0);
+    bool started = pool.start();
+    assert(setrlimit(RLIMIT_AS, &saved) == 0);
+    assert(!started && !pool.put(0, streams[0], 1));
+    assert(pool.start());
+    assert(!pool.put(16, streams[0], 1));
+
+    for (size_t step = 0, remaining = 16; remaining > 0; ++step) {
+        remaining = 0;
+        for (uint32_t ch = 0; ch < 16; ++ch) {
+            size_t n = (step * 7 + ch * 13) % 300 + 1;
+            if (n > stream_len[ch] - sent[ch])
+                n = stream_len[ch] - sent[ch];
+            assert(pool.put(ch, streams[ch] + sent[ch], n));
+            sent[ch] += n;
+            remaining += stream_len[ch] - sent[ch];
+        }
+    }
+    pool.flush();
+    for (uint32_t ch = 0; ch < 16; ++ch)
+        assert(result.received[ch] == 200);
+    assert(result.in_order);
+    pool.stop();
+}
+
+struct RingTest {
+    MsgLite::MessageRing<8> ring;
+    MsgLite::MessageQueue<8> queue;
+    uint8_t stream[4000 * 16];
+    size_t stream_len;
+};
+
+void* fill_ring(void* arg)
+{
+    RingTest& t = *(RingTest*)arg;
+    MsgLite::Unpacker unpacker;
+    for (size_t pos = 0; pos < t.stream_len;) {
+        size_t consumed;
+        bool available = unpacker.put(t.stream + pos, t.stream_len - pos, consumed);
+        pos += consumed;
+        if (available) {
+            MsgLite::Message* slot;
+            while (!(slot = t.ring.reserve()))
+                sched_yield();
+            assert(unpacker.get(*slot));
+            t.ring.publish();
+        }
+    }
+    return nullptr;
+}
+
+void* fill_queue(void* arg)
+{
+    RingTest& t = *(RingTest*)arg;
+    static uint32_t next_id = 0;
+    uint32_t id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED) % 4;
+    for (uint32_t seq = 0; seq < 4000; ++seq) {
+        MsgLite::Message* slot;
+        while (!(slot = t.queue.reserve()))
+            sched_yield();
+        *slot = MsgLite::Message(id, seq);
+        t.queue.publish(slot);
+    }
+    return nullptr;
+}
+
+static RingTest ring_test;
+
+void test_message_ring()
+{
+    RingTest& t = ring_test;
+
+    // Single thread: full, empty and wrapping around
+    MsgLite::Unpacker unpacker;
+    MsgLite::Message msg;
+    assert(!unpacker.get(msg));
+    assert(!t.ring.front());
+    for (uint32_t ii = 0; ii < 21; ++ii) {
+        MsgLite::Message* slot = t.ring.reserve();
+        assert(slot);
+        *slot = MsgLite::Message(ii);
+        t.ring.publish();
+        if (ii % 3 == 2) {
+            while (t.ring.reserve())
+                t.ring.publish();
+            assert(!t.ring.reserve());
+            while (t.ring.front())
+                t.ring.release();
+        }
+    }
+    assert(!t.ring.front());
+
+    // Decoding straight into slots from another thread
+    t.stream_len = 0;
+    for (uint32_t seq = 0; seq < 4000; ++seq) {
+        MsgLite::Buffer buf;
+        assert(MsgLite::Pack(MsgLite::Message("seq", seq), buf));
+        memcpy(t.stream + t.stream_len, buf.data, buf.len);
+        t.stream_len += buf.len;
+    }
+    pthread_t producer;
+    assert(pthread_create(&producer, nullptr, fill_ring, &t) == 0);
+    for (uint32_t seq = 0; seq < 4000;) {
+        MsgLite::Message* front = t.ring.front();
+        if (!front) {
+            sched_yield();
+            continue;
+        }
+        uint32_t x;
+        assert(front->parse("seq", x) && x == seq);
+        t.ring.release();
+        seq++;
+    }
+    pthread_join(producer, nullptr);
+    assert(!t.ring.front());
+
+    // Many producers, each one in order
+    pthread_t producers[4];
+    for (int ii = 0; ii < 4; ++ii)
+        assert(pthread_create(&producers[ii], nullptr, fill_queue, &t) == 0);
+    uint32_t expected[4] = {};
+    for (uint32_t received = 0; received < 4 * 4000;) {
+        MsgLite::Message* front = t.queue.front();
+        if (!front) {
+            sched_yield();
+            continue;
+        }
+        uint32_t id, seq;
+        assert(front->parse(id, seq) && id < 4 && seq == expected[id]);
+        expected[id]++;
+        t.queue.release();
+        received++;
+    }
+    for (int ii = 0; ii < 4; ++ii)
+        pthread_join(producers[ii], nullptr);
+    assert(!t.queue.front());
+}
+
+struct ReactorResult {
+    uint32_t received[8];
+    int closed;
+    bool in_order;
+};
+
+void check_fd_order(int fd, const MsgLite::Message& msg, void* context)
+{
+    ReactorResult& result = *(ReactorResult*)context;
+    uint32_t link, seq;
+    if (!msg.parse("link", link, seq) || link >= 8 || seq != result.received[link])
+        result.in_order = false;
+    else
+        result.received[link]++;
+    (void)fd;
+}
+
+void count_closed(int fd, void* context)
+{
+    ((ReactorResult*)context)->closed++;
+    (void)fd;
+}
+
+void test_reactor()
+{
+    // Writers and readers: pty pairs, a pipe and a socketpair
+    int writer[8], reader[8];
+    for (int ii = 0; ii < 6; ++ii) {
+        writer[ii] = posix_openpt(O_RDWR | O_NOCTTY);
+        assert(writer[ii] >= 0 && grantpt(writer[ii]) == 0 && unlockpt(writer[ii]) == 0);
+        reader[ii] = open(ptsname(writer[ii]), O_RDWR | O_NOCTTY);
+        assert(reader[ii] >= 0);
+        struct termios tio;
+        assert(tcgetattr(reader[ii], &tio) == 0);
+        cfmakeraw(&tio);
+        assert(tcsetattr(reader[ii], TCSANOW, &tio) == 0);
+    }
+    int fds[2];
+    assert(pipe(fds) == 0);
+    reader[6] = fds[0], writer[6] = fds[1];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    reader[7] = fds[0], writer[7] = fds[1];
+
+    ReactorResult result = { {}, 0, true };
+    MsgLite::Reactor reactor(512);
+    for (int ii = 0; ii < 8; ++ii)
+        assert(reactor.add(reader[ii], check_fd_order, &result, count_closed));
+    assert(!reactor.add(reader[0], check_fd_order, &result));
+
+    // epoll does not take regular files, which keep their flags.
+    int file = open("./test/data_static.bin", O_RDONLY);
+    assert(file >= 0 && !reactor.add(file, check_fd_order, &result));
+    assert((fcntl(file, F_GETFL) & O_NONBLOCK) == 0);
+    close(file);
+
+    // Messages with garbage in between, written in bursts
+    for (uint32_t seq = 0; seq < 100; ++seq) {
+        for (uint32_t link = 0; link < 8; ++link) {
+            MsgLite::Buffer buf;
+            assert(MsgLite::Pack(MsgLite::Message("link", link, seq), buf));
+            buf.data[buf.len++] = 0xFF;
+            assert(write(writer[link], buf.data, buf.len) == buf.len);
+        }
+        if (seq % 10 == 9)
+            while (reactor.poll(0) > 0) {
+            }
+    }
+    for (int tries = 0; tries < 100 && reactor.poll(10) >= 0;) {
+        bool done = true;
+        for (int link = 0; link < 8; ++link)
+            done = done && result.received[link] == 100;
+        if (done)
+            break;
+        tries++;
+    }
+    for (int link = 0; link < 8; ++link)
+        assert(result.received[link] == 100);
+    assert(result.in_order);
+
+    // End of file of the pipe and hang-up of a pty
+    close(writer[6]);
+    close(writer[0]);
+    for (int tries = 0; tries < 100 && result.closed < 2; ++tries)
+        assert(reactor.poll(10) >= 0);
+    assert(result.closed == 2);
+    assert(!reactor.remove(reader[6]));
+    assert(reactor.remove(reader[7]));
+
+    // At end of file, a resyncing channel rescans a message cut off by it.
+    ReactorResult cut = { {}, 0, true };
+    assert(pipe(fds) == 0);
+    assert(reactor.add(fds[0], check_fd_order, &cut, count_closed, true));
+    const uint8_t head[] = { 0x92, 0xCE, 0, 0, 0, 0, 0x91, 0xC4, 0xFF };
+    MsgLite::Buffer buf;
+    assert(MsgLite::Pack(MsgLite::Message("link", (uint32_t)0, (uint32_t)0), buf));
+    assert(write(fds[1], head, sizeof(head)) == sizeof(head) && write(fds[1], buf.data, buf.len) == buf.len);
+    close(fds[1]);
+    for (int tries = 0; tries < 100 && cut.closed < 1; ++tries)
+        assert(reactor.poll(10) >= 0);
+    assert(cut.closed == 1 && cut.received[0] == 1 && cut.in_order);
+    close(fds[0]);
+
+    close(reader[0]);
+    for (int ii = 1; ii < 8; ++ii) {
+        close(writer[ii]);
+        close(reader[ii]);
+    }
+}
+
+// Checks the next frame found by the reader against the message returned by
+// the unpacker once it has been fed up to the given position.
+void check_captured(MsgLite::CaptureReader& capture, MsgLite::Unpacker& unpacker, size_t& cnt, size_t& end, size_t fed)
+{
+    assert(cnt < capture.count());
+    const MsgLite::CapturedFrame& frame = capture.frames()[cnt++];
+    assert(frame.len == unpacker.buf.len);
+    assert(memcmp(capture.data() + frame.offset, unpacker.buf.data, frame.len) == 0);
+    assert(end <= frame.offset && frame.offset + frame.len <= fed);
+    end = frame.offset + frame.len;
+}
+
+// Checks CaptureReader finds the same messages as a resyncing Unpacker fed
+// the whole data, whatever the chunking.
+void check_capture(MsgLite::CaptureReader& capture)
+{
+    const size_t chunk_sizes[] = { 1, 7, 247, 4096, 1 << 20 };
+    for (size_t chunk_size : chunk_sizes) {
+        for (uint8_t threads = 1; threads <= 4; threads += 3) {
+            assert(capture.recover(threads, chunk_size));
+
+            // A message completed by rescanned bytes is reported a few bytes
+            // late, so the unpacker only gives an upper bound of its offset.
+            MsgLite::Unpacker unpacker(MsgLite::MAX_MSG_LEN, true);
+            size_t cnt = 0, end = 0;
+            for (size_t pos = 0, consumed; pos < capture.size(); pos += consumed) {
+                if (unpacker.put(capture.data() + pos, capture.size() - pos, consumed))
+                    check_captured(capture, unpacker, cnt, end, pos + consumed);
+            }
+            while (unpacker.flush())
+                check_captured(capture, unpacker, cnt, end, capture.size());
+            assert(cnt == capture.count());
+        }
+    }
+}
+
+void test_capture_reader()
+{
+    MsgLite::CaptureReader capture;
+    assert(!capture.open("./test/no_such_file.bin"));
+    assert(capture.open("./test/data_robustness.bin"));
+    check_capture(capture);
+    assert(capture.count() > 4500);
+
+    MsgLite::MessageView view;
+    assert(capture.get(0, view) && !capture.get(capture.count(), view));
+
+    // Random bytes, messages, corrupted messages, and empty messages hidden
+    // in strings of other messages
+    static uint8_t data[200000];
+    uint32_t state = 1;
+    size_t len = 0;
+    while (len + 2 * MsgLite::MAX_MSG_LEN < sizeof(data)) {
+        state = state * 1103515245 + 12345;
+        MsgLite::Buffer buf, inner;
+        switch ((state >> 16) % 4) {
+            case 0: {
+                for (int ii = (state >> 8) % 32; ii > 0; --ii)
+                    data[len++] = (ii * state) >> 24 | 0x80;
+                break;
+            }
+            case 1:
+            case 2: {
+                MsgLite::Pack(MsgLite::Message("msg", state, (uint8_t)len), buf);
+                if ((state >> 20) % 5 == 0)
+                    buf.data[(state >> 4) % buf.len] ^= 0x10;
+                memcpy(data + len, buf.data, (state >> 12) % 7 ? buf.len : buf.len / 2);
+                len += (state >> 12) % 7 ? buf.len : buf.len / 2;
+                break;
+            }
+            case 3: {
+                MsgLite::Pack(MsgLite::Message(), inner);
+                char str[16] = "xx";
+                memcpy(str + 2, inner.data, inner.len);
+                str[2 + inner.len] = 0;
+                if (strlen(str) == 2u + inner.len) {
+                    MsgLite::Pack(MsgLite::Message(str, str), buf);
+                    memcpy(data + len, buf.data, buf.len);
+                    len += buf.len;
+                }
+                break;
+            }
+        }
+    }
+    capture.open(data, len);
+    check_capture(capture);
+    assert(capture.count() > 1000);
+
+    capture.open(data, 0);
+    assert(capture.recover() && capture.count() == 0);
+}
+
+void test_capture_log()
+{
+    const char* path = "./output/test_capture.log";
+    remove(path);
+    remove("./output/test_capture.log.idx");
+
+    // Timestamps 0, 0, 10, 10, 20, ... with channels 0 to 7
+    MsgLite::CaptureLogWriter writer(16);
+    assert(writer.open(path));
+    for (uint32_t ii = 0; ii < 1000; ++ii) {
+        MsgLite::Buffer buf;
+        assert(MsgLite::Pack(MsgLite::Message("rec", ii), buf));
+        assert(writer.append(ii / 2 * 10, ii % 8, buf));
+    }
+    uint8_t garbage[MsgLite::MIN_MSG_LEN] = { 0x92, 0xCE };
+    assert(!writer.append(4990, 0, garbage, sizeof(garbage)));
+
+    // Going back in time would break seeking.
+    MsgLite::Buffer late;
+    assert(MsgLite::Pack(MsgLite::Message("late"), late));
+    assert(!writer.append(4980, 0, late));
+    writer.close();
+
+    MsgLite::CaptureLogReader reader;
+    assert(!reader.open("./test/data_static.bin"));
+    assert(reader.open(path));
+    assert(reader.count() == 1000);
+
+    MsgLite::LogRecord rec;
+    MsgLite::MessageView view;
+    uint32_t x;
+    for (uint32_t ii = 0; ii < 1000; ii += 37) {
+        MsgLite::LogCursor cursor = reader.at(ii);
+        assert(cursor.record == ii && reader.read(cursor, rec));
+        assert(rec.timestamp == ii / 2 * 10 && rec.channel == ii % 8);
+        assert(MsgLite::Unpack(rec.frame, rec.len, view) && view.parse("rec", x) && x == ii);
+    }
+    MsgLite::LogCursor cursor = reader.at(1000);
+    assert(!reader.read(cursor, rec));
+
+    // Seeking by time
+    assert(reader.seek(0).record == 0);
+    assert(reader.seek(1).record == 2);
+    assert(reader.seek(10).record == 2);
+    assert(reader.seek(4990).record == 998);
+    assert(reader.seek(5000).record == 1000);
+    for (uint64_t t = 0; t <= 4990; t += 7) {
+        cursor = reader.seek(t);
+        assert(reader.read(cursor, rec) && rec.timestamp >= t);
+        if (cursor.record > 1) {
+            MsgLite::LogCursor before = reader.at(cursor.record - 2);
+            assert(reader.read(before, rec) && rec.timestamp < t);
+        }
+    }
+
+    // Scanning a time range of a channel
+    size_t found = 0;
+    cursor = reader.seek(1000);
+    while (reader.read(cursor, rec) && rec.timestamp < 2000) {
+        if (rec.channel == 7)
+            found++;
+    }
+    assert(found == 25);
+    reader.close();
+
+    // A crash leaves a cut record and a stale index entry.
+    FILE* f = fopen(path, "ab");
+    fwrite(garbage, 1, 5, f);
+    fclose(f);
+    f = fopen("./output/test_capture.log.idx", "ab");
+    uint8_t stale[24] = {};
+    stale[8] = 1008 & 0xFF; // record of the next block
+    stale[9] = 1008 >> 8;
+    stale[16] = 0xFF; // offset past the end
+    stale[17] = 0xFF;
+    fwrite(stale, 1, sizeof(stale), f);
+    fclose(f);
+
+    assert(reader.open(path) && reader.count() == 1000);
+    reader.close();
+
+    // Appending goes on after the last whole record, with the log's block.
+    MsgLite::CaptureLogWriter appender(4);
+    assert(appender.open(path) && !appender.append(4980, 0, late));
+    for (uint32_t ii = 1000; ii < 1100; ++ii) {
+        MsgLite::Buffer buf;
+        assert(MsgLite::Pack(MsgLite::Message("rec", ii), buf));
+        assert(appender.append(ii / 2 * 10, ii % 8, buf));
+    }
+    appender.close();
+
+    assert(reader.open(path) && reader.count() == 1100);
+    for (uint32_t ii = 0; ii < 1100; ii += 11) {
+        cursor = reader.at(ii);
+        assert(reader.read(cursor, rec) && MsgLite::Unpack(rec.frame, rec.len, view));
+        assert(view.parse("rec", x) && x == ii);
+    }
+    assert(reader.seek(5490).record == 1098);
+}
+
+void test_unpacker_stats()
+{
+    // One of each: garbage, bad header, bad length, unknown type, checksum
+    // mismatch, too long for max_msg_len 40, and two valid messages
+    uint8_t data[512];
+    size_t len = 0, valid_len = 0;
+    MsgLite::Buffer buf;
+
+    const uint8_t garbage[] = { 0x01, 0x02, 0x92, 0x00, 0x03 };
+    memcpy(data + len, garbage, sizeof(garbage));
+    len += sizeof(garbage);
+
+    MsgLite::Pack(MsgLite::Message("ok"), buf);
+    memcpy(data + len, buf.data, buf.len);
+    len += buf.len, valid_len += buf.len;
+
+    MsgLite::Pack(MsgLite::Message((uint8_t)1), buf);
+    buf.data[6] = 0xA1; // bad length
+    memcpy(data + len, buf.data, buf.len);
+    len += buf.len;
+
+    MsgLite::Pack(MsgLite::Message((uint8_t)1), buf);
+    buf.data[7] = 0xC1; // unknown type
+    memcpy(data + len, buf.data, buf.len);
+    len += buf.len;
+
+    MsgLite::Pack(MsgLite::Message((uint32_t)1), buf);
+    buf.data[9] ^= 1; // checksum mismatch
+    memcpy(data + len, buf.data, buf.len);
+    len += buf.len;
+    data[len++] = 0x00; // rejects it, without resync the byte is dropped
+
+    MsgLite::Pack(MsgLite::Message("helloworldhello", "helloworldhello", "helloworldhello"), buf);
+    memcpy(data + len, buf.data, buf.len);
+    len += buf.len;
+
+    MsgLite::Pack(MsgLite::Message(1.0), buf);
+    memcpy(data + len, buf.data, buf.len);
+    len += buf.len, valid_len += buf.len;
+
+    MsgLite::Unpacker bytewise(40), bulk(40);
+    for (size_t ii = 0; ii < len; ++ii)
+        bytewise.put(data[ii]);
+    for (size_t pos = 0, consumed; pos < len; pos += consumed)
+        bulk.put(data + pos, len - pos, consumed);
+
+    MsgLite::UnpackerStats stats[2] = { bytewise.stats(), bulk.stats() };
+#ifdef MSGLITE_UNPACKER_STATS
+    for (const MsgLite::UnpackerStats& s : stats) {
+        assert(s.bytes == len && s.bytes_discarded == len - valid_len && s.messages == 2);
+        assert(s.bad_header == 1 && s.bad_length == 1 && s.unknown_type == 1);
+        assert(s.crc_mismatch == 1 && s.too_long == 1 && s.body_rejected == 0);
+    }
+
+    // Bytes of an unfinished message are not counted as discarded yet.
+    size_t consumed;
+    assert(!bulk.put(data + 5, 8, consumed));
+    assert(bulk.stats().bytes_discarded == stats[1].bytes_discarded);
+#else
+    // Counters are compiled out and read as zeros.
+    (void)valid_len;
+    const MsgLite::UnpackerStats zeros = {};
+    for (const MsgLite::UnpackerStats& s : stats)
+        assert(memcmp(&s, &zeros, sizeof(zeros)) == 0);
+#endif
+}
+
+void test_unpacker_timestamps()
+{
+    // Garbage, a message split across two puts and a message in the middle of
+    // a rejected one, each byte received at its position in the stream
+    uint8_t data[256];
+    size_t len = 0;
+    MsgLite::Buffer buf;
+
+    const uint8_t garbage[] = { 0x01, 0x92, 0x02 };
+    memcpy(data + len, garbage, sizeof(garbage));
+    len += sizeof(garbage);
+
+    size_t first = len;
+    MsgLite::Pack(MsgLite::Message("first", 1.0f), buf);
+    memcpy(data + len, buf.data, buf.len);
+    len += buf.len;
+
+    size_t rejected = len;
+    MsgLite::Pack(MsgLite::Message((uint32_t)1), buf);
+    memcpy(data + len, buf.data, 7); // cut after the length byte
+    len += 7;
+
+    size_t second = len;
+    MsgLite::Pack(MsgLite::Message("second"), buf);
+    memcpy(data + len, buf.data, buf.len);
+    len += buf.len;
+
+    MsgLite::Unpacker bytewise, bulk, rescan(MsgLite::MAX_MSG_LEN, true);
+    uint64_t times[3][2];
+    int found[3] = { 0, 0, 0 };
+    for (size_t ii = 0; ii < len; ++ii) {
+        if (bytewise.put(data[ii], ii))
+            times[0][found[0]++] = bytewise.timestamp();
+        if (rescan.put(data[ii], ii))
+            times[2][found[2]++] = rescan.timestamp();
+    }
+    for (size_t pos = 0, consumed; pos < len; pos += consumed) {
+        size_t n = (pos == 0) ? first + 4 : len - pos;
+        if (bulk.put(data + pos, n, consumed, pos))
+            times[1][found[1]++] = bulk.timestamp();
+    }
+
+    // Without resync, the second message is swallowed by the rejected one.
+    assert(found[0] == 1 && found[1] == 1 && found[2] == 2);
+    assert(times[0][0] == first && times[2][0] == first);
+    assert(times[1][0] == 0); // header byte put at time 0
+    assert(times[2][1] == rejected && rejected < second);
+
+    // A clock is read once per put().
+    MsgLite::Unpacker clocked;
+    clocked.set_clock(MsgLite::MonotonicClock);
+    uint64_t before = MsgLite::MonotonicClock();
+    size_t consumed;
+    assert(clocked.put(data + first, len - first, consumed));
+    assert(clocked.timestamp() >= before && clocked.timestamp() <= MsgLite::MonotonicClock());
+}
+
+void test_latency_histogram()
+{
+    MsgLite::LatencyHistogram low, high, all;
+    assert(all.count() == 0 && all.quantile(0.5) == 0 && all.min() == 0);
+
+    for (uint64_t ii = 1; ii <= 100000; ++ii) {
+        (ii <= 50000 ? low : high).record(ii);
+        all.record(ii);
+    }
+    MsgLite::LatencyHistogram merged;
+    merged.merge(low);
+    merged.merge(high);
+
+    const double qs[] = { 0.0, 0.5, 0.9, 0.99, 0.999, 1.0 };
+    for (double q : qs) {
+        uint64_t exact = q == 0 ? 1 : (uint64_t)(q * 100000);
+        uint64_t value = all.quantile(q);
+        assert(value >= exact && value <= exact + exact / 32);
+        assert(merged.quantile(q) == value);
+    }
+    assert(merged.count() == 100000 && merged.min() == 1 && merged.max() == 100000);
+    assert(low.quantile(1.0) == 50000 && high.min() == 50001);
+
+    // Small values are exact, the largest ones fit.
+    MsgLite::LatencyHistogram edges;
+    edges.record(0);
+    edges.record(63);
+    edges.record(UINT64_MAX);
+    assert(edges.quantile(0.2) == 0 && edges.quantile(0.5) == 63 && edges.quantile(0.9) == UINT64_MAX);
+
+    edges.reset();
+    assert(edges.count() == 0 && edges.max() == 0);
+}
+
+// Message number seq of a simulated link
+MsgLite::Message link_message(uint32_t seq)
+{
+    if (seq % 3 == 0)
+        return MsgLite::Message(seq, "imu", 0.5f * seq, -1.0f, 9.8f);
+    if (seq % 3 == 1)
+        return MsgLite::Message(seq, (uint8_t)seq, true);
+    return MsgLite::Message(seq, "status report", "all systems nominal", (int64_t)seq * 1000);
+}
+
+void test_lossy_channel()
+{
+    static uint8_t data[1 << 20], out[2 << 20], again[2 << 20];
+    for (size_t ii = 0; ii < sizeof(data); ++ii)
+        data[ii] = ii * 31;
+
+    // A clean link changes nothing.
+    MsgLite::ChannelErrors clean = { 0, 0, 0, 0, 0 };
+    MsgLite::LossyChannel perfect(clean, 1);
+    assert(perfect.transmit(data, sizeof(data), out) == sizeof(data));
+    assert(memcmp(data, out, sizeof(data)) == 0);
+
+    // The same seed gives the same errors, at about the configured rates.
+    MsgLite::ChannelErrors noisy = { 1e-3, 1e-2, 1e-2, 1e-4, 16 };
+    MsgLite::LossyChannel a(noisy, 42), b(noisy, 42), c(noisy, 43);
+    size_t len = a.transmit(data, sizeof(data), out);
+    assert(b.transmit(data, sizeof(data), again) == len && memcmp(out, again, len) == 0);
+    assert(c.transmit(data, sizeof(data), again) != len || memcmp(out, again, len) != 0);
+
+    const MsgLite::ChannelStats& stats = a.stats();
+    double bytes = sizeof(data);
+    assert(stats.bytes_in == sizeof(data) && stats.bytes_out == len);
+    assert(len == stats.bytes_in - stats.bytes_dropped + stats.bytes_inserted);
+    assert(stats.bits_flipped > bytes * 8e-3 * 0.9 && stats.bits_flipped < bytes * 8e-3 * 1.1);
+    assert(stats.bytes_dropped > bytes * 1e-2 * 0.9 && stats.bytes_dropped < bytes * 1e-2 * 1.1);
+    assert(stats.bytes_inserted > bytes * 1e-2 * 0.9 && stats.bytes_inserted < bytes * 1e-2 * 1.1);
+    assert(stats.bursts > bytes * 1e-4 * 0.7 && stats.bursts < bytes * 1e-4 * 1.3);
+
+    // Messages over a slightly noisy link are mostly recovered, and whatever
+    // passes the checksum is what was sent.
+    MsgLite::ChannelErrors link = { 1e-4, 1e-5, 1e-5, 1e-6, 8 };
+    MsgLite::LossyChannel channel(link, 7);
+    const uint32_t sent = 5000;
+    len = 0;
+    for (uint32_t seq = 0; seq < sent; ++seq)
+        len += channel.send(link_message(seq), out + len);
+
+    MsgLite::Unpacker plain, resync(MsgLite::MAX_MSG_LEN, true);
+    uint32_t recovered[2] = { 0, 0 };
+    MsgLite::Unpacker* unpackers[2] = { &plain, &resync };
+    for (int ii = 0; ii < 2; ++ii) {
+        for (size_t pos = 0, consumed; pos < len; pos += consumed) {
+            if (unpackers[ii]->put(out + pos, len - pos, consumed)) {
+                const MsgLite::Message& msg = unpackers[ii]->get();
+                uint32_t seq;
+                assert(msg.len > 0 && msg.obj[0].cast_to(seq) && seq < sent);
+                assert(msg == link_message(seq));
+                recovered[ii]++;
+            }
+        }
+    }
+    assert(recovered[0] > sent * 0.9 && recovered[1] >= recovered[0]);
+}
+
+// Feeds data to resyncing unpackers byte by byte and in chunks of random
+// sizes, and checks both give the same messages. Returns how many.
+size_t check_resync_unpacker(const uint8_t* data, size_t len, uint8_t max_msg_len, MsgLite::LossyChannel& rng)
+{
+    static uint32_t frames[1 << 16];
+    MsgLite::Unpacker bytewise(max_msg_len, true), bulk(max_msg_len, true);
+
+    size_t accepted = 0;
+    for (size_t pos = 0; pos < len; ++pos) {
+        if (bytewise.put(data[pos])) {
+            assert(accepted < sizeof(frames) / sizeof(frames[0]));
+            frames[accepted++] = MsgLite::CRC32B(bytewise.buf.len, bytewise.buf.data, bytewise.buf.len);
+        }
+    }
+    while (bytewise.flush()) {
+        assert(accepted < sizeof(frames) / sizeof(frames[0]));
+        frames[accepted++] = MsgLite::CRC32B(bytewise.buf.len, bytewise.buf.data, bytewise.buf.len);
+    }
+
+    size_t found = 0;
+    for (size_t pos = 0; pos < len;) {
+        size_t n = 1 + rng.random() % 600;
+        n = n < len - pos ? n : len - pos;
+        for (size_t off = 0, consumed; off < n; off += consumed) {
+            if (bulk.put(data + pos + off, n - off, consumed)) {
+                assert(found < accepted);
+                assert(frames[found++] == MsgLite::CRC32B(bulk.buf.len, bulk.buf.data, bulk.buf.len));
+            }
+        }
+        pos += n;
+    }
+    while (bulk.flush()) {
+        assert(found < accepted);
+        assert(frames[found++] == MsgLite::CRC32B(bulk.buf.len, bulk.buf.data, bulk.buf.len));
+    }
+    assert(found == accepted);
+    return accepted;
+}
+
+void test_resync_fuzz()
+{
+    // Noisy messages between cut off and corrupted frames, and random bytes
+    // rich in header bytes, so that rejected frames hide the next ones.
+    static uint8_t data[1 << 18];
+    for (uint64_t seed = 1; seed <= 300; ++seed) {
+        double ber = 1e-4 * (seed % 8);
+        MsgLite::ChannelErrors errors = { ber, ber / 8, ber / 8, ber / 64, 16 };
+        MsgLite::LossyChannel channel(errors, seed);
+
+        // bin8 payloads made of messages, which come out again when the frame
+        // around them is rejected
+        uint8_t samples[240];
+        size_t fill = 0;
+        for (uint32_t seq = seed;; ++seq) {
+            MsgLite::Buffer buf;
+            MsgLite::Pack(seq % 4 ? MsgLite::Message() : link_message(seq), buf);
+            if (fill + buf.len > sizeof(samples))
+                break;
+            memcpy(samples + fill, buf.data, buf.len);
+            fill += buf.len;
+        }
+        for (; fill < sizeof(samples); ++fill)
+            samples[fill] = (uint8_t)channel.random();
+
+        size_t len = 0;
+        for (uint32_t seq = 0; seq < 300; ++seq) {
+            MsgLite::Buffer buf;
+            MsgLite::Pack(link_message(seq), buf);
+            MsgLite::Blob blob = { samples + channel.random() % 11, (uint8_t)(channel.random() % 230) };
+            switch (seq == 299 ? 4 : channel.random() % 7) {
+                case 0:
+                    len += channel.send(link_message(seq), data + len);
+                    break;
+                case 1:
+                    buf.len = 1 + channel.random() % buf.len;
+                    memcpy(data + len, buf.data, buf.len);
+                    len += buf.len;
+                    break;
+                case 2:
+                    buf.data[channel.random() % buf.len] ^= 1 << channel.random() % 8;
+                    memcpy(data + len, buf.data, buf.len);
+                    len += buf.len;
+                    break;
+                case 3:
+                    for (uint64_t ii = channel.random() % 64; ii > 0; --ii) {
+                        uint64_t r = channel.random();
+                        data[len++] = r % 4 == 0 ? 0x92 : r % 4 == 1 ? 0xCE : (uint8_t)(r >> 8);
+                    }
+                    break;
+                case 4: {
+                    // Empty messages in the strings of a frame failing its
+                    // checksum, which all come out of the rescan queue
+                    MsgLite::Buffer empty;
+                    MsgLite::Pack(MsgLite::Message(), empty);
+                    const uint8_t head[] = { 0x92, 0xCE, 1, 2, 3, 4, 0x9F };
+                    memcpy(data + len, head, sizeof(head));
+                    len += sizeof(head);
+                    for (int ii = 0; ii < 15; ++ii) {
+                        data[len++] = 0xA0 + 2 * empty.len;
+                        for (int jj = 0; jj < 2; ++jj, len += empty.len)
+                            memcpy(data + len, empty.data, empty.len);
+                    }
+                    break;
+                }
+                case 5:
+                    len += channel.send(MsgLite::Message("bin", seq, blob), data + len);
+                    break;
+                case 6:
+                    MsgLite::Pack(MsgLite::Message("bin", seq, blob), buf);
+                    buf.data[channel.random() % buf.len] ^= 1 << channel.random() % 8;
+                    buf.len -= channel.random() % 2 ? 0 : channel.random() % buf.len;
+                    memcpy(data + len, buf.data, buf.len);
+                    len += buf.len;
+                    break;
+            }
+        }
+        // The stream ends with or somewhere in the last frame, maybe with
+        // messages still queued for rescanning.
+        if (seed % 2)
+            len -= channel.random() % 200;
+
+        check_resync_unpacker(data, len, MsgLite::MAX_MSG_LEN, channel);
+        check_resync_unpacker(data, len, 40, channel);
+
+        // The capture reader finds the same messages.
+        MsgLite::CaptureReader capture;
+        capture.open(data, len);
+        check_capture(capture);
+    }
+}
+
+void test_packer_queue()
+{
+    MsgLite::Buffer a, b;
+    MsgLite::Pack(MsgLite::Message("first", (uint32_t)1), a);
+    MsgLite::Pack(MsgLite::Message(2.0), b);
+
+    // Messages are queued whole, until the ring is full.
+    MsgLite::PackerQueue<48> queue;
+    assert(queue.get() == -1 && queue.size() == 0 && queue.space() == 48);
+    assert(queue.put(MsgLite::Message("first", (uint32_t)1)) && queue.put(b.data, b.len));
+    assert(queue.size() == (size_t)a.len + b.len && queue.queued() == queue.size());
+    assert(!queue.put(MsgLite::Message("does not fit in what is left")));
+    MsgLite::Message invalid;
+    invalid.len = 16;
+    assert(!queue.put(invalid));
+
+    // Bytes come out in order, one at a time or in bulk.
+    uint8_t out[64];
+    for (int ii = 0; ii < 3; ++ii)
+        out[ii] = queue.get();
+    assert(queue.get(out + 3, 2) == 2 && queue.sent() == 5);
+    assert(queue.get(out + 5, sizeof(out) - 5) == (size_t)a.len + b.len - 5);
+    assert(memcmp(out, a.data, a.len) == 0 && memcmp(out + a.len, b.data, b.len) == 0);
+
+    // A message wrapping around the ring is peeked as two regions, which
+    // are consumed as partial writes.
+    assert(queue.put(b.data, b.len) && queue.get(out, 4) == 4);
+    assert(queue.put(a.data, a.len) && queue.put(b.data, b.len));
+    MsgLite::Region regions[2];
+    assert(queue.peek(regions) == 2);
+    size_t len = 0;
+    for (const MsgLite::Region& region : regions) {
+        memcpy(out + len, region.data, region.len);
+        len += region.len;
+    }
+    assert(len == queue.size() && len == b.len - 4u + a.len + b.len);
+    assert(memcmp(out + b.len - 4, a.data, a.len) == 0);
+    uint64_t a_end = queue.queued() - b.len;
+    queue.consume(b.len - 4 + a.len - 1);
+    assert(queue.sent() == a_end - 1);
+    queue.consume(1);
+    assert(queue.sent() == a_end);
+    queue.consume(100);
+    assert(queue.size() == 0 && queue.sent() == queue.queued());
+
+    // Through a non-blocking pipe, writes stop when it is full and resume
+    // with the rest of a message.
+    int fds[2];
+    assert(pipe(fds) == 0);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETPIPE_SZ, 4096);
+    MsgLite::PackerQueue<1024> tx;
+    MsgLite::Unpacker rx;
+    uint32_t sent = 0, received = 0;
+    bool blocked = false;
+    while (received < 2000) {
+        while (sent < 2000 && tx.put(MsgLite::Message("seq", sent)))
+            sent++;
+        if (MsgLite::WriteQueue(fds[1], tx) < 0) {
+            assert(errno == EAGAIN);
+            blocked = true;
+        }
+        ssize_t n = read(fds[0], out, blocked ? sizeof(out) : 1);
+        for (ssize_t pos = 0, consumed; pos < n; pos += consumed) {
+            size_t used;
+            if (rx.put(out + pos, n - pos, used)) {
+                uint32_t seq;
+                assert(rx.get().parse("seq", seq) && seq == received);
+                received++;
+            }
+            consumed = used;
+        }
+    }
+    assert(blocked && tx.size() == 0);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_wrapped_pack()
+{
+    // Every split of a message between the end and the start of a ring gives
+    // the bytes of Pack(), also for blobs, empty ones having no bytes at all.
+    const uint8_t bytes[20] = { 0x92, 0xCE, 0x00, 0xC4 };
+    MsgLite::Message msgs[] = {
+        MsgLite::Message(),
+        MsgLite::Message("helloworld", true, 3.1415926f),
+        MsgLite::Message((uint64_t)1 << 40, (int8_t)-1, 2.0, "x"),
+        MsgLite::Message(MsgLite::Blob { nullptr, 0 }, MsgLite::Blob { bytes, 20 }, MsgLite::Blob { nullptr, 0 }),
+    };
+    for (const MsgLite::Message& msg : msgs) {
+        MsgLite::Buffer buf;
+        assert(MsgLite::Pack(msg, buf));
+        for (size_t split = 0; split <= buf.len; ++split) {
+            uint8_t ring[64];
+            memset(ring, 0xEE, sizeof(ring));
+            uint8_t* end = ring + sizeof(ring) - split;
+            assert(MsgLite::Pack(msg, end, split, ring, buf.len - split) == buf.len);
+            assert(memcmp(end, buf.data, split) == 0);
+            assert(memcmp(ring, buf.data + split, buf.len - split) == 0);
+            assert(ring[buf.len - split] == 0xEE || buf.len - split == (size_t)(end - ring));
+            assert(MsgLite::Pack(msg, end, split, ring, buf.len - split - 1) == -1 || split == buf.len);
+        }
+    }
+    MsgLite::Message invalid;
+    invalid.len = 16;
+    uint8_t ring[256];
+    assert(MsgLite::Pack(invalid, ring, 128, ring + 128, 128) == -1);
+
+    // A PackerQueue serializes messages wrapping around its end in place.
+    MsgLite::PackerQueue<50> queue;
+    MsgLite::Unpacker unpacker;
+    uint8_t out[50];
+    for (uint32_t seq = 0; seq < 100; ++seq) {
+        assert(queue.put(msgs[seq % 3]));
+        size_t n = queue.get(out, 7 + seq % 20);
+        for (size_t pos = 0, consumed; pos < n; pos += consumed)
+            if (unpacker.put(out + pos, n - pos, consumed))
+                assert(unpacker.get() == msgs[seq % 3] || unpacker.get() == msgs[(seq + 2) % 3]);
+        n = queue.get(out, sizeof(out));
+        for (size_t pos = 0, consumed; pos < n; pos += consumed)
+            if (unpacker.put(out + pos, n - pos, consumed))
+                assert(unpacker.get() == msgs[seq % 3]);
+    }
+}
+
+void test_double_buffer()
+{
+    MsgLite::DoubleBuffer<64> dma;
+    MsgLite::Message msg("helloworld", true, 3.1415926f);
+    MsgLite::Buffer buf;
+    MsgLite::Pack(msg, buf);
+
+    // Messages fill the back half, flip() hands it over for sending.
+    assert(dma.put(msg) && dma.put(msg) && !dma.put(msg) && dma.size() == 2u * buf.len);
+    MsgLite::Region front = dma.flip();
+    assert(front.data == dma.data() && front.len == 2u * buf.len && dma.size() == 0);
+    assert(memcmp(front.data + buf.len, buf.data, buf.len) == 0);
+    assert(dma.put(msg));
+
+    // The sent half is cleared when it becomes the back one again, so a
+    // circular DMA sending whole halves gives only the messages.
+    MsgLite::Region next = dma.flip();
+    assert(next.data == dma.data() + 64 && next.len == buf.len);
+    assert(dma.flip().len == 0 && dma.flip().len == 0);
+    assert(dma.put(msg));
+    dma.flip();
+
+    MsgLite::Unpacker unpacker;
+    size_t found = 0;
+    for (size_t ii = 0; ii < dma.capacity; ++ii) {
+        if (unpacker.put(dma.data()[ii])) {
+            assert(unpacker.get() == msg);
+            found++;
+        }
+    }
+    assert(found == 1);
+
+    // Circular DMA, one byte sent per tick: primed by a flip(), then flipped
+    // by the half and full transfer interrupts. Messages put meanwhile never
+    // land in the half being sent, so they all come out whole and in order.
+    MsgLite::DoubleBuffer<64> circular;
+    circular.flip();
+    uint32_t sent = 0, received = 0;
+    for (size_t tick = 0; tick < 40 * circular.capacity; ++tick) {
+        size_t pos = tick % circular.capacity;
+        if (tick % 23 == 0 && circular.put(MsgLite::Message("seq", sent)))
+            sent++;
+        if (unpacker.put(circular.data()[pos])) {
+            uint32_t seq;
+            assert(unpacker.get().parse("seq", seq) && seq == received);
+            received++;
+        }
+        if (pos == 63 || pos == 127)
+            circular.flip();
+    }
+    assert(received > 100 && sent - received <= 3);
+}
+
+void test_message_builder()
+{
+    MsgLite::Buffer expected, buf;
+
+    // Same bytes as Pack() for every type of object
+    MsgLite::Pack(MsgLite::Message(true, (uint8_t)1, (uint16_t)2, (uint32_t)3, (uint64_t)4, (int8_t)-5, (int16_t)-6,
+                      (int32_t)-7, (int64_t)-8, 9.5f, 10.25, "eleven", "trimmed to fifteen"),
+        expected);
+    assert(MsgLite::MessageBuilder(buf)
+               .add(true)
+               .add((uint8_t)1)
+               .add((uint16_t)2)
+               .add((uint32_t)3)
+               .add((uint64_t)4)
+               .add((int8_t)-5)
+               .add((int16_t)-6)
+               .add((int32_t)-7)
+               .add((int64_t)-8)
+               .add(9.5f)
+               .add(10.25)
+               .add("eleven")
+               .add("trimmed to fifteen")
+               .finish()
+        == expected.len);
+    assert(buf.len == expected.len && memcmp(buf.data, expected.data, buf.len) == 0);
+
+    // Empty message, and strings with an explicit length
+    MsgLite::Pack(MsgLite::Message(), expected);
+    MsgLite::MessageBuilder builder(buf);
+    assert(builder.finish() == MsgLite::MIN_MSG_LEN && memcmp(buf.data, expected.data, buf.len) == 0);
+    MsgLite::Pack(MsgLite::Message("imu", ""), expected);
+    builder.reset();
+    assert(builder.add("imu and more", 3).add("", 0).finish() == expected.len);
+    assert(memcmp(buf.data, expected.data, buf.len) == 0);
+
+    // Errors are kept until finish().
+    builder.reset();
+    assert(builder.add("sixteen bytes!!!", 16).add(1.0).finish() == -1);
+    builder.reset();
+    assert(builder.add("nul\0", 4).finish() == -1);
+    builder.reset();
+    for (int ii = 0; ii < 16; ++ii)
+        builder.add((uint8_t)ii);
+    assert(builder.finish() == -1);
+
+    // Byte arrays are bounded by their length.
+    uint8_t raw[16];
+    MsgLite::Pack(MsgLite::Message(1.0f), expected);
+    assert(MsgLite::MessageBuilder(raw, 12).add(1.0f).finish() == 12);
+    assert(memcmp(raw, expected.data, 12) == 0);
+    assert(MsgLite::MessageBuilder(raw, 11).add(1.0f).finish() == -1);
+    assert(MsgLite::MessageBuilder(raw, 6).finish() == -1);
+}
+
+void test_binary()
+{
+    // Sample bytes, including '\0' and header bytes
+    static uint8_t samples[2 * MsgLite::MAX_MSG_LEN];
+    for (size_t ii = 0; ii < sizeof(samples); ++ii)
+        samples[ii] = (uint8_t)(ii * 37);
+    MsgLite::Blob block = { samples, 200 };
+
+    assert(MsgLite::Object(block).type == MsgLite::Object::Binary);
+    assert(MsgLite::Object(samples, 0).size() == 2);
+    assert(MsgLite::Object(block).size() == 202);
+    assert(MsgLite::Object(nullptr, 1).size() == -1);
+    uint8_t copy[3] = { samples[0], samples[1], samples[2] };
+    assert(MsgLite::Object(samples, 3) == MsgLite::Object(copy, 3));
+    assert(!(MsgLite::Object(samples, 3) == MsgLite::Object(copy, 2)));
+    assert(!(MsgLite::Object(samples + 1, 3) == MsgLite::Object(copy, 3)));
+
+    MsgLite::Buffer buf;
+    assert(MsgLite::Pack(MsgLite::Object(samples, 3), buf));
+    assert_buffer_equal(buf, 7, 0xC4, 0x03, 0x00, 0x25, 0x4A);
+    assert(MsgLite::Pack(MsgLite::Object(samples, 0), buf));
+    assert_buffer_equal(buf, 7, 0xC4, 0x00);
+
+    // Decoded objects point into the buffer.
+    MsgLite::Message msg("adc", (uint32_t)7, block), decoded;
+    assert(msg.size() == 218);
+    assert(MsgLite::Pack(msg, buf) && buf.len == 218);
+    assert(MsgLite::Unpack(buf, decoded) && decoded == msg);
+    assert(decoded.obj[2].as.Binary.data == buf.data + 18);
+
+    MsgLite::Blob out = { nullptr, 0 };
+    uint32_t seq = 0;
+    char s[16];
+    assert(decoded.parse("adc", seq, out) && seq == 7);
+    assert(out.data == buf.data + 18 && out.len == 200);
+    const MsgLite::Blob same = { samples, 200 }, other = { samples + 1, 200 };
+    assert(decoded.parse("adc", seq, same));
+    assert(!decoded.parse("adc", seq, other));
+    assert(!decoded.parse("adc", seq, s));
+
+    MsgLite::MessageView view;
+    assert(MsgLite::Unpack(buf, view) && view.len == 3);
+    out.data = nullptr;
+    assert(view.get(2, out) && out.data == buf.data + 18 && out.len == 200);
+    assert(!view.get(1, out));
+    assert(view.parse("adc", seq, same));
+
+    // Limits: a message is still at most MAX_MSG_LEN bytes, and a
+    // CompactMessage only has room for 14 bytes.
+    assert(MsgLite::Message(MsgLite::Blob { samples, 238 }).size() == MsgLite::MAX_MSG_LEN);
+    MsgLite::Message too_long("adc", MsgLite::Blob { samples, 238 });
+    assert(too_long.size() == -1 && !MsgLite::Pack(too_long, buf));
+    MsgLite::CompactMessage compact;
+    MsgLite::Buffer buf2;
+    assert(compact.from(MsgLite::Message("adc", MsgLite::Blob { samples, 14 })));
+    assert(MsgLite::Pack(compact, buf2) && compact.size() == buf2.len);
+    assert(MsgLite::Unpack(buf2, decoded) && decoded == MsgLite::Message("adc", MsgLite::Blob { samples, 14 }));
+    assert(!compact.from(MsgLite::Message("adc", MsgLite::Blob { samples, 15 })));
+    assert(!MsgLite::Unpack(buf, compact));
+
+    // Schema and MessageBuilder write the same bytes.
+    typedef MsgLite::Schema<const char*, uint32_t, MsgLite::Blob> Block;
+    assert(MsgLite::Pack(msg, buf));
+    assert(Block::pack(buf2, "adc", 7, block));
+    assert(buf.len == buf2.len && memcmp(buf.data, buf2.data, buf.len) == 0);
+    assert(Block::unpack(buf2, "adc", seq, out) && out.data == buf2.data + 18 && out.len == 200);
+    assert(!Block::pack(buf2, "adc", 7, MsgLite::Blob { samples, 238 }));
+    assert(MsgLite::MessageBuilder(buf2).add("adc").add((uint32_t)7).add(block).finish() == buf.len);
+    assert(memcmp(buf.data, buf2.data, buf.len) == 0);
+    assert(MsgLite::MessageBuilder(buf2).add("adc").add(MsgLite::Blob { samples, 238 }).finish() == -1);
+    uint8_t raw[255];
+    assert(MsgLite::MessageBuilder(raw, sizeof(raw)).add(MsgLite::Blob { samples, 240 }).finish() == -1);
+
+    // Stream unpacker, byte by byte and in bulk, with blobs of every length
+    static uint8_t stream[64 << 10];
+    size_t len = 0;
+    for (uint8_t n = 0; n <= 236; ++n) {
+        MsgLite::Pack(MsgLite::Message("b", MsgLite::Blob { samples + n, n }), buf);
+        memcpy(stream + len, buf.data, buf.len);
+        len += buf.len;
+    }
+    for (int resync = 0; resync <= 1; ++resync) {
+        MsgLite::Unpacker bytewise(MsgLite::MAX_MSG_LEN, resync), bulk(MsgLite::MAX_MSG_LEN, resync);
+        size_t found = 0;
+        for (size_t pos = 0; pos < len; ++pos) {
+            if (bytewise.put(stream[pos])) {
+                assert(bytewise.get().parse("b", out) && out.len == found);
+                assert(bytewise.get() == MsgLite::Message("b", MsgLite::Blob { samples + found, (uint8_t)found }));
+                found++;
+            }
+        }
+        assert(found == 237);
+        found = 0;
+        for (size_t pos = 0, consumed; pos < len; pos += consumed) {
+            if (bulk.put(stream + pos, len - pos < 100 ? len - pos : 100, consumed)) {
+                assert(bulk.get(decoded) && decoded.obj[1].as.Binary.data == bulk.buf.data + 11);
+                assert(decoded.parse("b", out) && out.len == found);
+                found++;
+            }
+        }
+        assert(found == 237);
+    }
+}
+
+#ifdef MSGLITE_LARGE_MESSAGES
+// Builds a large record of count small integers and a str8 string.
+size_t large_record(uint8_t* buf, size_t len, uint32_t seq, size_t count)
+{
+    MsgLite::LargeMessageBuilder builder(buf, len);
+    builder.add("record").add(seq);
+    for (size_t ii = 0; ii < count; ++ii)
+        builder.add((uint8_t)((seq + ii) & 0x7F));
+    return builder.add("a string longer than fifteen bytes").finish();
+}
+
+static MsgLite::LargeUnpacker large_bytewise, large_bulk;
+
+// Feeds a stream to a LargeUnpacker byte by byte and to another in chunks,
+// checks they accept the same messages at the same bytes, and returns how
+// many there are.
+size_t check_large_unpacker(const uint8_t* data, size_t len, size_t max_msg_len, size_t resync_window)
+{
+    static size_t ends[1 << 16];
+    MsgLite::LargeUnpacker& bytewise = large_bytewise;
+    MsgLite::LargeUnpacker& bulk = large_bulk;
+    bytewise = MsgLite::LargeUnpacker(max_msg_len, resync_window);
+    bulk = MsgLite::LargeUnpacker(max_msg_len, resync_window);
+
+    size_t accepted = 0;
+    for (size_t pos = 0; pos < len; ++pos) {
+        if (bytewise.put(data[pos])) {
+            assert(accepted < (1 << 16));
+            ends[accepted++] = pos;
+        }
+    }
+
+    size_t found = 0;
+    for (size_t pos = 0, chunk = 1; pos < len; chunk = chunk % 3000 + 7) {
+        size_t n = chunk < len - pos ? chunk : len - pos;
+        for (size_t off = 0, consumed; off < n; off += consumed) {
+            if (bulk.put(data + pos + off, n - off, consumed)) {
+                assert(found < accepted && ends[found] == pos + off + consumed - 1);
+                const MsgLite::LargeMessageView& view = bulk.view();
+                assert(view.data == bulk.buf.data);
+                assert(memcmp(bulk.buf.data, data + ends[found] + 1 - bulk.buf.len, bulk.buf.len) == 0);
+                found++;
+            }
+        }
+        pos += n;
+    }
+    assert(found == accepted);
+    return accepted;
+}
+
+void test_large_messages()
+{
+    static MsgLite::LargeBuffer large;
+    MsgLite::LargeMessageView view;
+    MsgLite::Buffer buf;
+    MsgLite::Message msg("imu", 1.5f, (uint32_t)7), decoded;
+
+    // Small frames are the same as in the default profile.
+    MsgLite::Pack(msg, buf);
+    assert(MsgLite::Pack(msg.obj, msg.len, large));
+    assert(large.len == buf.len && memcmp(large.data, buf.data, buf.len) == 0);
+    assert(MsgLite::LargeMessageBuilder(large).add("imu").add(1.5f).add((uint32_t)7).finish() == buf.len);
+    assert(memcmp(large.data, buf.data, buf.len) == 0);
+    assert(MsgLite::Unpack(buf.data, buf.len, view) && MsgLite::Unpack(view, decoded) && decoded == msg);
+
+    // More than 15 objects use an array16 count.
+    MsgLite::Object objs[300];
+    for (int ii = 0; ii < 300; ++ii)
+        objs[ii] = MsgLite::Object((uint16_t)ii);
+    assert(MsgLite::Pack(objs, 300, large) && large.len == 9 + 300 * 3);
+    assert(large.data[6] == 0xDC && large.data[7] == 0x01 && large.data[8] == 0x2C);
+    assert(MsgLite::FrameLength(large.data, large.len) == 0);
+    assert(MsgLite::Unpack(large, view) && view.len == 300);
+    uint16_t x;
+    assert(view.get(299, x) && x == 299 && !view.get(300, x));
+    assert(!MsgLite::Unpack(view, decoded));
+    large.data[large.len - 1] ^= 1;
+    assert(!MsgLite::Unpack(large, view));
+
+    // The builder moves its objects when the 16th is added.
+    uint8_t packed[64];
+    MsgLite::LargeMessageBuilder builder(large);
+    for (int ii = 0; ii < 16; ++ii)
+        builder.add((uint16_t)ii);
+    size_t n = builder.finish();
+    assert(n == 9 + 16 * 3 && builder.finish() == n && large.len == n);
+    assert(MsgLite::Pack(objs, 16, packed, sizeof(packed)) == n && memcmp(packed, large.data, n) == 0);
+
+    // Strings above 15 bytes are str8.
+    char text[300];
+    memset(text, 'x', sizeof(text) - 1);
+    text[sizeof(text) - 1] = '\0';
+    builder.reset();
+    n = builder.add(text + 300 - 1 - 255).add(text, 16).add(text, 15).finish();
+    assert(n == 7 + (2 + 255) + (2 + 16) + (1 + 15));
+    assert(MsgLite::Unpack(large, view) && view.len == 3);
+    const char* str;
+    size_t str_len;
+    assert(view.get(0, str, str_len) && str_len == 255 && str == (const char*)large.data + 9);
+    assert(view.get(2, str, str_len) && str_len == 15);
+    MsgLite::Object obj;
+    assert(!view.get(0, obj) && !view.get(1, obj) && view.get(2, obj) && obj.type == MsgLite::Object::String);
+
+    // Binary objects point into the frame, as in the default profile.
+    MsgLite::Blob blob = { (const uint8_t*)text, 238 };
+    builder.reset();
+    n = builder.add(blob).add(blob).add(1.0f).finish();
+    assert(n == 7 + 2 * (2 + 238) + 5);
+    assert(MsgLite::Unpack(large, view) && view.len == 3);
+    assert(view.get(1, obj) && obj.type == MsgLite::Object::Binary);
+    assert(obj.as.Binary.data == large.data + 7 + 240 + 2 && obj.as.Binary.len == 238);
+    MsgLite::Object blobs[3] = { blob, blob, 1.0f };
+    static uint8_t blob_frame[512];
+    assert(MsgLite::Pack(blobs, 3, blob_frame, sizeof(blob_frame)) == n && memcmp(blob_frame, large.data, n) == 0);
+    assert(check_large_unpacker(blob_frame, n, MsgLite::LARGE_MAX_MSG_LEN, 0) == 1);
+
+    // Errors are kept until finish().
+    builder.reset();
+    assert(builder.add(text).add(1.0).finish() == 0);
+    builder.reset();
+    assert(builder.add("nul\0", 4).finish() == 0);
+    builder.reset();
+    for (int ii = 0; ii < 2000; ++ii)
+        builder.add((uint16_t)ii);
+    assert(builder.finish() == 0);
+    uint8_t raw[16];
+    assert(MsgLite::LargeMessageBuilder(raw, 12).add(1.0f).finish() == 12);
+    assert(MsgLite::LargeMessageBuilder(raw, 11).add(1.0f).finish() == 0);
+
+    // Large records and default messages in one stream
+    static uint8_t data[1 << 20], lossy[2 << 20];
+    size_t len = 0;
+    for (uint32_t seq = 0; seq < 200; ++seq) {
+        if (seq % 2) {
+            len += large_record(data + len, sizeof(data) - len, seq, seq * 17 % 700);
+        } else {
+            MsgLite::Pack(link_message(seq), buf);
+            memcpy(data + len, buf.data, buf.len);
+            len += buf.len;
+        }
+    }
+    assert(check_large_unpacker(data, len, MsgLite::LARGE_MAX_MSG_LEN, 0) == 200);
+    assert(check_large_unpacker(data, len, MsgLite::LARGE_MAX_MSG_LEN, MsgLite::LARGE_MAX_MSG_LEN) == 200);
+    MsgLite::Unpacker unpacker(MsgLite::MAX_MSG_LEN, true);
+    size_t small = 0;
+    for (size_t pos = 0; pos < len; ++pos)
+        small += unpacker.put(data[pos]);
+    assert(small == 100);
+
+    // Records above max_msg_len are cut off, the next frame is still found.
+    assert(check_large_unpacker(data, len, 512, 0) == 133); // 33 records fit
+
+    // A broken string length that swallows the next frame: it is only found
+    // if the resync window holds all of it.
+    len = large_record(data, sizeof(data), 1, 300);
+    MsgLite::Pack(MsgLite::Message("swallowed"), buf);
+    memcpy(data + len, buf.data, buf.len);
+    data[len - 35] += buf.len;
+    len += buf.len;
+    size_t window = len - 1;
+    len += large_record(data + len, sizeof(data) - len, 2, 10);
+    assert(check_large_unpacker(data, len, MsgLite::LARGE_MAX_MSG_LEN, 0) == 1);
+    assert(check_large_unpacker(data, len, MsgLite::LARGE_MAX_MSG_LEN, 64) == 1);
+    assert(check_large_unpacker(data, len, MsgLite::LARGE_MAX_MSG_LEN, window - 1) == 1);
+    assert(check_large_unpacker(data, len, MsgLite::LARGE_MAX_MSG_LEN, window) == 2);
+
+    // Noisy link
+    len = 0;
+    for (uint32_t seq = 0; seq < 400; ++seq)
+        len += large_record(data + len, sizeof(data) - len, seq, seq % 500);
+    for (uint64_t seed = 1; seed <= 3; ++seed) {
+        double ber = 1e-5 * seed * seed;
+        MsgLite::ChannelErrors errors = { ber, ber / 8, ber / 8, ber / 64, 16 };
+        MsgLite::LossyChannel channel(errors, seed);
+        size_t lossy_len = channel.transmit(data, len, lossy);
+        size_t plain = check_large_unpacker(lossy, lossy_len, MsgLite::LARGE_MAX_MSG_LEN, 0);
+        size_t bounded = check_large_unpacker(lossy, lossy_len, MsgLite::LARGE_MAX_MSG_LEN, 256);
+        size_t full = check_large_unpacker(lossy, lossy_len, MsgLite::LARGE_MAX_MSG_LEN, MsgLite::LARGE_MAX_MSG_LEN);
+        assert(plain > 0 && plain <= bounded && bounded <= full && full <= 400);
+    }
+}
+#endif
+
+// Feeds a stream to an Unpacker and a DfaUnpacker, byte by byte and in
+// chunks, and checks they accept the same messages at the same bytes.
+size_t check_dfa_unpacker(const uint8_t* data, size_t len, uint8_t max_msg_len)
+{
+    static size_t ends[1 << 20];
+    MsgLite::Unpacker unpacker(max_msg_len);
+    MsgLite::DfaUnpacker bytewise(max_msg_len), bulk(max_msg_len);
+
+    size_t accepted = 0;
+    for (size_t pos = 0; pos < len; ++pos) {
+        bool ok = unpacker.put(data[pos]);
+        assert(bytewise.put(data[pos]) == ok);
+        if (ok) {
+            assert(bytewise.buf.len == unpacker.buf.len);
+            assert(memcmp(bytewise.buf.data, unpacker.buf.data, unpacker.buf.len) == 0);
+            assert(bytewise.get() == unpacker.get());
+            ends[accepted++] = pos;
+        }
+    }
+
+    size_t found = 0;
+    for (size_t pos = 0, chunk = 1; pos < len; chunk = chunk % 300 + 1) {
+        size_t n = chunk < len - pos ? chunk : len - pos;
+        for (size_t off = 0, consumed; off < n; off += consumed) {
+            if (bulk.put(data + pos + off, n - off, consumed)) {
+                assert(found < accepted && ends[found] == pos + off + consumed - 1);
+                assert(memcmp(bulk.buf.data, data + ends[found] + 1 - bulk.buf.len, bulk.buf.len) == 0);
+                found++;
+            }
+        }
+        pos += n;
+    }
+    assert(found == accepted);
+    return accepted;
+}
+
+void test_dfa_unpacker()
+{
+    static uint8_t data[4 << 20];
+    const char* paths[] = { "./test/data_static.bin", "./test/data_robustness.bin" };
+    for (const char* path : paths) {
+        FILE* fd = fopen(path, "rb");
+        size_t len = fread(data, 1, sizeof(data), fd);
+        fclose(fd);
+        const uint8_t limits[] = { MsgLite::MAX_MSG_LEN, 40, 12 };
+        for (uint8_t max_msg_len : limits)
+            check_dfa_unpacker(data, len, max_msg_len);
+    }
+
+    // Noisy links, and pure noise
+    for (uint64_t seed = 1; seed <= 4; ++seed) {
+        double ber = 1e-4 * seed * seed * seed;
+        MsgLite::ChannelErrors errors = { ber, ber / 8, ber / 8, ber / 64, 16 };
+        MsgLite::LossyChannel channel(errors, seed);
+        size_t len = 0;
+        for (uint32_t seq = 0; seq < 20000; ++seq)
+            len += channel.send(link_message(seq), data + len);
+        assert(check_dfa_unpacker(data, len, MsgLite::MAX_MSG_LEN) > 0);
+        for (size_t ii = 0; ii < len; ++ii)
+            data[ii] = (uint8_t)channel.random();
+        check_dfa_unpacker(data, len, MsgLite::MAX_MSG_LEN);
+    }
+
+    // Blobs, whose bytes are not run through the tables, clean and noisy
+    uint8_t samples[200];
+    for (size_t ii = 0; ii < sizeof(samples); ++ii)
+        samples[ii] = (uint8_t)(ii * 37);
+    for (uint64_t seed = 1; seed <= 2; ++seed) {
+        double ber = 1e-4 * seed;
+        MsgLite::ChannelErrors errors = { ber, ber / 8, ber / 8, ber / 64, 16 };
+        MsgLite::LossyChannel channel(errors, seed);
+        MsgLite::Buffer clean;
+        size_t len = 0, lossy_len = 0;
+        static uint8_t lossy[4 << 20];
+        for (uint32_t seq = 0; seq < 5000; ++seq) {
+            MsgLite::Pack(MsgLite::Message("b", seq, MsgLite::Blob { samples, (uint8_t)(seq % 200) }), clean);
+            memcpy(data + len, clean.data, clean.len);
+            len += clean.len;
+            lossy_len += channel.send(MsgLite::Message("b", seq, MsgLite::Blob { samples, (uint8_t)(seq % 200) }), lossy + lossy_len);
+        }
+        assert(check_dfa_unpacker(data, len, MsgLite::MAX_MSG_LEN) == 5000);
+        assert(check_dfa_unpacker(data, len, 100) > 0);
+        assert(check_dfa_unpacker(lossy, lossy_len, MsgLite::MAX_MSG_LEN) > 0);
+    }
+
+    // Odd frames: a length byte below 0x90 with a matching checksum resets
+    // at once, a mismatch drops the next byte, and so does a rejected byte.
+    MsgLite::Buffer msg;
+    MsgLite::Pack(MsgLite::Message("ok"), msg);
+    size_t len = 0;
+    const uint8_t below[] = { 0x92, 0xCE, 0, 0, 0, 0, 0x10 };
+    uint32_t crc = MsgLite::CRC32B(0, below + 6, 1);
+    memcpy(data + len, below, sizeof(below));
+    for (int ii = 0; ii < 4; ++ii)
+        data[len + 2 + ii] = crc >> (24 - 8 * ii);
+    len += sizeof(below);
+    memcpy(data + len, msg.data, msg.len);
+    len += msg.len;
+    memcpy(data + len, below, sizeof(below)); // checksum mismatch
+    len += sizeof(below);
+    memcpy(data + len, msg.data, msg.len); // header dropped
+    len += msg.len;
+    data[len++] = 0x92;
+    memcpy(data + len, msg.data, msg.len); // header dropped after 0x92
+    len += msg.len;
+    memcpy(data + len, msg.data, msg.len);
+    len += msg.len;
+    assert(check_dfa_unpacker(data, len, MsgLite::MAX_MSG_LEN) == 2);
+}
+
 void pedantic_checks()
 {
     test_object_constructors();
@@ -484,4 +2297,28 @@ void pedantic_checks()
     test_equality_comparison();
     test_checksum();
     test_parse();
+    test_message_view();
+    test_compact_message();
+    test_schema();
+    test_dispatcher();
+    test_batch_pack();
+    test_unpacker_pool();
+    test_message_ring();
+    test_reactor();
+    test_capture_reader();
+    test_capture_log();
+    test_unpacker_stats();
+    test_unpacker_timestamps();
+    test_latency_histogram();
+    test_lossy_channel();
+    test_resync_fuzz();
+    test_packer_queue();
+    test_wrapped_pack();
+    test_double_buffer();
+    test_message_builder();
+    test_binary();
+    test_dfa_unpacker();
+#ifdef MSGLITE_LARGE_MESSAGES
+    test_large_messages();
+#endif
 }